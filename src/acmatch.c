@@ -0,0 +1,518 @@
+/*
+ Copyright 2013-2025 Alexander Wittig. All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "acmatch.h"
+
+// Literals shorter than this are not selective enough to be worth it
+static const size_t AC_MIN_LITERAL = 3;
+
+// literal added to the automaton
+struct literal {
+    char* str;                  // Literal (lower case)
+    size_t len;                 // Length of literal
+    unsigned int id;            // Id reported when literal is found
+};
+
+// entry in the output lists of the automaton states
+struct output {
+    unsigned int id;            // Id of the literal
+    int next;                   // Next output for this state or -1
+};
+
+// the automaton
+struct acmatch {
+    struct literal* lits;       // Literals added so far
+    unsigned int nlits;         // Number of literals
+    unsigned int maxid;         // Largest id added plus one
+    unsigned char cls[256];     // Character class of each input byte
+    unsigned int ncls;          // Number of character classes
+    int* delta;                 // Transition table (nstates x ncls)
+    int* out;                   // First output of each state or -1
+    unsigned int nstates;       // Number of states
+    struct output* outs;        // Output list entries
+    unsigned int nouts;         // Number of output list entries
+};
+
+// literals found by the last scan (one per thread scanning with the automaton)
+struct ac_hits {
+    unsigned int* mark;         // Scan generation in which each id was last seen
+    unsigned int maxid;         // Number of ids
+    unsigned int gen;           // Current scan generation
+};
+
+// Create a new, empty automaton
+struct acmatch* ac_create( )
+{
+    return (struct acmatch*) calloc( 1, sizeof(struct acmatch) );
+}
+
+// Free an automaton and all its data
+void ac_free( struct acmatch* ac )
+{
+    unsigned int i;
+
+    if( !ac ) return;
+
+    for( i = 0; i < ac->nlits; i++ )
+        free( ac->lits[i].str );
+    free( ac->lits );
+    free( ac->delta );
+    free( ac->out );
+    free( ac->outs );
+    free( ac );
+}
+
+// Add a literal identified by id to the automaton (before ac_compile)
+int ac_add( struct acmatch* ac, const char* literal, size_t len, unsigned int id )
+{
+    struct literal* l;
+    size_t i;
+
+    if( !ac || len == 0 ) return 1;
+
+    l = (struct literal*) realloc( ac->lits, (ac->nlits+1)*sizeof(struct literal) );
+    if( !l ) return 1;
+    ac->lits = l;
+
+    l = &ac->lits[ac->nlits];
+    if( !(l->str = (char*) malloc( len )) ) return 1;
+    for( i = 0; i < len; i++ )
+        l->str[i] = tolower( (unsigned char)literal[i] );
+    l->len = len;
+    l->id = id;
+    ac->nlits++;
+    if( id >= ac->maxid ) ac->maxid = id+1;
+
+    return 0;
+}
+
+// Build the automaton from all added literals
+int ac_compile( struct acmatch* ac )
+{
+    unsigned int i, c, s, t, maxstates, head, tail;
+    int *own = NULL, *owntail = NULL, *fail = NULL, *queue = NULL;
+    size_t j;
+    int rc = 1;
+
+    if( !ac ) return 1;
+
+    // assign a character class to each byte occuring in a literal, all others share class 0
+    memset( ac->cls, 0, sizeof(ac->cls) );
+    ac->ncls = 1;
+    for( i = 0; i < ac->nlits; i++ )
+        for( j = 0; j < ac->lits[i].len; j++ )
+            if( ac->cls[(unsigned char)ac->lits[i].str[j]] == 0 )
+                ac->cls[(unsigned char)ac->lits[i].str[j]] = ac->ncls++;
+    // input is matched case insensitively
+    for( c = 0; c < 256; c++ )
+        ac->cls[c] = ac->cls[(unsigned char)tolower( c )];
+
+    // allocate enough states for the worst case (no shared prefixes)
+    maxstates = 1;
+    for( i = 0; i < ac->nlits; i++ )
+        maxstates += ac->lits[i].len;
+    ac->delta = (int*) malloc( maxstates*ac->ncls*sizeof(int) );
+    ac->out = (int*) malloc( maxstates*sizeof(int) );
+    ac->outs = (struct output*) malloc( (ac->nlits+1)*sizeof(struct output) );
+    own = (int*) malloc( maxstates*sizeof(int) );
+    owntail = (int*) malloc( maxstates*sizeof(int) );
+    fail = (int*) malloc( maxstates*sizeof(int) );
+    queue = (int*) malloc( maxstates*sizeof(int) );
+    if( !ac->delta || !ac->out || !ac->outs || !own || !owntail || !fail || !queue )
+        goto cleanup;
+
+    // build the trie (-1 marks missing transitions)
+    for( j = 0; j < maxstates*ac->ncls; j++ )
+        ac->delta[j] = -1;
+    ac->nstates = 1;
+    ac->nouts = 0;
+    own[0] = owntail[0] = -1;
+    for( i = 0; i < ac->nlits; i++ )
+    {
+        s = 0;
+        for( j = 0; j < ac->lits[i].len; j++ )
+        {
+            c = ac->cls[(unsigned char)ac->lits[i].str[j]];
+            if( ac->delta[s*ac->ncls+c] == -1 )
+            {
+                t = ac->nstates++;
+                own[t] = owntail[t] = -1;
+                ac->delta[s*ac->ncls+c] = t;
+            }
+            s = ac->delta[s*ac->ncls+c];
+        }
+        ac->outs[ac->nouts].id = ac->lits[i].id;
+        ac->outs[ac->nouts].next = own[s];
+        if( own[s] == -1 ) owntail[s] = ac->nouts;
+        own[s] = ac->nouts++;
+    }
+
+    // breadth first traversal to compute failure links and complete the transition table
+    head = tail = 0;
+    fail[0] = 0;
+    ac->out[0] = own[0];
+    for( c = 0; c < ac->ncls; c++ )
+    {
+        t = ac->delta[c];
+        if( (int)t == -1 )
+            ac->delta[c] = 0;
+        else
+        {
+            fail[t] = 0;
+            queue[tail++] = t;
+        }
+    }
+    while( head < tail )
+    {
+        s = queue[head++];
+
+        // outputs of a state are its own followed by those of its failure state
+        if( own[s] != -1 )
+        {
+            ac->outs[owntail[s]].next = ac->out[fail[s]];
+            ac->out[s] = own[s];
+        }
+        else
+            ac->out[s] = ac->out[fail[s]];
+
+        for( c = 0; c < ac->ncls; c++ )
+        {
+            t = ac->delta[s*ac->ncls+c];
+            if( (int)t == -1 )
+                ac->delta[s*ac->ncls+c] = ac->delta[fail[s]*ac->ncls+c];
+            else
+            {
+                fail[t] = ac->delta[fail[s]*ac->ncls+c];
+                queue[tail++] = t;
+            }
+        }
+    }
+
+    rc = 0;
+
+cleanup:
+    if( rc )
+    {
+        free( ac->delta );
+        free( ac->out );
+        free( ac->outs );
+        ac->delta = ac->out = NULL;
+        ac->outs = NULL;
+    }
+    free( own );
+    free( owntail );
+    free( fail );
+    free( queue );
+    return rc;
+}
+
+// Create the scan result for a compiled automaton
+struct ac_hits* ac_hits_create( const struct acmatch* ac )
+{
+    struct ac_hits* h;
+
+    if( !ac || !ac->delta ) return NULL;
+
+    h = (struct ac_hits*) calloc( 1, sizeof(struct ac_hits) );
+    if( !h ) return NULL;
+    h->mark = (unsigned int*) calloc( ac->maxid+1, sizeof(unsigned int) );
+    if( !h->mark )
+    {
+        free( h );
+        return NULL;
+    }
+    h->maxid = ac->maxid;
+
+    return h;
+}
+
+// Free a scan result
+void ac_hits_free( struct ac_hits* h )
+{
+    if( !h ) return;
+    free( h->mark );
+    free( h );
+}
+
+// Scan text and mark all ids whose literal occurs in it in h.
+// Returns the number of distinct ids found.
+unsigned int ac_scan( const struct acmatch* ac, struct ac_hits* h, const char* text, size_t len )
+{
+    const unsigned char *p = (const unsigned char*)text, *end = p+len;
+    unsigned int hits = 0, s = 0;
+    int o;
+
+    if( !ac || !ac->delta || !h ) return 0;
+
+    // start a new generation, clearing the marks on overflow
+    if( ++h->gen == 0 )
+    {
+        memset( h->mark, 0, h->maxid*sizeof(unsigned int) );
+        h->gen = 1;
+    }
+
+    for( ; p < end; p++ )
+    {
+        s = ac->delta[s*ac->ncls+ac->cls[*p]];
+        for( o = ac->out[s]; o != -1; o = ac->outs[o].next )
+            if( h->mark[ac->outs[o].id] != h->gen )
+            {
+                h->mark[ac->outs[o].id] = h->gen;
+                hits++;
+            }
+    }
+
+    return hits;
+}
+
+// Check if the literal of id was found by the last call to ac_scan with h
+int ac_hit( const struct ac_hits* h, unsigned int id )
+{
+    return h && (id < h->maxid) && (h->mark[id] == h->gen);
+}
+
+/* Literal extraction from regular expressions */
+
+// Skip a quantifier at exp[*i] (if any) and return its minimum repeat count or
+// -1 if there is none. Returns -2 if the quantifier could not be parsed.
+static int skipQuantifier( const char* exp, size_t* i )
+{
+    int min;
+
+    switch( exp[*i] )
+    {
+        case '?':
+        case '*':
+            min = 0;
+            (*i)++;
+            break;
+
+        case '+':
+            min = 1;
+            (*i)++;
+            break;
+
+        case '{':
+            if( !isdigit( (unsigned char)exp[*i+1] ) )
+                return -2;
+            min = strtol( &exp[*i+1], NULL, 10 );
+            while( exp[*i] && exp[*i] != '}' )
+                (*i)++;
+            if( exp[*i] != '}' )
+                return -2;
+            (*i)++;
+            break;
+
+        default:
+            return -1;
+    }
+
+    // lazy or possessive quantifier suffix (PCRE)
+    if( exp[*i] == '?' || exp[*i] == '+' )
+        (*i)++;
+
+    return min;
+}
+
+// Skip a bracket expression starting at exp[*i] == '['. Returns non-zero if
+// it cannot be skipped safely.
+static int skipBracket( const char* exp, size_t* i )
+{
+    size_t j = *i+1;
+
+    if( exp[j] == '^' ) j++;
+    if( exp[j] == ']' ) j++;
+    while( exp[j] && exp[j] != ']' )
+    {
+        // backslashes mean different things in POSIX and PCRE brackets
+        if( exp[j] == '\\' )
+            return 1;
+        // character classes, collating symbols and equivalence classes
+        if( exp[j] == '[' && exp[j+1] && strchr( ":.=", exp[j+1] ) )
+        {
+            char t = exp[j+1];
+            for( j += 2; exp[j] && !(exp[j] == t && exp[j+1] == ']'); j++ )
+                ;
+            if( !exp[j] ) return 1;
+            j += 2;
+        }
+        else
+            j++;
+    }
+    if( exp[j] != ']' )
+        return 1;
+
+    *i = j+1;
+    return 0;
+}
+
+// Skip a parenthesized group starting at exp[*i] == '('. Returns non-zero if
+// it cannot be skipped safely.
+static int skipGroup( const char* exp, size_t* i )
+{
+    size_t j = *i+1;
+    int depth = 1;
+
+    // inline options switching on extended mode change the meaning of the rest of the pattern
+    if( exp[j] == '?' )
+    {
+        size_t k;
+        for( k = j+1; exp[k] && exp[k] != ')' && exp[k] != ':'; k++ )
+            if( exp[k] == 'x' ) return 1;
+    }
+
+    while( exp[j] && depth > 0 )
+    {
+        switch( exp[j] )
+        {
+            case '\\':
+                if( !exp[j+1] ) return 1;
+                j += 2;
+                break;
+
+            case '[':
+                if( skipBracket( exp, &j ) ) return 1;
+                break;
+
+            case '(':
+                depth++;
+                j++;
+                break;
+
+            case ')':
+                depth--;
+                j++;
+                break;
+
+            default:
+                j++;
+                break;
+        }
+    }
+    if( depth > 0 )
+        return 1;
+
+    *i = j;
+    return 0;
+}
+
+// Extract the longest literal every match of the regular expression exp must
+// contain (lower case). Returns its length or 0 if none was found.
+// This errs on the safe side: whenever the pattern contains a construct that
+// is not fully understood, no literal is returned and the pattern is always
+// evaluated.
+size_t ac_literal( const char* exp, char* lit, size_t size )
+{
+    char run[256];
+    size_t i = 0, len = 0, best = 0;
+    int q;
+    char c;
+
+    if( size > sizeof(run) ) size = sizeof(run);
+
+    while( exp[i] )
+    {
+        c = exp[i];
+        switch( c )
+        {
+            case '\\':
+                c = exp[i+1];
+                // escaped punctuation is a literal character
+                if( c && !isalnum( (unsigned char)c ) )
+                {
+                    i += 2;
+                    break;
+                }
+                // simple PCRE character types and assertions
+                if( c && strchr( "dDwWsShHvVRNbBAZzGKX", c ) && exp[i+2] != '{' )
+                {
+                    i += 2;
+                    c = '\0';
+                    break;
+                }
+                // anything else (\x.., \p{..}, \Q..\E, back references) is not handled
+                return 0;
+
+            case '[':
+                if( skipBracket( exp, &i ) ) return 0;
+                c = '\0';
+                break;
+
+            case '(':
+                if( skipGroup( exp, &i ) ) return 0;
+                c = '\0';
+                break;
+
+            case '|':
+            case ')':
+                // alternations at the top level do not have a single required literal
+                return 0;
+
+            case '.':
+            case '^':
+            case '$':
+            case '*':
+            case '+':
+            case '?':
+            case '{':
+                i++;
+                c = '\0';
+                break;
+
+            default:
+                i++;
+                break;
+        }
+
+        // check for a quantifier following this atom
+        q = skipQuantifier( exp, &i );
+        if( q == -2 )
+            return 0;
+
+        // append literal character unless it is optional
+        if( c && q != 0 && len < size )
+            run[len++] = tolower( (unsigned char)c );
+
+        // remember the longest run so far
+        if( len > best )
+        {
+            memcpy( lit, run, len );
+            best = len;
+        }
+
+        // anything that is not a single literal character ends the current run
+        if( !c || q >= 0 )
+            len = 0;
+    }
+
+    return best >= AC_MIN_LITERAL ? best : 0;
+}
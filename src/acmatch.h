@@ -0,0 +1,59 @@
+/*
+ Copyright 2013-2025 Alexander Wittig. All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Case insensitive multi-literal prefilter (Aho-Corasick automaton) */
+
+struct acmatch;
+struct ac_hits;
+
+// Create a new, empty automaton
+struct acmatch* ac_create( );
+
+// Free an automaton and all its data
+void ac_free( struct acmatch* ac );
+
+// Add a literal identified by id to the automaton (before ac_compile)
+int ac_add( struct acmatch* ac, const char* literal, size_t len, unsigned int id );
+
+// Build the automaton from all added literals
+int ac_compile( struct acmatch* ac );
+
+// Create the scan result for a compiled automaton. The automaton itself is
+// not changed by scanning, so several threads can share it with one result each.
+struct ac_hits* ac_hits_create( const struct acmatch* ac );
+
+// Free a scan result
+void ac_hits_free( struct ac_hits* h );
+
+// Scan text and mark all ids whose literal occurs in it in h.
+// Returns the number of distinct ids found.
+unsigned int ac_scan( const struct acmatch* ac, struct ac_hits* h, const char* text, size_t len );
+
+// Check if the literal of id was found by the last call to ac_scan with h
+int ac_hit( const struct ac_hits* h, unsigned int id );
+
+// Extract the longest literal every match of the regular expression exp must
+// contain (lower case). Returns its length or 0 if none was found.
+size_t ac_literal( const char* exp, char* lit, size_t size );
@@ -27,6 +27,7 @@
 
 #define _WITH_GETLINE
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <err.h>
@@ -51,6 +52,14 @@
 #ifdef HAVE_LIBMD
 #include <sha256.h>
 #endif
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+// statistics are printed on SIGINFO, or on SIGUSR1 where there is none (Linux)
+#ifndef SIGINFO
+#define SIGINFO SIGUSR1
+#endif
 
 #ifdef HAVE_LIBPCRE2
     #define PCRE2_CODE_UNIT_WIDTH 8
@@ -60,15 +69,23 @@
 #endif
 
 #include "banlib.h"
+#include "acmatch.h"
+#include "linereader.h"
+#include "tail.h"
+#include "listener.h"
+#include "resolver.h"
+#include "radix.h"
 
 // flags for group
-const unsigned char BIF_CONTINUE   = 0x01;    // continue processing after hit
-const unsigned char BIF_SKIP       = 0x02;    // skip to next group after hit
-const unsigned char BIF_WARNFAIL   = 0x04;    // warn on hits after blocking
-const unsigned char BIF_BLOCKFAIL  = 0x08;    // keep blocking on hits after blocking
-const unsigned char BIF_WARNMAX    = 0x10;    // warn if maxblock is exceeded
-const unsigned char BIF_BLOCKMAX   = 0x20;    // block hosts if maxblock is reached
-const unsigned char BIF_BLOCKLOCAL = 0x40;    // also block local interfaces
+const unsigned int BIF_CONTINUE   = 0x001;    // continue processing after hit
+const unsigned int BIF_SKIP       = 0x002;    // skip to next group after hit
+const unsigned int BIF_WARNFAIL   = 0x004;    // warn on hits after blocking
+const unsigned int BIF_BLOCKFAIL  = 0x008;    // keep blocking on hits after blocking
+const unsigned int BIF_WARNMAX    = 0x010;    // warn if maxblock is exceeded
+const unsigned int BIF_BLOCKMAX   = 0x020;    // block hosts if maxblock is reached
+const unsigned int BIF_BLOCKLOCAL = 0x040;    // also block local interfaces
+const unsigned int BIF_COMBINE    = 0x080;    // match all pattern in a single pass
+const unsigned int BIF_EVICTMAX   = 0x100;    // evict a watched host if maxblock is reached
 
 // error numbers
 const unsigned int ERR_NO_ERROR       = 0;
@@ -77,6 +94,8 @@ const unsigned int ERR_INVALID_KEY    = 2;
 const unsigned int ERR_INVALID_VALUE  = 3;
 const unsigned int ERR_INVALID_REGEXP = 4;
 const unsigned int ERR_OUT_OF_MEMORY  = 5;
+const unsigned int ERR_INVALID_COMBINE = 6;
+const unsigned int ERR_INVALID_EXCLUDE = 7;
 
 // error messages
 const char* error_messages[] = {
@@ -89,27 +108,81 @@ const char* error_messages[] = {
 #else
     "Invalid regular expression or no matches defined (maybe not a POSIX regex?)",
 #endif
-    "Memory allocation failed"
+    "Memory allocation failed",
+    "Invalid group line (combine requires continue=no or continue=next)",
+    "Invalid group line (invalid exclude address, prefix or file)"
 };
 
-// linked list of hosts for watch list
+// linked list of hosts for watch list (kept small, as there can be millions)
+#define HOST_SIZE 256           // maximum length of a host name on the watch list (including '\0')
+#define HOST_MAX_COUNT 65535    // hit counts of hosts saturate at this value
+#define ADDR_SIZE (INET6_ADDRSTRLEN + 4)    // size of a printed address prefix (including '\0')
 struct host {
-    unsigned int count;         // Number of hits
-    time_t access_time;         // Time of first access
-    char* hostname;             // Name of the host (as matched by the regexp pattern)
     STAILQ_ENTRY(host) next;    // Singly linked list entry
+    union {
+        unsigned char addr[16]; // Address of the host if it is numeric (see parseAddress)
+        char* hostname;         // Name of the host otherwise (as matched by the regexp pattern, from name_slab)
+    };
+    unsigned int hash;          // Hash of the host name (for the watch list index)
+    int32_t access_time;        // Time of first access (relative to time_base)
+    uint16_t count;             // Number of hits
+    unsigned char hostlen;      // Length of the host name (0 for numeric addresses)
 };
 
 STAILQ_HEAD( _hosts, host );
 
+// host a group has put in its table (mirror of the tables, so hits of blocked hosts don't block them again)
+struct blocked {
+    union {
+        unsigned char addr[16]; // Blocked address prefix if it is numeric (see maskAddress)
+        char* hostname;         // Blocked host name otherwise (from name_slab)
+    };
+    unsigned int hash;          // Hash of the address prefix or host name
+    unsigned int table;         // Table it was added to
+    time_t expires;             // Time it expires from the table (0 for never)
+    unsigned char hostlen;      // Length of the host name (0 for numeric addresses)
+    unsigned char used;         // Slot is in use
+};
+
+// pool of fixed size records allocated in blocks, which are only returned to
+// the system all at once (used for host records and host names)
+#define HOST_CHUNK 256          // number of host records to add when none are left
+#define HOST_RESERVE 4096       // maximum number of host records to reserve up front
+#define NAME_CHUNK 32           // number of host names to add when none are left
+struct slabblock {
+    STAILQ_ENTRY(slabblock) next;   // Singly linked list entry
+    void* records[];                // Records in this block (aligned like pointers)
+};
+
+struct slab {
+    size_t size;                    // Size of one record
+    unsigned int chunk;             // Number of records to add when none are left
+    unsigned long count;            // Number of records in all blocks
+    void* free;                     // Unused records, linked through their first pointer
+    STAILQ_HEAD( , slabblock ) blocks;  // All blocks
+};
+
+// count-min sketch counting hits of hosts before they are admitted to the watch list
+#define SKETCH_DEPTH 4          // number of rows (independent hash functions)
+#define SKETCH_MIN 64           // minimum number of counters per row
+#define SKETCH_MAX (1 << 24)    // maximum number of counters per row
+#define SKETCH_GROWTH 16        // how many times its configured width a sketch may grow to
+
+// number of the oldest watched hosts to choose a host to evict from
+#define EVICT_SAMPLE 8
+
 // linked list of the regexps
 struct regexp {
 #ifdef HAVE_LIBPCRE2
     pcre2_code* re;             // Compiled pattern
+    int jit;                    // Pattern was successfully JIT compiled
 #else
     regex_t re;                 // Compiled pattern
 #endif
     char* exp;                  // Original pattern
+    int literal;                // Id of required literal in prefilter or -1 if always checked
+    unsigned int host;          // Capture group holding the host name
+    unsigned int capture;       // First capture group of this pattern within the combined pattern
     unsigned int matches;       // Statistics how often that pattern matched
     STAILQ_ENTRY(regexp) next;  // Singly linked list entry
 };
@@ -121,20 +194,114 @@ struct bgroup {
     unsigned int max_count;         // Number of hits before blocking
     time_t within_time;             // Time within which access has to happen
     time_t reset_time;              // Time to block IP for
+    time_t reblock_time;            // Time a new block has to outlast the current one of a blocked host to be renewed
     unsigned int table;             // IPFW table to add IP to
     unsigned int max_hosts;         // Maximum number of hosts allowed in watchlist
     unsigned int random;            // Maximum randomization of blocking time
-    unsigned char flags;            // Flags for this group
+    unsigned int prefix4;           // Prefix length to watch and block IPv4 addresses by (32 for single addresses)
+    unsigned int prefix6;           // Prefix length to watch and block IPv6 addresses by (128 for single addresses)
+    unsigned int flags;             // Flags for this group
+    char* program;                  // Only match messages by this syslog program (NULL for all lines)
     unsigned int reg_count;         // Number of regex pattern
     unsigned int host_count;        // Number of hosts in watch list
     struct _hosts hosts;            // Host watch list
+    struct host** index;            // Open addressing hash index over the watch list (NULL if empty)
+    unsigned int index_mask;        // Number of index slots minus one (a power of two)
+    unsigned int sketch_width;      // Counters per row of the admission sketch (0 if not used)
+    unsigned int sketch_limit;      // Counters per row the admission sketch may grow to
+    uint16_t* sketch;               // Admission sketch counters, current and previous period interleaved (NULL if not used)
+    unsigned int sketch_current;    // Which of each pair of counters belongs to the current period (0 or 1)
+    time_t sketch_period;           // Start of the current counting period of the sketch
+    unsigned long sketch_total[2];  // Hits counted in the sketch in each of the two periods
+    unsigned long sketch_hits;      // Statistics how many hits were only counted in the sketch
+    unsigned long sketch_admitted;  // Statistics how many hosts were admitted to the watch list by the sketch
+    unsigned long evicted;          // Statistics how many hosts were evicted from the full watch list
+    struct radix* exclude;          // Address prefixes never watched or blocked by this group (NULL if none)
+    unsigned long excluded;         // Statistics how many hits were from excluded addresses
+    unsigned long suppressed;       // Statistics how many blocks were skipped as the host was blocked already
     struct _regexps regexps;        // Regular expression list
+    struct regexp** branch;         // Pattern by branch of the combined pattern (NULL if not combined)
+#ifdef HAVE_LIBPCRE2
+    pcre2_code* combined;           // All pattern combined into one
+    int jit;                        // Combined pattern was successfully JIT compiled
+#else
+    regex_t combined;               // All pattern combined into one
+#endif
     STAILQ_ENTRY(bgroup) next;      // Singly linked list entry
 };
 
 // Single global head of the list of groups this program is operating on
 STAILQ_HEAD( _groups, bgroup ) groups;
 
+// fields of an RFC 3164 syslog header
+struct syslog_header {
+    const char* host;               // Host name
+    size_t hostlen;                 // Length of host name
+    const char* tag;                // Program tag
+    size_t taglen;                  // Length of program tag
+    long pid;                       // Process id or -1 if not given
+    size_t body;                    // Offset of the message body in the line
+};
+
+// list of groups that apply to messages from one syslog program
+struct dispatch {
+    char* program;                  // Program tag (NULL for lines by any other program)
+    unsigned int count;             // Number of groups
+    struct bgroup** groups;         // Groups in configuration order
+    STAILQ_ENTRY(dispatch) next;    // Singly linked list entry
+};
+
+STAILQ_HEAD( _dispatches, dispatch );
+
+// pattern that matched an input line, applied to the watch list in input order
+struct hit {
+    struct bgroup* group;           // Group of the pattern
+    struct regexp* regexp;          // Pattern that matched
+    const char* host;               // Host name (slice of the input line)
+    size_t hostlen;                 // Length of host name
+    int numeric;                    // Host name is a numeric address
+    int excluded;                   // Address is excluded from watching and blocking
+    unsigned char addr[16];         // Address of the host if it is numeric (see parseAddress)
+};
+
+// state needed to match lines (one per thread)
+struct matcher {
+#ifdef HAVE_LIBPCRE2
+    pcre2_general_context* gc;      // Allocator counting allocations while matching
+    pcre2_match_data* md;           // Match data
+    PCRE2_SIZE* ovector;            // Output vector of md
+    pcre2_match_context* mc;        // Match context with the JIT stack
+    pcre2_jit_stack* js;            // JIT stack (NULL if the default is used)
+    struct bgroup* combined;        // Group whose combined pattern is being matched
+#else
+    regmatch_t* pmatch;             // Match data
+    size_t nmatch;                  // Size of pmatch
+#endif
+    struct ac_hits* literals;       // Literals found by the prefilter in the current line
+    unsigned long allocations;      // Allocations made while matching
+};
+
+// batch of input lines and the hits found in them
+#define LINE_BATCH 64                       // maximum number of input lines per batch
+struct batch {
+    size_t count;                           // Number of lines
+    struct lr_line lines[LINE_BATCH];       // Lines
+    char* data;                             // Private copy of the lines (threaded mode only)
+    size_t datasize;                        // Size of data
+    struct hit* hits;                       // Hits in input order
+    size_t nhits;                           // Number of hits
+    unsigned long rejected;                 // Statistics: lines rejected by the prefilter
+    unsigned long noheader;                 // Statistics: lines without syslog header
+    unsigned long allocations;              // Statistics: allocations while matching
+    int done;                               // Batch was matched (threaded mode only)
+};
+
+// hash index from program tag to groups
+#define DISPATCH_SIZE 64
+static struct _dispatches dispatch_table[DISPATCH_SIZE];
+static struct dispatch* dispatch_default = NULL;     // groups for all other lines
+static int dispatch_programs = 0;                    // number of groups restricted to a program
+
 // global configuration options and their default
 int loglevel = 2;
 static char* root_dir = NULL;
@@ -149,28 +316,340 @@ static SHA256_CTX sha256_ctx = { 0 };
 static const char* state_file = NULL;
 #endif
 static const char* default_config_file = SYSCONFDIR "/banhammer.conf";
-static const struct bgroup default_group = { 4, 60, 600, 1, 0, 30, 0x04|0x10|0x20, 0, 0, { 0 }, { 0 } };
-// 4 hits within 60 seconds, block for 10 min in table 1, no watchlist limit, randomize time +-30%, warn if blocking failed and warn and block if maxhost exceeded, 0 references, 0 hosts on watch, and two empty lists
+static const size_t default_max_line = 8192;  // default maximum length of input lines
+static size_t max_line = 8192;                // maximum length of input lines, longer ones are cut off
+static struct linereader* input = NULL;       // buffered standard input (kept across SIGHUP)
+#define MAX_FOLLOW 64                          // maximum number of followed log files
+static const char* follow_files[MAX_FOLLOW];  // log files to follow instead of reading standard input
+static unsigned int follow_count = 0;         // number of log files to follow
+static struct tail* tail = NULL;              // followed log files (kept across SIGHUP)
+static const char* offsets_file = NULL;       // file to save the offsets of followed log files in
+#define MAX_LISTEN 16                          // maximum number of syslog sockets
+static const char* listen_addresses[MAX_LISTEN];   // sockets to receive syslog messages on instead of reading standard input
+static unsigned int listen_count = 0;         // number of syslog sockets
+static struct listener* listener = NULL;      // syslog sockets (kept across SIGHUP)
+static volatile sig_atomic_t caught_signal = 0;    // last signal asking to reload or stop
+static volatile sig_atomic_t caught_info = 0;      // statistics were asked for by SIGINFO
+static unsigned int max_hits = 0;             // maximum number of hits in one line
+#ifdef HAVE_LIBPTHREAD
+#define MAX_THREADS 64                         // maximum number of matching threads
+static unsigned int threads = 1;              // number of matching threads (1 matches in the main thread)
+#define MAX_RESOLVERS 32                       // maximum number of resolving threads
+static unsigned int resolvers = 2;            // number of threads resolving host names (0 resolves them in the main thread)
+#endif
+#define RESOLVER_CACHE 4096                    // number of resolved host names cached
+#define RESOLVER_TTL 300                       // time resolved addresses are cached for
+#define RESOLVER_NEGTTL 60                     // time host names that failed to resolve are cached for
+static struct resolver* resolver = NULL;      // host name resolver (kept across SIGHUP)
+#ifdef HAVE_LIBPTHREAD
+#define WRITER_BATCH 256                       // most addresses added to a firewall table at once
+#define WRITER_WAIT 50                         // milliseconds to wait for more addresses before adding them
+static int writer = 0;                        // firewall writer thread is running (kept across SIGHUP)
+#endif
+static struct radix* exclude = NULL;          // address prefixes never watched or blocked by any group (NULL if none)
+#define MAX_EXCLUDE 16                         // maximum number of exclude options per group
+static struct acmatch* prefilter = NULL;      // literal prefilter over all pattern
+static unsigned int literal_count = 0;        // number of pattern with a literal in the prefilter
+static unsigned int unfiltered_count = 0;     // number of pattern without a literal
+static unsigned long lines_read = 0;          // statistics: lines read from input
+static unsigned long lines_rejected = 0;      // statistics: lines rejected by the prefilter
+static unsigned long lines_noheader = 0;      // statistics: lines without a syslog header
+static unsigned long allocations = 0;         // statistics: heap allocations while matching
+static struct slab host_slab = { sizeof(struct host), HOST_CHUNK, 0, NULL, STAILQ_HEAD_INITIALIZER( host_slab.blocks ) };    // all host records
+static struct slab name_slab = { HOST_SIZE, NAME_CHUNK, 0, NULL, STAILQ_HEAD_INITIALIZER( name_slab.blocks ) };           // names of hosts that are not numeric
+static time_t time_base = 0;                  // time host access times are relative to
+static struct blocked* blocked_set = NULL;    // hosts put in the tables (open addressing hash table, NULL if empty)
+static unsigned int blocked_mask = 0;         // number of slots of the blocked set minus one (a power of two)
+static unsigned int blocked_count = 0;        // number of used slots (including expired hosts)
+#ifdef HAVE_LIBPCRE2
+static const PCRE2_SIZE jit_stack_start = 32*1024;     // initial size of the JIT stack
+static const PCRE2_SIZE jit_stack_max = 512*1024;      // maximum size of the JIT stack
+#endif
+// 4 hits within 60 seconds, block for 10 min (renewed if at least 1 min longer) in table 1, no watchlist limit,
+// randomize time +-30%, single addresses, warn if blocking failed and warn and block if maxhost exceeded,
+// all other fields (lists, index, sketch, exclusions, statistics) empty
+static const struct bgroup default_group = {
+    .max_count = 4,
+    .within_time = 60,
+    .reset_time = 600,
+    .reblock_time = 60,
+    .table = 1,
+    .max_hosts = 0,
+    .random = 30,
+    .prefix4 = 32,
+    .prefix6 = 128,
+    .flags = 0x04|0x10|0x20
+};
 
-#ifndef HAVE_LIBPCRE2
-// Extract a match from regexp result
-static int regexGetSubstring( const char* line, regmatch_t* pmatch, char** hostname )
+#ifdef HAVE_LIBPCRE2
+// Find capture group n of the last match as a slice of the subject (no copy is made)
+static int pcreGetSubstring( const char* subject, const PCRE2_SIZE* ovector, int rc, unsigned int n, const char** host, size_t* hostlen )
 {
-    // there is no match (both are -1) or it is empty (both equal)
-    if( pmatch->rm_so >= pmatch->rm_eo )
+    // the group did not participate in the match or it is empty
+    if( (n >= (unsigned int)rc) || (ovector[2*n] == PCRE2_UNSET) || (ovector[2*n] >= ovector[2*n+1]) )
         return 0;
 
-    *hostname = (char*) calloc( pmatch->rm_eo - pmatch->rm_so + 1, sizeof(char) );
-    if( !*hostname )
+    *host = &subject[ovector[2*n]];
+    *hostlen = ovector[2*n+1] - ovector[2*n];
+
+    return 1;
+}
+
+// Memory allocator for PCRE2 that counts the allocations made while matching
+// (in the counter data points to, so each thread can have its own)
+static void* pcreMalloc( PCRE2_SIZE size, void* data )
+{
+    (*(unsigned long*)data)++;
+    return malloc( size );
+}
+
+static void pcreFree( void* ptr, void* data )
+{
+    (void)data;
+    free( ptr );
+}
+
+// Callout at the start of branch n-1 of a combined pattern, which fails the
+// branch right away if the prefilter did not find its required literal
+static int pcreBranch( pcre2_callout_block* cb, void* data )
+{
+    struct matcher* m = (struct matcher*)data;
+    struct bgroup* g = m->combined;
+    unsigned int k = cb->callout_number - 1;
+
+    return g && (k < g->reg_count) && (g->branch[k]->literal >= 0) && !ac_hit( m->literals, g->branch[k]->literal );
+}
+#else
+// Find a match from regexp result as a slice of the subject (no copy is made)
+static int regexGetSubstring( const char* subject, const regmatch_t* pmatch, const char** host, size_t* hostlen )
+{
+    // there is no match (both are -1) or it is empty (both equal)
+    if( (pmatch->rm_so < 0) || (pmatch->rm_so >= pmatch->rm_eo) )
         return 0;
 
-    strncpy( *hostname, &line[pmatch->rm_so], pmatch->rm_eo - pmatch->rm_so );
-    (*hostname)[pmatch->rm_eo - pmatch->rm_so] = '\0';
+    *host = &subject[pmatch->rm_so];
+    *hostlen = pmatch->rm_eo - pmatch->rm_so;
 
     return 1;
 }
 #endif
 
+// Add a block of n records to the unused records of a slab
+static int slabReserve( struct slab* sl, unsigned int n )
+{
+    struct slabblock* b;
+    char* r;
+    unsigned int i;
+
+    b = (struct slabblock*) malloc( sizeof(struct slabblock) + n*sl->size );
+    if( !b )
+        return 1;
+
+    STAILQ_INSERT_TAIL( &sl->blocks, b, next );
+    sl->count += n;
+    for( i = 0, r = (char*)b->records; i < n; i++, r += sl->size )
+    {
+        *(void**)r = sl->free;
+        sl->free = r;
+    }
+
+    return 0;
+}
+
+// Take an unused record, only allocating more if there are none left
+static void* slabAlloc( struct slab* sl )
+{
+    void* r;
+
+    if( !sl->free )
+    {
+        allocations++;
+        if( slabReserve( sl, sl->chunk ) )
+            return NULL;
+    }
+
+    r = sl->free;
+    sl->free = *(void**)r;
+
+    return r;
+}
+
+// Return a record to the unused records of a slab
+static void slabFree( struct slab* sl, void* r )
+{
+    *(void**)r = sl->free;
+    sl->free = r;
+}
+
+// Release all records of a slab at once
+static void slabRelease( struct slab* sl )
+{
+    struct slabblock* b;
+
+    while( !STAILQ_EMPTY( &sl->blocks ) )
+    {
+        b = STAILQ_FIRST( &sl->blocks );
+        STAILQ_REMOVE_HEAD( &sl->blocks, next );
+        free( b );
+    }
+    sl->free = NULL;
+    sl->count = 0;
+}
+
+// Return a host record and its name to the unused records
+static void freeHost( struct host* h )
+{
+    if( h->hostlen )
+        slabFree( &name_slab, h->hostname );
+    slabFree( &host_slab, h );
+}
+
+// hash function for host names (FNV-1a)
+static unsigned int hashHost( const char* host, size_t len )
+{
+    unsigned int h = 2166136261u;
+
+    while( len-- > 0 )
+        h = (h ^ (unsigned char)*host++) * 16777619u;
+
+    return h;
+}
+
+// Make room in the watch list index of g for n hosts, keeping it at most half full
+static int sizeIndex( struct bgroup* g, unsigned int n )
+{
+    struct host **index, *h;
+    unsigned int size, i;
+
+    if( g->index && (2*n <= g->index_mask + 1) )
+        return 0;
+
+    for( size = 64; size < 2*n; size *= 2 )
+        ;
+    if( !(index = (struct host**) calloc( size, sizeof(struct host*) )) )
+        return 1;
+
+    // insert all watched hosts again
+    STAILQ_FOREACH( h, &g->hosts, next )
+    {
+        for( i = h->hash & (size-1); index[i]; i = (i+1) & (size-1) )
+            ;
+        index[i] = h;
+    }
+    free( g->index );
+    g->index = index;
+    g->index_mask = size - 1;
+
+    return 0;
+}
+
+// Find a host on the watch list of g by its numeric address (if addr is not
+// NULL) or its name, and its hash (NULL if not watched)
+static struct host* findHost( const struct bgroup* g, const unsigned char* addr, const char* host, size_t hostlen, unsigned int hash )
+{
+    struct host* h;
+    unsigned int i;
+
+    if( !g->index )
+        return NULL;
+
+    for( i = hash & g->index_mask; (h = g->index[i]); i = (i+1) & g->index_mask )
+        if( (h->hash == hash) && (addr ? (h->hostlen == 0) && (memcmp( h->addr, addr, 16 ) == 0) :
+                                         (h->hostlen == hostlen) && (memcmp( h->hostname, host, hostlen ) == 0)) )
+            return h;
+
+    return NULL;
+}
+
+// Set the address or name of a host record and its hash
+static int nameHost( struct host* h, const unsigned char* addr, const char* host, size_t hostlen )
+{
+    if( addr )
+    {
+        memcpy( h->addr, addr, 16 );
+        h->hostlen = 0;
+        h->hash = hashHost( (const char*)addr, 16 );
+    }
+    else
+    {
+        if( !(h->hostname = slabAlloc( &name_slab )) )
+            return 1;
+        h->hostlen = hostlen;
+        memcpy( h->hostname, host, hostlen );
+        h->hostname[hostlen] = '\0';
+        h->hash = hashHost( host, hostlen );
+    }
+
+    return 0;
+}
+
+// Time of first access of a watched host
+static time_t hostTime( const struct host* h )
+{
+    return time_base + h->access_time;
+}
+
+// Printable name of a host watched by g (buf must have room for ADDR_SIZE characters)
+static const char* hostName( const struct bgroup* g, const struct host* h, char* buf, size_t size )
+{
+    unsigned char addr[16];
+
+    if( h->hostlen )
+        return h->hostname;
+    memcpy( addr, h->addr, 16 );
+    return formatPrefix( h->addr, maskAddress( addr, g->prefix4, g->prefix6 ), buf, size );
+}
+
+// Append a host record to the end of the watch list of g and to its index
+static int watchHost( struct bgroup* g, struct host* h )
+{
+    unsigned int i;
+
+    if( sizeIndex( g, g->host_count + 1 ) )
+        return 1;
+
+    for( i = h->hash & g->index_mask; g->index[i]; i = (i+1) & g->index_mask )
+        ;
+    g->index[i] = h;
+    STAILQ_INSERT_TAIL( &g->hosts, h, next );
+    g->host_count++;
+
+    return 0;
+}
+
+// Remove a host record from the watch list of g and its index (only fast for
+// hosts near the beginning of the list, as the list is singly linked)
+static struct host* unwatchHost( struct bgroup* g, struct host* h )
+{
+    unsigned int i, j, k;
+
+    STAILQ_REMOVE( &g->hosts, h, host, next );
+    g->host_count--;
+
+    // find its slot, then move later entries of the same probe sequence back
+    // into the gap instead of leaving a tombstone
+    for( i = h->hash & g->index_mask; g->index[i] != h; i = (i+1) & g->index_mask )
+        ;
+    for( j = (i+1) & g->index_mask; g->index[j]; j = (j+1) & g->index_mask )
+    {
+        k = g->index[j]->hash & g->index_mask;
+        if( (i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j)) )
+            continue;
+        g->index[i] = g->index[j];
+        i = j;
+    }
+    g->index[i] = NULL;
+
+    return h;
+}
+
+// Release all host records and names at once
+static void freeHosts( )
+{
+    slabRelease( &host_slab );
+    slabRelease( &name_slab );
+}
+
 // Show help
 static void usage( )
 {
@@ -181,6 +660,10 @@ static void usage( )
 #endif
 #ifdef HAVE_LIBMD
           "[-S statefile] "
+#endif
+          "[-l length] [-x exclude [-x ...]] [-F logfile [-F ...] [-o offsetfile] | -L address [-L ...]] "
+#ifdef HAVE_LIBPTHREAD
+          "[-t threads] [-r resolvers] "
 #endif
           "-f config_file [-f ...]\n"
           " --help, -h\n\t\tprint this message and exit\n"
@@ -195,11 +678,21 @@ static void usage( )
 #endif
 #ifdef HAVE_LIBMD
           " --statefile, -S\n\t\tsave and restore banned host state in file\n"
+#endif
+          " --maxline, -l\n\t\tcut off input lines longer than this (default: %lu)\n"
+          " --exclude, -x\n\t\tnever watch or block this address or prefix, or the ones listed in\n\t\tthis file (repeat for more)\n"
+          " --follow, -F\n\t\tfollow this log file instead of reading stdin (repeat for more)\n"
+          " --offsets, -o\n\t\tsave and restore the read offsets of followed log files in file\n"
+          " --listen, -L\n\t\treceive syslog messages on this UNIX socket path or UDP [host:]port\n"
+          "\t\tinstead of reading stdin (repeat for more)\n"
+#ifdef HAVE_LIBPTHREAD
+          " --threads, -t\n\t\tnumber of threads matching input lines (default: 1)\n"
+          " --resolvers, -r\n\t\tnumber of threads resolving host names (default: 2)\n"
 #endif
           " --file, -f\n\t\tconfiguration file with pattern to match against\n"
           "\t\t(default if none specified: %s)\n"
           "\nFor more details see banhammer(1).\n",
-          default_config_file );
+          (unsigned long)default_max_line, default_config_file );
 }
 
 // Show version information
@@ -209,37 +702,70 @@ static void version( )
 #ifdef HAVE_LIBPCRE2
 #define _STRINGIFY(x) #x
 #define STRINGIFY(x) _STRINGIFY(x)
-    char ver[64];
+    char ver[64], target[64];
+    uint32_t jit = 0;
     pcre2_config( PCRE2_CONFIG_VERSION, ver );
+    if( pcre2_config( PCRE2_CONFIG_JIT, &jit ) != 0 || !jit || pcre2_config( PCRE2_CONFIG_JITTARGET, target ) < 0 )
+        jit = 0;
     fprintf( stderr,
         "Built with PCRE regular expressions.\n"
         "\tCompiled with PCRE version:\t%i.%i %s\n"
-        "\tLinked with PCRE version:\t%s\n",
-        PCRE2_MAJOR, PCRE2_MINOR, STRINGIFY(PCRE2_DATE), ver );
+        "\tLinked with PCRE version:\t%s\n"
+        "\tJIT compilation:\t\t%s%s\n",
+        PCRE2_MAJOR, PCRE2_MINOR, STRINGIFY(PCRE2_DATE), ver,
+        jit ? "active, " : "not available", jit ? target : "" );
 #else
     fprintf( stderr, "Built with POSIX regular expressions.\n" );
 #endif
 #ifdef WITH_IPV6
-    fprintf( stderr, "Built with IPv6 support via IPFW 3.\n" );
+    fprintf( stderr, "Built with IPv6 support.\n" );
 #else
-    fprintf( stderr, "Built with IPv4 support only via IPFW 3.\n" );
+    fprintf( stderr, "Built with IPv4 support only.\n" );
 #endif
+    fprintf( stderr, "Built with firewalls:%s%s sim (using %s).\n",
+#ifdef HAVE_IPFW3
+        " ipfw",
+#else
+        "",
+#endif
+#ifdef HAVE_LINUX_NETFILTER_NF_TABLES_H
+        " nft",
+#else
+        "",
+#endif
+        fw_name( ) );
 #ifdef WITH_USERS
     fprintf( stderr, "Built with support to drop priviliges.\n" );
 #endif
 #ifdef HAVE_LIBMD
     fprintf( stderr, "Built with support to save and restore state.\n" );
+#endif
+#ifdef HAVE_LIBPTHREAD
+    fprintf( stderr, "Built with support for multi-threaded matching (up to %d threads).\n", MAX_THREADS );
+    fprintf( stderr, "Built with support for resolving host names in the background (up to %d threads).\n", MAX_RESOLVERS );
+#endif
+#if defined(HAVE_KQUEUE)
+    fprintf( stderr, "Built with kqueue notifications for followed log files.\n" );
+#elif defined(HAVE_INOTIFY_INIT1)
+    fprintf( stderr, "Built with inotify notifications for followed log files.\n" );
+#else
+    fprintf( stderr, "Built with polling for followed log files.\n" );
+#endif
+#ifdef HAVE_RECVMMSG
+    fprintf( stderr, "Built with batched reception of syslog messages (recvmmsg).\n" );
 #endif
     fprintf( stderr,
         "\n"
         "Default config file: %s\n"
         "Default chroot dir:  %s\n"
         "Default logging level:  %d\n"
+        "Default max line length:  %lu\n"
         "Default blocking settings:\n"
         "\ttable = %d\n"
         "\tcount = %d\n"
         "\twithin = %ld seconds\n"
         "\treset = %ld seconds\n"
+        "\treblock = %ld seconds\n"
         "\trandom = %d %%\n"
         "\tonfail = %s\n"
         "\twarnfail = %s\n"
@@ -247,163 +773,707 @@ static void version( )
         "\tmaxhosts = %d\n"
         "\tonmax = %s\n"
         "\twarnmax = %s\n"
-        "\tblocklocal = %s\n",
+        "\tblocklocal = %s\n"
+        "\tcombine = %s\n"
+        "\tprefix4 = %u\n"
+        "\tprefix6 = %u\n"
+        "\tsketch = %u\n"
+        "\tprogram = %s\n",
         default_config_file ? default_config_file : "(none)",
         root_dir ? root_dir : "(none)",
         loglevel,
+        (unsigned long)default_max_line,
         default_group.table, default_group.max_count, default_group.within_time,
-        default_group.reset_time, default_group.random,
+        default_group.reset_time, default_group.reblock_time, default_group.random,
         (default_group.flags & BIF_BLOCKFAIL) ? "block" : "ignore",
         (default_group.flags & BIF_WARNFAIL) ? "yes" : "no",
         (default_group.flags & BIF_CONTINUE) ?
             ((default_group.flags & BIF_SKIP) ? "next" : "yes") : "no",
         default_group.max_hosts,
-        (default_group.flags & BIF_BLOCKMAX) ? "block" : "ignore",
+        (default_group.flags & BIF_BLOCKMAX) ? "block" : ((default_group.flags & BIF_EVICTMAX) ? "evict" : "ignore"),
         (default_group.flags & BIF_WARNMAX) ? "yes" : "no",
-        (default_group.flags & BIF_BLOCKLOCAL) ? "yes" : "no"
+        (default_group.flags & BIF_BLOCKLOCAL) ? "yes" : "no",
+        (default_group.flags & BIF_COMBINE) ? "yes" : "no",
+        default_group.prefix4,
+        default_group.prefix6,
+        default_group.sketch_width,
+        default_group.program ? default_group.program : "(any)"
     );
 }
 
-// Walk the groups host list and delete old entries on the way. If we find the
-// given host name: bump it up and if necessary block it. If we don't find it,
-// add it.
-static int checkHost( const char *host, struct bgroup* g )
+// Find a host in the blocked set, even if it expired already
+static struct blocked* findBlocked( const unsigned char* addr, const char* host, size_t hostlen, unsigned int hash, unsigned int table )
 {
-    time_t ct = time( NULL ), rt = g->reset_time, bt = 0;
-    struct host *ptr;
+    struct blocked* b;
+    unsigned int i;
 
-    // clean expired hosts from the beginning of the watch list (always ordered by access time)
-    while( !STAILQ_EMPTY( &g->hosts ) )
-    {
-        ptr = STAILQ_FIRST( &g->hosts );
-        if( ptr->access_time + g->within_time < ct )
-        {
-            if( loglevel >= 3 )
-               printLog( LOG_DEBUG, "Removed host '%s' from watch list", ptr->hostname );
+    if( !blocked_set )
+        return NULL;
 
-            // Remove and free this entry
-            STAILQ_REMOVE_HEAD( &g->hosts, next );
-            g->host_count--;
-            free( ptr->hostname );
-            free( ptr );
-        }
-        else
-            // From here on out all entries are legitimate, stop searching
-            break;
+    for( i = hash & blocked_mask; blocked_set[i].used; i = (i + 1) & blocked_mask )
+    {
+        b = &blocked_set[i];
+        if( (b->hash == hash) && (b->table == table) && (b->hostlen == (addr ? 0 : hostlen)) &&
+            (addr ? !memcmp( b->addr, addr, 16 ) : !memcmp( b->hostname, host, hostlen )) )
+            return b;
     }
 
-    // randomize reset time if needed
-    if( rt > 0 )
+    return NULL;
+}
+
+// Make room in the blocked set for one more host, keeping it at most half full.
+// Expired hosts are dropped whenever the set is rebuilt.
+static int sizeBlocked( time_t ct )
+{
+    struct blocked *old = blocked_set, *b;
+    unsigned int i, j, n = 0, size;
+
+    if( blocked_set && (2*(blocked_count + 1) <= blocked_mask + 1) )
+        return 0;
+
+    for( i = 0; old && (i <= blocked_mask); i++ )
+        if( old[i].used && ((old[i].expires == 0) || (old[i].expires > ct)) )
+            n++;
+    for( size = 16; size < 4*(n + 1); size *= 2 )
+        ;
+    if( !(blocked_set = (struct blocked*) calloc( size, sizeof(struct blocked) )) )
     {
-        rt += (((random( )&0xFFFF)-0x8000)*g->random*rt)/(100*0xFFFF);
-        bt = ct+rt;
+        blocked_set = old;
+        return 1;
     }
+    allocations++;
 
-    // check if the host matches one already on the watch list
-    STAILQ_FOREACH( ptr, &g->hosts, next )
-        if( strcmp( host, ptr->hostname ) == 0 )
+    for( i = 0; old && (i <= blocked_mask); i++ )
+    {
+        b = &old[i];
+        if( !b->used )
+            continue;
+        if( (b->expires != 0) && (b->expires <= ct) )
         {
-            ptr->count++;
-            if( loglevel >= 3 )
-               printLog( LOG_DEBUG, "Increased hit count for host '%s' to %i.", host, ptr->count );
-
-            if( ptr->count == g->max_count )
-                addHostLong( host, bt, g->table, rt, g->flags & BIF_BLOCKLOCAL );
-            else if( ptr->count > g->max_count )
-            {
-                if( (loglevel >= 1) && (g->flags & BIF_WARNFAIL) && (ptr->count == g->max_count + 1) )
-                    printLog( LOG_WARNING, "Hit from blocked host '%s'.", host );
-                if( g->flags & BIF_BLOCKFAIL )
-                    addHostLong( host, bt, g->table, rt, g->flags & BIF_BLOCKLOCAL );
-            }
-            return 1;
+            if( b->hostlen )
+                slabFree( &name_slab, b->hostname );
+            continue;
         }
+        for( j = b->hash & (size - 1); blocked_set[j].used; j = (j + 1) & (size - 1) )
+            ;
+        blocked_set[j] = *b;
+    }
+    free( old );
+    blocked_mask = size - 1;
+    blocked_count = n;
 
-    // We are through and nothing was found. Check if max number of hosts has been reached
-    if( (g->max_hosts > 0) && (g->host_count >= g->max_hosts) )
-    {
-        if( (loglevel >= 1) && (g->flags & BIF_WARNMAX) )
-            printLog( LOG_NOTICE, "Maximum number of watched hosts exceeded." );
+    return 0;
+}
 
-        // block the host preemptively if requested
-        if( g->flags & BIF_BLOCKMAX )
+// Remember that a host was put in a table until bt (0 for ever)
+static void rememberBlocked( struct blocked* b, const unsigned char* addr, const char* host, size_t hostlen, unsigned int hash, unsigned int table, time_t bt, time_t ct )
+{
+    unsigned int i;
+    char* name = NULL;
+
+    if( !b )
+    {
+        if( (!addr && !(name = slabAlloc( &name_slab ))) || sizeBlocked( ct ) )
         {
-            if( loglevel >= 2 )
-                printLog( LOG_NOTICE, "Preemptively blocking host '%s'.", host );
-            addHostLong( host, bt, g->table, rt, g->flags & BIF_BLOCKLOCAL );
+            // not remembering it only costs another block next time
+            if( name )
+                slabFree( &name_slab, name );
+            return;
         }
+        for( i = hash & blocked_mask; blocked_set[i].used; i = (i + 1) & blocked_mask )
+            ;
+        b = &blocked_set[i];
+        if( addr )
+            memcpy( b->addr, addr, 16 );
         else
-            if( loglevel >= 2 )
-                printLog( LOG_NOTICE, "Ignoring host '%s'.", host );
-    }
-    else
-    {
-        if( (ptr = (struct host*) malloc( sizeof(struct host) )) == NULL )
         {
-            if( loglevel >= 1 )
-                printLog( LOG_ERR, "Out of memory, ignoring host '%s'.", host );
-            return -1;
+            memcpy( name, host, hostlen );
+            name[hostlen] = '\0';
+            b->hostname = name;
         }
+        b->hash = hash;
+        b->table = table;
+        b->hostlen = addr ? 0 : hostlen;
+        b->used = 1;
+        blocked_count++;
+    }
+    b->expires = bt;
+}
 
-        g->host_count++;
-        ptr->count = 1;
-        ptr->access_time = ct;
-        ptr->hostname = strdup( host );
-
-        STAILQ_INSERT_TAIL( &g->hosts, ptr, next );
+// Forget the hosts the writer or resolver threads failed to block after they
+// were remembered, so they are blocked again on their next hit
+static void forgetFailed( )
+{
+    struct fw_failure f;
+    struct blocked* b;
+    size_t hostlen;
+    unsigned int i;
+    int rc;
 
-        if( loglevel >= 3 )
-            printLog( LOG_DEBUG, "Added host '%s' to watch list.", host );
+    while( (rc = fw_failure( &f )) )
+    {
+        b = NULL;
+        hostlen = strlen( f.host );
+        if( rc > 0 )
+            b = hostlen ? findBlocked( NULL, f.host, hostlen, hashHost( f.host, hostlen ), f.table ) :
+                          findBlocked( f.addr, NULL, 0, hashHost( (const char*)f.addr, 16 ), f.table );
+        if( b )
+        {
+            // expired entries are dropped when the set is rebuilt
+            b->expires = 1;
+            continue;
+        }
 
-        // just checking if someone is really cruel
-        if( ptr->count == g->max_count )
-            addHostLong( host, bt, g->table, rt, g->flags & BIF_BLOCKLOCAL );
+        // some failures were lost, or it is one of the addresses of a host
+        // name, which could be any of the host names in the table
+        for( i = 0; blocked_set && (i <= blocked_mask); i++ )
+            if( blocked_set[i].used && ((rc < 0) || (blocked_set[i].hostlen && (blocked_set[i].table == f.table))) )
+                blocked_set[i].expires = 1;
     }
-
-    return 0;
 }
 
-// print diagnostics and statistics about the current status of the program
-void printTable( )
+// Block a host in the table of group g, resolving it only if it is no numeric
+// address. Numeric addresses are blocked with the prefix length of the group,
+// host names are handed to the resolver, which may block them later with the
+// same prefix length and exclusions.
+// Hosts the group put in its table already are only blocked again if the new
+// block lasts at least reblock seconds longer. Blocks that are queued count as
+// done until the thread they were queued for reports them failed.
+static int blockHost( struct bgroup* g, const unsigned char* addr, const char* host, time_t bt, time_t rt )
 {
-    struct host *h;
-    struct regexp *r;
-    struct bgroup *g;
-    int now = time( NULL );
+    unsigned char prefix[16];
+    unsigned int masklen = 128, hash;
+    char name[ADDR_SIZE];
+    size_t hostlen = strlen( host );
+    time_t ct = time( NULL );
+    struct blocked* b;
+    int rc;
 
-    STAILQ_FOREACH( g, &groups, next )
+    if( addr )
     {
-        printLog( LOG_DEBUG, "[table=%d, within=%ld, count=%d, reset=%ld, random=%d, continue=%s,\n"
-                        " warnfail=%s, onfail=%s, maxhosts=%d, warnmax=%s, onmax=%s, blocklocal=%s]\n",
-                        g->table,
-                        g->within_time,
-                        g->max_count,
-                        g->reset_time,
-                        g->random,
-                        g->flags & BIF_CONTINUE ? (g->flags & BIF_SKIP ? "next" : "yes") : "no",
-                        g->flags & BIF_WARNFAIL ? "yes" : "no",
-                        g->flags & BIF_BLOCKFAIL ? "block" : "ignore",
-                        g->max_hosts,
-                        g->flags & BIF_WARNMAX ? "yes" : "no",
-                        g->flags & BIF_BLOCKMAX ? "block" : "ignore",
-                        g->flags & BIF_BLOCKLOCAL ? "yes" : "no" );
-        printLog( LOG_DEBUG, "Number of pattern: %d\tCurrently watched hosts: %d\n", g->reg_count, g->host_count );
-
-        printLog( LOG_DEBUG, "\nmatches\tpattern\n" );
-        printLog( LOG_DEBUG, "-----------------------------------------------------------\n" );
-        STAILQ_FOREACH( r, &g->regexps, next )
-            printLog( LOG_DEBUG, "%d\t%s\n", r->matches, r->exp );
+        memcpy( prefix, addr, 16 );
+        masklen = maskAddress( prefix, g->prefix4, g->prefix6 );
 
-        if( g->host_count > 0 )
+        // single excluded addresses never get here, but prefixes may contain some
+        if( (masklen < 128) && ((exclude && rx_match( exclude, prefix, masklen )) || (g->exclude && rx_match( g->exclude, prefix, masklen ))) )
         {
-            printLog( LOG_DEBUG, "\nhost\tcount\texpires in\tstatus\n" );
-            printLog( LOG_DEBUG, "-----------------------------------------------------------\n" );
-            STAILQ_FOREACH( h, &g->hosts, next )
-                printLog( LOG_DEBUG, "%s\t%d\t%ld sec\t%s\n", h->hostname, h->count, h->access_time + g->within_time - now,
-                                h->count > g->max_count ? "failed" : (h->count == g->max_count ? "blocked" : "watching") );
+            if( loglevel >= 1 )
+                printLog( LOG_NOTICE, "Not blocking '%s' containing excluded addresses.", formatPrefix( prefix, masklen, name, sizeof(name) ) );
+            return -1;
         }
     }
-}
+
+    // skip hosts that are in the table until later than the new block anyway
+    forgetFailed( );
+    hash = addr ? hashHost( (const char*)prefix, 16 ) : hashHost( host, hostlen );
+    b = findBlocked( addr ? prefix : NULL, host, hostlen, hash, g->table );
+    if( b && ((b->expires == 0) || ((b->expires > ct) && (bt != 0) && (bt < b->expires + g->reblock_time))) )
+    {
+        g->suppressed++;
+        if( loglevel >= 3 )
+            printLog( LOG_DEBUG, "Not blocking host '%s' again, it is blocked already.", host );
+        return 0;
+    }
+
+    if( addr )
+        rc = addAddressLong( prefix, masklen, bt, g->table, rt, g->flags & BIF_BLOCKLOCAL );
+    else if( resolver )
+        rc = rs_block( resolver, host, bt, g->table, rt, g->flags & BIF_BLOCKLOCAL, g->prefix4, g->prefix6, exclude, g->exclude );
+    else
+        rc = -1;
+
+    if( !rc )
+        rememberBlocked( b, addr ? prefix : NULL, host, hostlen, hash, g->table, bt, ct );
+
+    return rc;
+}
+
+// Start a new counting period of the admission sketch of g if the current one
+// is over. Each period lasts within seconds, and hits are counted for the
+// current and the previous period, so no hit within that time is forgotten.
+static void ageSketch( struct bgroup* g, time_t ct )
+{
+    time_t period = g->within_time > 0 ? g->within_time : 1;
+    size_t i, n = (size_t)SKETCH_DEPTH*g->sketch_width;
+
+    if( ct < g->sketch_period + period )
+        return;
+
+    if( ct < g->sketch_period + 2*period )
+    {
+        // the current period becomes the previous one
+        g->sketch_current ^= 1;
+        g->sketch_period += period;
+        for( i = 0; i < n; i++ )
+            g->sketch[2*i + g->sketch_current] = 0;
+        g->sketch_total[g->sketch_current] = 0;
+    }
+    else
+    {
+        // nothing was counted for more than a period
+        memset( g->sketch, 0, 2*n*sizeof(uint16_t) );
+        g->sketch_total[0] = g->sketch_total[1] = 0;
+        g->sketch_period = ct;
+    }
+}
+
+// Double the number of counters per row of the admission sketch of g, up to its
+// limit. Each counter is copied to both counters a host can now hash to, so no
+// estimate becomes lower than before.
+static void growSketch( struct bgroup* g )
+{
+    unsigned int r, w = g->sketch_width;
+    uint16_t* s;
+
+    if( (2*w > g->sketch_limit) || !(s = (uint16_t*) malloc( 2*SKETCH_DEPTH*2*(size_t)w*sizeof(uint16_t) )) )
+        return;
+
+    for( r = 0; r < SKETCH_DEPTH; r++ )
+    {
+        memcpy( s + 2*(size_t)r*2*w, g->sketch + 2*(size_t)r*w, 2*w*sizeof(uint16_t) );
+        memcpy( s + 2*(size_t)r*2*w + 2*w, g->sketch + 2*(size_t)r*w, 2*w*sizeof(uint16_t) );
+    }
+    free( g->sketch );
+    g->sketch = s;
+    g->sketch_width = 2*w;
+
+    if( loglevel >= 3 )
+        printLog( LOG_DEBUG, "Grew admission sketch of table %d to %u counters per row.", g->table, g->sketch_width );
+}
+
+// Count a hit of a host that is not watched in the admission sketch of g and
+// return the estimated number of its hits in the current and previous period.
+// The estimate is never lower than the real number of hits, but hits of other
+// hosts sharing all of its counters may add to it.
+static unsigned int sketchHit( struct bgroup* g, unsigned int hash, time_t ct )
+{
+    uint16_t* s = g->sketch;
+    unsigned int r, c, est = UINT16_MAX, cur, step, idx[SKETCH_DEPTH];
+
+    ageSketch( g, ct );
+    cur = g->sketch_current;
+
+    // derive the row hashes from two hashes of the host (double hashing)
+    step = hash * 0x9e3779b1u;
+    step = (step ^ (step >> 15)) | 1;
+    for( r = 0; r < SKETCH_DEPTH; r++ )
+    {
+        idx[r] = 2*(r*g->sketch_width + ((hash + r*step) & (g->sketch_width - 1)));
+        c = s[idx[r]] + s[idx[r] + 1];
+        if( c < est )
+            est = c;
+    }
+
+    // conservative update: only raise the counters that are at the estimate
+    g->sketch_total[cur]++;
+    for( r = 0; r < SKETCH_DEPTH; r++ )
+        if( (s[idx[r]] + s[idx[r] + 1] == est) && (s[idx[r] + cur] < UINT16_MAX) )
+            s[idx[r] + cur]++;
+
+    // once the hits spread over a row get close to what admits a host, most
+    // hosts would be admitted by the hits of others, so make the rows wider
+    if( 2*(g->sketch_total[0] + g->sketch_total[1]) >= (unsigned long)g->sketch_width*(g->max_count - 2) )
+        growSketch( g );
+
+    return est < UINT16_MAX ? est + 1 : est;
+}
+
+// Make room on the full watch list of g by evicting the host with the lowest
+// hit count among the first EVICT_SAMPLE hosts on it. The list is in order of
+// the first hit, which later hits do not change, so these are the hosts
+// watched longest and closest to expiring, not the ones hit least recently.
+// A host among them is only evicted with many hits if all others have as many.
+static void evictHost( struct bgroup* g )
+{
+    struct host *h, *victim = STAILQ_FIRST( &g->hosts );
+    char name[ADDR_SIZE];
+    unsigned int n = 0;
+
+    for( h = victim; h && (n < EVICT_SAMPLE); h = STAILQ_NEXT( h, next ), n++ )
+        if( h->count < victim->count )
+            victim = h;
+
+    if( loglevel >= 3 )
+        printLog( LOG_DEBUG, "Evicted host '%s' with hit count %i from watch list.", hostName( g, victim, name, sizeof(name) ), victim->count );
+
+    freeHost( unwatchHost( g, victim ) );
+    g->evicted++;
+}
+
+// Walk the groups host list and delete old entries on the way. If we find the
+// given host name: bump it up and if necessary block it. If we don't find it,
+// add it. The host name is a slice of hostlen characters of the input line,
+// numeric addresses are given as addr and are watched in that form, so
+// different spellings of the same address are the same host.
+static int checkHost( const char *hostslice, size_t hostlen, const unsigned char* addr, struct bgroup* g )
+{
+    time_t ct = time( NULL ), rt = g->reset_time, bt = 0;
+    struct host *ptr;
+    char host[HOST_SIZE], name[ADDR_SIZE];
+    unsigned int hash, count = 1;
+
+    // copy the host name to a terminated string on the stack
+    if( hostlen >= HOST_SIZE )
+    {
+        if( loglevel >= 1 )
+            printLog( LOG_NOTICE, "Ignoring host name longer than %d characters '%.32s...'.", HOST_SIZE-1, hostslice );
+        return -1;
+    }
+    memcpy( host, hostslice, hostlen );
+    host[hostlen] = '\0';
+
+    // clean expired hosts from the beginning of the watch list (always ordered by access time)
+    while( !STAILQ_EMPTY( &g->hosts ) )
+    {
+        ptr = STAILQ_FIRST( &g->hosts );
+        if( hostTime( ptr ) + g->within_time < ct )
+        {
+            if( loglevel >= 3 )
+               printLog( LOG_DEBUG, "Removed host '%s' from watch list", hostName( g, ptr, name, sizeof(name) ) );
+
+            // Remove and free this entry
+            freeHost( unwatchHost( g, ptr ) );
+        }
+        else
+            // From here on out all entries are legitimate, stop searching
+            break;
+    }
+
+    // randomize reset time if needed
+    if( rt > 0 )
+    {
+        rt += (((random( )&0xFFFF)-0x8000)*g->random*rt)/(100*0xFFFF);
+        bt = ct+rt;
+    }
+
+    // check if the host matches one already on the watch list
+    hash = addr ? hashHost( (const char*)addr, 16 ) : hashHost( host, hostlen );
+    if( (ptr = findHost( g, addr, host, hostlen, hash )) )
+    {
+        if( ptr->count < HOST_MAX_COUNT )
+            ptr->count++;
+        if( loglevel >= 3 )
+           printLog( LOG_DEBUG, "Increased hit count for host '%s' to %i.", host, ptr->count );
+
+        if( ptr->count == g->max_count )
+            blockHost( g, addr, host, bt, rt );
+        else if( ptr->count > g->max_count )
+        {
+            if( (loglevel >= 1) && (g->flags & BIF_WARNFAIL) && (ptr->count == g->max_count + 1) )
+                printLog( LOG_WARNING, "Hit from blocked host '%s'.", host );
+            if( g->flags & BIF_BLOCKFAIL )
+                blockHost( g, addr, host, bt, rt );
+        }
+        return 1;
+    }
+
+    // Nothing was found. Unless its estimated number of hits in the admission sketch
+    // is one less than needed for blocking, only count the host there.
+    if( g->sketch )
+    {
+        count = sketchHit( g, hash, ct );
+        if( count < g->max_count - 1 )
+        {
+            g->sketch_hits++;
+            if( loglevel >= 3 )
+                printLog( LOG_DEBUG, "Counted hit of host '%s' in sketch (estimate %u).", host, count );
+            return 0;
+        }
+
+        // the estimate is never too low, so the host is blocked on its next hit
+        // at the latest if it really had that many
+        if( count > g->max_count - 1 )
+            count = g->max_count - 1;
+        g->sketch_admitted++;
+    }
+
+    // Check if max number of hosts has been reached
+    if( (g->max_hosts > 0) && (g->host_count >= g->max_hosts) && !(g->flags & BIF_EVICTMAX) )
+    {
+        if( (loglevel >= 1) && (g->flags & BIF_WARNMAX) )
+            printLog( LOG_NOTICE, "Maximum number of watched hosts exceeded." );
+
+        // block the host preemptively if requested
+        if( g->flags & BIF_BLOCKMAX )
+        {
+            if( loglevel >= 2 )
+                printLog( LOG_NOTICE, "Preemptively blocking host '%s'.", host );
+            blockHost( g, addr, host, bt, rt );
+        }
+        else
+            if( loglevel >= 2 )
+                printLog( LOG_NOTICE, "Ignoring host '%s'.", host );
+    }
+    else
+    {
+        // evict watched hosts to make room if requested
+        if( (g->max_hosts > 0) && (g->host_count >= g->max_hosts) )
+        {
+            if( (loglevel >= 1) && (g->flags & BIF_WARNMAX) )
+                printLog( LOG_NOTICE, "Maximum number of watched hosts exceeded." );
+            while( g->host_count >= g->max_hosts )
+                evictHost( g );
+        }
+
+        if( (ptr = slabAlloc( &host_slab )) == NULL )
+        {
+            if( loglevel >= 1 )
+                printLog( LOG_ERR, "Out of memory, ignoring host '%s'.", host );
+            return -1;
+        }
+
+        ptr->count = count;
+        ptr->access_time = ct - time_base;
+        if( nameHost( ptr, addr, host, hostlen ) )
+        {
+            slabFree( &host_slab, ptr );
+            if( loglevel >= 1 )
+                printLog( LOG_ERR, "Out of memory, ignoring host '%s'.", host );
+            return -1;
+        }
+
+        // a growing index is an allocation while matching
+        if( !g->index || (2*(g->host_count + 1) > g->index_mask + 1) )
+            allocations++;
+        if( watchHost( g, ptr ) )
+        {
+            freeHost( ptr );
+            if( loglevel >= 1 )
+                printLog( LOG_ERR, "Out of memory, ignoring host '%s'.", host );
+            return -1;
+        }
+
+        if( loglevel >= 3 )
+            printLog( LOG_DEBUG, "Added host '%s' to watch list with hit count %i.", host, ptr->count );
+
+        // just checking if someone is really cruel
+        if( ptr->count == g->max_count )
+            blockHost( g, addr, host, bt, rt );
+    }
+
+    return 0;
+}
+
+// Match a line against the combined pattern of group g and record a hit in h.
+// Returns non-zero if there was a hit.
+static int matchCombined( struct bgroup* g, const char* line, size_t length, struct matcher* m, struct hit* h )
+{
+    struct regexp* r;
+    unsigned int k;
+    int rc, found;
+#ifdef HAVE_LIBPCRE2
+    PCRE2_SPTR mark;
+#else
+    regmatch_t* pmatch = m->pmatch;
+#endif
+
+    // skip the match entirely if the prefilter rules out all pattern of this group
+    for( k = 0; k < g->reg_count; k++ )
+        if( (g->branch[k]->literal < 0) || ac_hit( m->literals, g->branch[k]->literal ) )
+            break;
+    if( k == g->reg_count )
+        return 0;
+
+    if( loglevel >= 3 )
+        printLog( LOG_DEBUG, "%s", line );
+
+#ifdef HAVE_LIBPCRE2
+    m->combined = g;
+    if( g->jit )
+        rc = pcre2_jit_match( g->combined, (PCRE2_SPTR)line, length, 0, PCRE2_NOTEMPTY, m->md, m->mc );
+    else
+        rc = pcre2_match( g->combined, (PCRE2_SPTR)line, length, 0, PCRE2_NOTEMPTY, m->md, m->mc );
+    m->combined = NULL;
+
+    if( rc <= 0 )
+    {
+        if( rc != PCRE2_ERROR_NOMATCH )
+        {
+            if( loglevel < 3 ) printLog( LOG_ERR, "%s", line );
+            printLog( LOG_ERR, "Error in pcre2_match for combined regexp of table %d (rc=%d).", g->table, rc );
+        }
+        return 0;
+    }
+
+    // the mark tells us which branch matched. The branches are anchored and
+    // scan the line themselves, so like matching one by one the first pattern
+    // of the group that matches anywhere in the line wins.
+    mark = pcre2_get_mark( m->md );
+    if( !mark || (k = strtoul( (const char*)mark, NULL, 10 )) >= g->reg_count )
+    {
+        printLog( LOG_ERR, "Unknown branch in combined regexp of table %d matched.", g->table );
+        return 0;
+    }
+    r = g->branch[k];
+
+    // the host group of the branch, shifted to its position in the combined pattern
+    found = pcreGetSubstring( line, m->ovector, rc, r->capture + r->host - 1, &h->host, &h->hostlen ) ||
+            pcreGetSubstring( line, m->ovector, rc, r->capture, &h->host, &h->hostlen );
+#else
+    pmatch[0].rm_so = 0;
+    pmatch[0].rm_eo = length;
+    rc = regexec( &g->combined, line, m->nmatch, pmatch, REG_STARTEND );
+
+    if( rc )
+    {
+        if( rc != REG_NOMATCH )
+        {
+            if( loglevel < 3 ) printLog( LOG_ERR, "%s", line );
+            printLog( LOG_ERR, "Error in regexec for combined regexp of table %d (rc=%d).", g->table, rc );
+        }
+        return 0;
+    }
+
+    // the enclosing capture group tells us which branch matched (the one
+    // matching earliest in the line, and of those the longest)
+    for( k = 0; k < g->reg_count; k++ )
+        if( pmatch[g->branch[k]->capture-1].rm_so != -1 )
+            break;
+    if( k == g->reg_count )
+    {
+        printLog( LOG_ERR, "Unknown branch in combined regexp of table %d matched.", g->table );
+        return 0;
+    }
+    r = g->branch[k];
+
+    found = regexGetSubstring( line, &pmatch[r->capture], &h->host, &h->hostlen );
+#endif
+
+    if( !found )
+    {
+        if( loglevel >= 1 )
+        {
+            if( loglevel < 3 ) printLog( LOG_NOTICE, "%s", line );
+            printLog( LOG_NOTICE, "No substrings in matching regexp '%s' (rc=%d).", r->exp, rc );
+        }
+        return 0;
+    }
+
+    // we caught a bad guy!
+    if( loglevel >= 3 )
+        printLog( LOG_DEBUG, "Regular expression '%s' matches with host '%.*s'.", r->exp, (int)h->hostlen, h->host );
+    h->group = g;
+    h->regexp = r;
+
+    return 1;
+}
+
+// print diagnostics and statistics about the current status of the program
+void printTable( )
+{
+    struct host *h;
+    char name[ADDR_SIZE];
+    struct regexp *r;
+    struct bgroup *g;
+    int now = time( NULL );
+    unsigned long watched = 0, memory;
+#ifdef HAVE_LIBPTHREAD
+    unsigned long entries, fwbatches;
+    unsigned int queued;
+#endif
+
+    // memory of all watch lists: host records, names and their index
+    memory = host_slab.count*host_slab.size + name_slab.count*name_slab.size;
+    STAILQ_FOREACH( g, &groups, next )
+    {
+        watched += g->host_count;
+        if( g->index )
+            memory += (g->index_mask + 1)*sizeof(struct host*);
+    }
+
+    printLog( LOG_DEBUG, "Lines read: %lu\tRejected by prefilter: %lu\tPattern in prefilter: %u of %u\n",
+                    lines_read, lines_rejected, literal_count, literal_count + unfiltered_count );
+    if( dispatch_programs > 0 )
+        printLog( LOG_DEBUG, "Lines without syslog header: %lu\n", lines_noheader );
+    printLog( LOG_DEBUG, "Allocations while matching: %lu (%.4f per line)\n",
+                    allocations, lines_read ? (double)allocations/lines_read : 0.0 );
+    printLog( LOG_DEBUG, "Watch list memory: %lu bytes for %lu hosts (%lu per host, %lu per host record)\n",
+                    memory, watched, watched ? memory/watched : 0, (unsigned long)sizeof(struct host) );
+#ifdef HAVE_LIBPTHREAD
+    if( threads > 1 )
+        printLog( LOG_DEBUG, "Matching threads: %u\n", threads );
+#endif
+    if( tail )
+        printLog( LOG_DEBUG, "Following log files: %u\tRotated: %lu\tTruncated: %lu\n",
+                        tl_count( tail ), tl_rotations( tail ), tl_truncations( tail ) );
+    if( listener )
+        printLog( LOG_DEBUG, "Listening on sockets: %u\tMessages received: %lu\n",
+                        sl_count( listener ), sl_received( listener ) );
+    if( blocked_set )
+        printLog( LOG_DEBUG, "Blocked hosts remembered: %u\tMemory: %lu bytes\n",
+                        blocked_count, (unsigned long)((blocked_mask + 1)*sizeof(struct blocked)) );
+    if( exclude )
+        printLog( LOG_DEBUG, "Prefixes excluded for all groups: %u\tExclusion memory: %lu bytes\n",
+                        rx_count( exclude ), (unsigned long)rx_memory( exclude ) );
+#ifdef HAVE_LIBPTHREAD
+    if( writer )
+    {
+        fw_writer_stats( &entries, &fwbatches, &queued );
+        printLog( LOG_DEBUG, "Firewall additions written: %lu\tBatches: %lu\tQueued: %u\n", entries, fwbatches, queued );
+    }
+#endif
+    if( resolver )
+        printLog( LOG_DEBUG, "Host names resolved: %lu\tFound in cache: %lu\tFailed: %lu\tPending: %u\n",
+                        rs_lookups( resolver ), rs_hits( resolver ), rs_failures( resolver ), rs_pending( resolver ) );
+    if( (tail ? tl_truncated( tail ) : listener ? sl_truncated( listener ) : input ? lr_truncated( input ) : 0) > 0 )
+        printLog( LOG_DEBUG, "Lines cut off at %lu characters: %lu\n", (unsigned long)max_line,
+                        tail ? tl_truncated( tail ) : listener ? sl_truncated( listener ) : lr_truncated( input ) );
+
+    STAILQ_FOREACH( g, &groups, next )
+    {
+        printLog( LOG_DEBUG, "[table=%d, within=%ld, count=%d, reset=%ld, reblock=%ld, random=%d, continue=%s,\n"
+                        " warnfail=%s, onfail=%s, maxhosts=%d, warnmax=%s, onmax=%s, blocklocal=%s, combine=%s,\n"
+                        " prefix4=%u, prefix6=%u, sketch=%u, program=%s]\n",
+                        g->table,
+                        g->within_time,
+                        g->max_count,
+                        g->reset_time,
+                        g->reblock_time,
+                        g->random,
+                        g->flags & BIF_CONTINUE ? (g->flags & BIF_SKIP ? "next" : "yes") : "no",
+                        g->flags & BIF_WARNFAIL ? "yes" : "no",
+                        g->flags & BIF_BLOCKFAIL ? "block" : "ignore",
+                        g->max_hosts,
+                        g->flags & BIF_WARNMAX ? "yes" : "no",
+                        g->flags & BIF_BLOCKMAX ? "block" : (g->flags & BIF_EVICTMAX ? "evict" : "ignore"),
+                        g->flags & BIF_BLOCKLOCAL ? "yes" : "no",
+                        g->flags & BIF_COMBINE ? (g->branch ? "yes" : "failed") : "no",
+                        g->prefix4,
+                        g->prefix6,
+                        g->sketch_width,
+                        g->program ? g->program : "(any)" );
+        printLog( LOG_DEBUG, "Number of pattern: %d\tCurrently watched hosts: %d\n", g->reg_count, g->host_count );
+        if( g->flags & BIF_EVICTMAX )
+            printLog( LOG_DEBUG, "Hosts evicted from watch list: %lu\n", g->evicted );
+        printLog( LOG_DEBUG, "Blocks skipped for blocked hosts: %lu\n", g->suppressed );
+        if( exclude || g->exclude )
+            printLog( LOG_DEBUG, "Hits from excluded addresses: %lu\tExcluded prefixes: %u\tExclusion memory: %lu bytes\n",
+                            g->excluded, g->exclude ? rx_count( g->exclude ) : 0, g->exclude ? (unsigned long)rx_memory( g->exclude ) : 0 );
+        if( g->sketch )
+            printLog( LOG_DEBUG, "Hits only counted in sketch: %lu\tHosts admitted to watch list: %lu\tSketch memory: %lu bytes\n",
+                            g->sketch_hits, g->sketch_admitted, (unsigned long)(2*SKETCH_DEPTH*g->sketch_width*sizeof(uint16_t)) );
+
+        printLog( LOG_DEBUG, "\nmatches\tfilter\tjit\tpattern\n" );
+        printLog( LOG_DEBUG, "-----------------------------------------------------------\n" );
+        STAILQ_FOREACH( r, &g->regexps, next )
+            printLog( LOG_DEBUG, "%d\t%s\t%s\t%s\n", r->matches, r->literal < 0 ? "no" : "yes",
+#ifdef HAVE_LIBPCRE2
+                            r->jit ? "yes" : "no",
+#else
+                            "no",
+#endif
+                            r->exp );
+
+        if( g->host_count > 0 )
+        {
+            printLog( LOG_DEBUG, "\nhost\tcount\texpires in\tstatus\n" );
+            printLog( LOG_DEBUG, "-----------------------------------------------------------\n" );
+            STAILQ_FOREACH( h, &g->hosts, next )
+                printLog( LOG_DEBUG, "%s\t%d\t%ld sec\t%s\n", hostName( g, h, name, sizeof(name) ), h->count, hostTime( h ) + g->within_time - now,
+                                h->count > g->max_count ? "failed" : (h->count == g->max_count ? "blocked" : "watching") );
+        }
+    }
+}
 
 // handles signals
 void signalHandler( int sig )
@@ -411,12 +1481,15 @@ void signalHandler( int sig )
     switch( sig )
     {
         case SIGINFO:
-            printTable( );
+            // printTable takes the locks of the writer thread and the resolver, which the
+            // interrupted main thread may be holding, so the main loop prints it before reading on
+            caught_info = 1;
             break;
 
         case SIGHUP:
-            // do nothing
-            // fgetln(...) in the main loop returns automatically because we set siginterrupt for SIGHUP
+            // read(...) in the main loop returns automatically because SIGHUP is set up without SA_RESTART,
+            // waiting for followed log files checks for the signal
+            caught_signal = sig;
             break;
 
         case SIGTERM:
@@ -424,7 +1497,8 @@ void signalHandler( int sig )
         case SIGINT:
         case SIGPIPE:
         default:
-            // close stdin so that fgetln(...) in the main loop returns and never succeeds again
+            // close stdin so that read(...) in the main loop returns and never succeeds again
+            caught_signal = sig;
             fclose( stdin );
             break;
     }
@@ -439,6 +1513,8 @@ int addRegexp( char* exp, struct bgroup* g )
 #endif
     int i;
     struct regexp* nptr;
+    char lit[128];
+    size_t len;
 
     // check for minimum regexp length
     i = strlen( exp );
@@ -463,6 +1539,15 @@ int addRegexp( char* exp, struct bgroup* g )
         free( nptr );
         return ERR_INVALID_REGEXP;
     }
+
+    // look up the capture group holding the host name once, defaulting to the first one
+    i = pcre2_substring_number_from_name( nptr->re, (PCRE2_SPTR)"host" );
+    nptr->host = i > 0 ? i : 1;
+
+    // try to JIT compile the pattern, otherwise fall back to the interpreter
+    nptr->jit = (pcre2_jit_compile( nptr->re, PCRE2_JIT_COMPLETE ) == 0);
+    if( !nptr->jit && (loglevel >= 3) )
+        printLog( LOG_DEBUG, "JIT compilation not available for regexp '%s', using interpreter.", exp );
 #else
     if( regcomp( &nptr->re, exp, REG_EXTENDED | REG_NEWLINE | REG_ICASE ) )
     {
@@ -477,11 +1562,25 @@ int addRegexp( char* exp, struct bgroup* g )
         free( nptr );
         return ERR_INVALID_REGEXP;
     }
+    nptr->host = 1;
 #endif
 
     nptr->matches = 0;
     nptr->exp = strdup( exp );
 
+    // register required literal with the prefilter, if the pattern has one
+    if( (len = ac_literal( exp, lit, sizeof(lit) )) > 0 )
+    {
+        if( ac_add( prefilter, lit, len, literal_count ) )
+            err( EX_OSERR, "%s", error_messages[ERR_OUT_OF_MEMORY] );
+        nptr->literal = literal_count++;
+    }
+    else
+    {
+        nptr->literal = -1;
+        unfiltered_count++;
+    }
+
     // Add to regexp list
     STAILQ_INSERT_TAIL( &g->regexps, nptr, next );
     g->reg_count++;
@@ -489,12 +1588,370 @@ int addRegexp( char* exp, struct bgroup* g )
     return 0;
 }
 
+// Check if a pattern can be merged into a combined pattern without changing its meaning
+static int isCombinable( const struct regexp* r )
+{
+    const char* c;
+#ifdef HAVE_LIBPCRE2
+    uint32_t refs, empty;
+
+    // back references change their meaning when capture groups are renumbered,
+    // and an empty match would no longer be rejected where the pattern starts
+    if( pcre2_pattern_info( r->re, PCRE2_INFO_BACKREFMAX, &refs ) || refs ||
+        pcre2_pattern_info( r->re, PCRE2_INFO_MATCHEMPTY, &empty ) || empty )
+        return 0;
+#endif
+
+    // parse the pattern for the constructs that refer to group numbers or the
+    // whole pattern, skipping escaped characters and bracket expressions
+    for( c = r->exp; *c; c++ )
+    {
+        if( *c == '\\' )
+        {
+            if( c[1] == '\0' )
+                break;
+#ifdef HAVE_LIBPCRE2
+            // quoted text up to \E
+            if( c[1] == 'Q' )
+            {
+                for( c += 2; *c && !((c[0] == '\\') && (c[1] == 'E')); c++ );
+                if( !*c )
+                    break;
+            }
+            // subroutine calls by number or name (Oniguruma syntax)
+            else if( (c[1] == 'g') && ((c[2] == '<') || (c[2] == '\'')) )
+                return 0;
+#else
+            // back references (a GNU extension to extended expressions)
+            if( (c[1] >= '1') && (c[1] <= '9') )
+                return 0;
+#endif
+            c++;
+        }
+        else if( *c == '[' )
+        {
+            // a closing bracket right at the start is a member of the expression
+            c++;
+            if( *c == '^' )
+                c++;
+            if( *c == ']' )
+                c++;
+            for( ; *c && (*c != ']'); c++ )
+            {
+                if( (c[0] == '[') && (c[1] == ':' || c[1] == '.' || c[1] == '=') && strchr( c + 2, ']' ) )
+                    c = strchr( c + 2, ']' );
+#ifdef HAVE_LIBPCRE2
+                else if( (c[0] == '\\') && c[1] )
+                    c++;
+#endif
+            }
+            if( !*c )
+                break;
+        }
+#ifdef HAVE_LIBPCRE2
+        else if( (c[0] == '(') && (c[1] == '*') )
+            // backtracking verbs act on the whole alternation, and may clobber our marks
+            return 0;
+        else if( (c[0] == '(') && (c[1] == '?') )
+        {
+            // recursion, subroutine calls and conditions (but not option settings like (?-i))
+            if( (c[2] && strchr( "R0123456789&(", c[2] )) || ((c[2] == 'P') && (c[3] == '>')) ||
+                (((c[2] == '+') || (c[2] == '-')) && (c[3] >= '0') && (c[3] <= '9')) )
+                return 0;
+        }
+#endif
+    }
+
+    return 1;
+}
+
+// Merge all pattern of group g into one alternation, which is matched in a
+// single pass. Each branch is tagged so the pattern that hit can be
+// identified. Returns non-zero if the pattern could not be combined.
+static int combineRegexps( struct bgroup* g )
+{
+    struct regexp* r;
+    size_t len = 1;
+    char *exp, *p;
+    unsigned int k = 0, capture = 1;
+#ifdef HAVE_LIBPCRE2
+    int error;
+    uint32_t n;
+    PCRE2_SIZE offset;
+#endif
+
+    // all pattern must be suitable for combination
+    STAILQ_FOREACH( r, &g->regexps, next )
+    {
+        if( !isCombinable( r ) )
+        {
+            if( loglevel >= 1 )
+                printLog( LOG_WARNING, "Regexp '%s' cannot be combined with other pattern.", r->exp );
+            return 1;
+        }
+        len += strlen( r->exp ) + 48;
+    }
+
+    exp = (char*) malloc( len );
+    g->branch = (struct regexp**) calloc( g->reg_count, sizeof(struct regexp*) );
+    if( !exp || !g->branch )
+    {
+        free( exp );
+        free( g->branch );
+        g->branch = NULL;
+        return 1;
+    }
+
+    // build the alternation
+    p = exp;
+    STAILQ_FOREACH( r, &g->regexps, next )
+    {
+#ifdef HAVE_LIBPCRE2
+        // tag each branch with its index, keep options local to the branch, and
+        // let it search the whole line before the next branch is tried. The
+        // callout skips branches ruled out by the prefilter (numbers end at 255).
+        if( k < 255 )
+            p += sprintf( p, "%s(?:(*MARK:%u)(?C%u)(?s:.*?)(?:%s))", k ? "|" : "", k, k + 1, r->exp );
+        else
+            p += sprintf( p, "|(?:(*MARK:%u)(?s:.*?)(?:%s))", k, r->exp );
+        r->capture = capture;
+        pcre2_pattern_info( r->re, PCRE2_INFO_CAPTURECOUNT, &n );
+        capture += n;
+#else
+        // enclose each branch in its own capture group to identify it
+        p += sprintf( p, "%s(%s)", k ? "|" : "", r->exp );
+        r->capture = capture + 1;
+        capture += 1 + r->re.re_nsub;
+#endif
+        g->branch[k++] = r;
+    }
+
+#ifdef HAVE_LIBPCRE2
+    g->combined = pcre2_compile( (PCRE2_SPTR)exp, PCRE2_ZERO_TERMINATED, PCRE2_CASELESS | PCRE2_DUPNAMES | PCRE2_ANCHORED, &error, &offset, NULL );
+    if( g->combined )
+        g->jit = (pcre2_jit_compile( g->combined, PCRE2_JIT_COMPLETE ) == 0);
+    else
+#else
+    if( regcomp( &g->combined, exp, REG_EXTENDED | REG_NEWLINE | REG_ICASE ) )
+#endif
+    {
+        free( g->branch );
+        g->branch = NULL;
+    }
+
+    free( exp );
+    return g->branch ? 0 : 1;
+}
+
+// Split an RFC 3164 syslog line ("Mmm dd hh:mm:ss host tag[pid]: message")
+// into its header fields. Returns non-zero if the line has no such header.
+static int parseHeader( const char* line, size_t length, struct syslog_header* h )
+{
+    size_t i;
+
+    // fixed width time stamp followed by a space
+    if( (length < 16) || (line[3] != ' ') || (line[6] != ' ') || (line[9] != ':') || (line[12] != ':') || (line[15] != ' ') )
+        return 1;
+
+    // host name
+    h->host = &line[16];
+    for( i = 16; (i < length) && (line[i] != ' '); i++ )
+        ;
+    h->hostlen = i - 16;
+    if( (h->hostlen == 0) || (i >= length) )
+        return 1;
+
+    // program tag, optionally followed by the pid in brackets, and a colon
+    h->tag = &line[++i];
+    for( ; (i < length) && !strchr( "[]: \n", line[i] ); i++ )
+        ;
+    h->taglen = &line[i] - h->tag;
+    if( (h->taglen == 0) || (i >= length) )
+        return 1;
+    h->pid = -1;
+    if( line[i] == '[' )
+    {
+        for( h->pid = 0, i++; (i < length) && (line[i] >= '0') && (line[i] <= '9'); i++ )
+            h->pid = 10*h->pid + (line[i] - '0');
+        if( (i >= length) || (line[i] != ']') )
+            return 1;
+        i++;
+    }
+    if( (i >= length) || (line[i] != ':') )
+        return 1;
+    i++;
+    if( (i < length) && (line[i] == ' ') )
+        i++;
+    h->body = i;
+
+    return 0;
+}
+
+// hash function for program tags (FNV-1a)
+static unsigned int hashProgram( const char* tag, size_t len )
+{
+    unsigned int h = 2166136261u;
+
+    while( len-- > 0 )
+        h = (h ^ (unsigned char)*tag++) * 16777619u;
+
+    return h % DISPATCH_SIZE;
+}
+
+// Create a dispatch entry for the given program with all groups applying to it
+static struct dispatch* newDispatch( const char* program )
+{
+    struct dispatch* d;
+    struct bgroup* g;
+
+    if( !(d = (struct dispatch*) calloc( 1, sizeof(struct dispatch) )) )
+        err( EX_OSERR, "%s", error_messages[ERR_OUT_OF_MEMORY] );
+    STAILQ_FOREACH( g, &groups, next )
+        d->count++;
+    if( !(d->groups = (struct bgroup**) calloc( d->count, sizeof(struct bgroup*) )) ||
+        (program && !(d->program = strdup( program ))) )
+        err( EX_OSERR, "%s", error_messages[ERR_OUT_OF_MEMORY] );
+
+    // keep the configuration order of the groups
+    d->count = 0;
+    STAILQ_FOREACH( g, &groups, next )
+        if( !g->program || (program && (strcmp( g->program, program ) == 0)) )
+            d->groups[d->count++] = g;
+
+    return d;
+}
+
+// Find the groups that apply to lines from the given program
+static struct dispatch* findDispatch( const char* tag, size_t len )
+{
+    struct dispatch* d;
+
+    STAILQ_FOREACH( d, &dispatch_table[hashProgram( tag, len )], next )
+        if( (strncmp( d->program, tag, len ) == 0) && (d->program[len] == '\0') )
+            return d;
+
+    return dispatch_default;
+}
+
+// Build the hash index from program tags to groups
+static void buildDispatch( )
+{
+    struct bgroup* g;
+    struct dispatch* d;
+    unsigned int i;
+
+    for( i = 0; i < DISPATCH_SIZE; i++ )
+        STAILQ_INIT( &dispatch_table[i] );
+    dispatch_default = newDispatch( NULL );
+    dispatch_programs = 0;
+
+    STAILQ_FOREACH( g, &groups, next )
+        if( g->program )
+        {
+            dispatch_programs++;
+            if( findDispatch( g->program, strlen( g->program ) ) != dispatch_default )
+                continue;
+            d = newDispatch( g->program );
+            STAILQ_INSERT_TAIL( &dispatch_table[hashProgram( g->program, strlen( g->program ) )], d, next );
+        }
+}
+
+// Free the hash index from program tags to groups
+static void freeDispatch( )
+{
+    struct dispatch* d;
+    unsigned int i;
+
+    for( i = 0; i < DISPATCH_SIZE; i++ )
+        while( !STAILQ_EMPTY( &dispatch_table[i] ) )
+        {
+            d = STAILQ_FIRST( &dispatch_table[i] );
+            STAILQ_REMOVE_HEAD( &dispatch_table[i], next );
+            free( d->program );
+            free( d->groups );
+            free( d );
+        }
+
+    if( dispatch_default )
+    {
+        free( dispatch_default->groups );
+        free( dispatch_default );
+        dispatch_default = NULL;
+    }
+}
+
+// Add an address or address prefix to a set of excluded prefixes.
+// Returns non-zero if it is invalid.
+static int parseExclude( struct radix* rx, const char* value )
+{
+    unsigned char addr[16];
+    unsigned int masklen = 128;
+    int rc;
+
+    rc = parsePrefix( value, addr, &masklen );
+    if( (rc < 0) || ((rc == 0) && !parseAddress( value, strlen( value ), addr )) )
+        return -1;
+    if( rx_add( rx, addr, masklen ) )
+        err( EX_OSERR, "%s", error_messages[ERR_OUT_OF_MEMORY] );
+
+    return 0;
+}
+
+// Add an address, an address prefix, or all of those listed in a file (given
+// by its absolute path, one per line) to a set of excluded prefixes, which is
+// created if needed. Returns non-zero if any of them is invalid.
+static int addExclude( struct radix** rx, const char* value )
+{
+    FILE* f;
+    char *line = NULL, *p, *c;
+    size_t size = 0;
+    unsigned int lc = 0;
+    int ec = 0;
+
+    if( !*rx && !(*rx = rx_create( )) )
+        err( EX_OSERR, "%s", error_messages[ERR_OUT_OF_MEMORY] );
+
+    if( *value != '/' )
+        return parseExclude( *rx, value );
+
+    f = fopen( value, "r" );
+    if( !f )
+    {
+        printLog( LOG_WARNING, "Cannot open exclude file '%s'", value );
+        return -1;
+    }
+
+    while( readline( &line, &size, f ) != -1 )
+    {
+        lc++;
+
+        // skip white space and comments
+        for( p = line; (*p != '\0') && strchr( " \t\r", *p ); p++ )
+            ;
+        for( c = p; (*c != '\0') && !strchr( " \t\r#", *c ); c++ )
+            ;
+        *c = '\0';
+        if( (*p != '\0') && parseExclude( *rx, p ) )
+        {
+            printLog( LOG_WARNING, "%s:%u  Invalid address or prefix '%s'", value, lc, p );
+            ec++;
+        }
+    }
+
+    fclose( f );
+    free( line );
+
+    return ec;
+}
+
 // Parse a group definition line into the newly allocated pg
 // XXX: change to be more lenient and only warn on errors.
 int parseGroupData( char* line, struct bgroup** pg )
 {
     int i;
-    char *value, *key, *c;
+    char *value, *key, *c, *program = NULL;
+    char *excludes[MAX_EXCLUDE];        // values of the exclude options (parsed once the line is valid)
+    unsigned int exclude_count = 0;
     struct bgroup g = default_group;    // temporary group
 
     *pg = NULL;
@@ -587,9 +2044,17 @@ int parseGroupData( char* line, struct bgroup** pg )
             if( !value )
                 return ERR_INVALID_VALUE;
             else if( strcasecmp( value, "block" ) == 0 )
+            {
                 g.flags |= BIF_BLOCKMAX;
-            else if( (strcasecmp( value, "none" ) == 0) || (strcasecmp( value, "ignore" ) == 0) )
+                g.flags &= ~BIF_EVICTMAX;
+            }
+            else if( strcasecmp( value, "evict" ) == 0 )
+            {
+                g.flags |= BIF_EVICTMAX;
                 g.flags &= ~BIF_BLOCKMAX;
+            }
+            else if( (strcasecmp( value, "none" ) == 0) || (strcasecmp( value, "ignore" ) == 0) )
+                g.flags &= ~(BIF_BLOCKMAX|BIF_EVICTMAX);
             else
                 return ERR_INVALID_VALUE;
         }
@@ -602,33 +2067,76 @@ int parseGroupData( char* line, struct bgroup** pg )
             else
                 return ERR_INVALID_VALUE;
         }
-        else if( (strcasecmp( key, "random" ) == 0) || (strcasecmp( key, "randomize" ) == 0) )
+        else if( strcasecmp( key, "program" ) == 0 )
+        {
+            if( !value || (*value == '\0') || strpbrk( value, " \t[]:" ) )
+                return ERR_INVALID_VALUE;
+            program = value;
+        }
+        else if( strcasecmp( key, "combine" ) == 0 )
+        {
+            if( !value || (strcasecmp( value, "yes" ) == 0) )
+                g.flags |= BIF_COMBINE;
+            else if( strcasecmp( value, "no" ) == 0 )
+                g.flags &= ~BIF_COMBINE;
+            else
+                return ERR_INVALID_VALUE;
+        }
+        else if( (strcasecmp( key, "random" ) == 0) || (strcasecmp( key, "randomize" ) == 0) )
+        {
+            if( !value )
+                return ERR_INVALID_VALUE;
+            else if( strcasecmp( value, "no" ) == 0 )
+                g.random = 0;
+            else
+            {
+                // convert value to number
+                i = strtol( value, &value, 10 );
+                if( (*value != '\0') || abs(i) > 100 ) return ERR_INVALID_VALUE;
+                g.random = i;
+            }
+        }
+        else if( strcasecmp( key, "maxhosts" ) == 0 )
+        {
+            if( !value )
+                return ERR_INVALID_VALUE;
+            else
+            {
+                // convert value to number
+                i = strtol( value, &value, 10 );
+                if( (*value != '\0') || i <= 0 ) return ERR_INVALID_VALUE;
+                g.max_hosts = i;
+            }
+        }
+        else if( strcasecmp( key, "count" ) == 0 )
         {
             if( !value )
                 return ERR_INVALID_VALUE;
-            else if( strcasecmp( value, "no" ) == 0 )
-                g.random = 0;
             else
             {
                 // convert value to number
                 i = strtol( value, &value, 10 );
-                if( (*value != '\0') || abs(i) > 100 ) return ERR_INVALID_VALUE;
-                g.random = i;
+                // one more hit than this must still be counted
+                if( (*value != '\0') || i < 0 || i >= HOST_MAX_COUNT ) return ERR_INVALID_VALUE;
+                g.max_count = i;
             }
         }
-        else if( strcasecmp( key, "maxhosts" ) == 0 )
+        else if( strcasecmp( key, "sketch" ) == 0 )
         {
             if( !value )
                 return ERR_INVALID_VALUE;
+            else if( strcasecmp( value, "no" ) == 0 )
+                g.sketch_width = 0;
             else
             {
-                // convert value to number
+                // convert value to number, rounded up to a power of two
                 i = strtol( value, &value, 10 );
-                if( (*value != '\0') || i <= 0 ) return ERR_INVALID_VALUE;
-                g.max_hosts = i;
+                if( (*value != '\0') || i < 0 || i > SKETCH_MAX ) return ERR_INVALID_VALUE;
+                for( g.sketch_width = i > 0 ? SKETCH_MIN : 0; g.sketch_width < (unsigned int)i; g.sketch_width *= 2 )
+                    ;
             }
         }
-        else if( strcasecmp( key, "count" ) == 0 )
+        else if( (strcasecmp( key, "prefix4" ) == 0) || (strcasecmp( key, "prefix6" ) == 0) )
         {
             if( !value )
                 return ERR_INVALID_VALUE;
@@ -636,10 +2144,19 @@ int parseGroupData( char* line, struct bgroup** pg )
             {
                 // convert value to number
                 i = strtol( value, &value, 10 );
-                if( (*value != '\0') || i < 0 ) return ERR_INVALID_VALUE;
-                g.max_count = i;
+                if( (*value != '\0') || i < 1 || i > (key[6] == '4' ? 32 : 128) ) return ERR_INVALID_VALUE;
+                if( key[6] == '4' )
+                    g.prefix4 = i;
+                else
+                    g.prefix6 = i;
             }
         }
+        else if( strcasecmp( key, "exclude" ) == 0 )
+        {
+            if( !value || (*value == '\0') || (exclude_count >= MAX_EXCLUDE) )
+                return ERR_INVALID_VALUE;
+            excludes[exclude_count++] = value;
+        }
         else if( strcasecmp( key, "within" ) == 0 )
         {
             if( !value )
@@ -664,6 +2181,18 @@ int parseGroupData( char* line, struct bgroup** pg )
                 g.reset_time = i;
             }
         }
+        else if( strcasecmp( key, "reblock" ) == 0 )
+        {
+            if( !value )
+                return ERR_INVALID_VALUE;
+            else
+            {
+                // convert value to number
+                i = strtol( value, &value, 10 );
+                if( (*value != '\0') || i < 0 ) return ERR_INVALID_VALUE;
+                g.reblock_time = i;
+            }
+        }
         else if( strcasecmp( key, "table" ) == 0 )
         {
             if( !value )
@@ -680,10 +2209,30 @@ int parseGroupData( char* line, struct bgroup** pg )
             return ERR_INVALID_KEY;
     }
 
+    // a combined pattern can only report one hit per line
+    if( (g.flags & BIF_COMBINE) && (g.flags & BIF_CONTINUE) && !(g.flags & BIF_SKIP) )
+        return ERR_INVALID_COMBINE;
+
+    for( i = 0; i < (int)exclude_count; i++ )
+        if( addExclude( &g.exclude, excludes[i] ) )
+        {
+            rx_free( g.exclude );
+            return ERR_INVALID_EXCLUDE;
+        }
+
+    // with a count below 3 every host goes on the watch list on its first hit anyway
+    if( g.max_count < 3 )
+        g.sketch_width = 0;
+    g.sketch_limit = g.sketch_width*SKETCH_GROWTH < SKETCH_MAX ? g.sketch_width*SKETCH_GROWTH : SKETCH_MAX;
+
     // allocate new group and copy temporary one
     if( !(*pg = (struct bgroup*) malloc( sizeof(struct bgroup) )) )
         err( EX_OSERR, "%s", error_messages[ERR_OUT_OF_MEMORY] );
     **pg = g;
+    if( program && !((*pg)->program = strdup( program )) )
+        err( EX_OSERR, "%s", error_messages[ERR_OUT_OF_MEMORY] );
+    if( g.sketch_width && !((*pg)->sketch = (uint16_t*) calloc( 2*SKETCH_DEPTH*g.sketch_width, sizeof(uint16_t) )) )
+        err( EX_OSERR, "%s", error_messages[ERR_OUT_OF_MEMORY] );
     STAILQ_INIT( &(*pg)->hosts );
     STAILQ_INIT( &(*pg)->regexps );
 
@@ -696,9 +2245,10 @@ void loadState( const char* state_file, const char config_hash[65] )
     struct stat sb;
     FILE* sf;
     char *line = NULL, *ip, *p;
+    unsigned char addr[16];
     size_t len = 0;
     ssize_t sl;
-    int i = 1;
+    int i = 1, numeric;
     time_t atime;
     uint32_t count;
     struct bgroup *gptr;
@@ -787,150 +2337,648 @@ void loadState( const char* state_file, const char config_hash[65] )
             continue;
         }
 
-        hptr = malloc( sizeof(struct host) );
+        if( strlen( ip ) >= HOST_SIZE )
+        {
+            if( loglevel >= 1 )
+                printLog( LOG_INFO, "Skipping invalid state file entry (%s:%d)", state_file, i );
+            continue;
+        }
+
+        hptr = slabAlloc( &host_slab );
         if( !hptr )
         {
             if( loglevel >= 1 )
                 printLog( LOG_ERR, "Out of memory" );
             break;
         }
-        hptr->access_time = atime;
-        hptr->count = count;
-        hptr->hostname = strdup( ip );
-        STAILQ_INSERT_TAIL( &gptr->hosts, hptr, next );
-        gptr->host_count++;
+        hptr->access_time = atime - time_base;
+        hptr->count = count < HOST_MAX_COUNT ? count : HOST_MAX_COUNT;
+        // numeric addresses are saved with the prefix length of the group
+        numeric = parseAddress( ip, strcspn( ip, "/" ), addr );
+        if( numeric )
+            maskAddress( addr, gptr->prefix4, gptr->prefix6 );
+        if( nameHost( hptr, numeric ? addr : NULL, ip, strlen( ip ) ) )
+        {
+            slabFree( &host_slab, hptr );
+            if( loglevel >= 1 )
+                printLog( LOG_ERR, "Out of memory" );
+            break;
+        }
+        if( watchHost( gptr, hptr ) )
+        {
+            freeHost( hptr );
+            if( loglevel >= 1 )
+                printLog( LOG_ERR, "Out of memory" );
+            break;
+        }
     }
 
     if( (sl != -1 || gptr) && loglevel >= 1 )
         printLog( LOG_WARNING, "Mismatch in number of groups in state file %s", state_file );
 
-    free( line );
-    fclose( sf );
+    free( line );
+    fclose( sf );
+}
+
+void saveState( const char* state_file, const char config_hash[65] )
+{
+    struct bgroup *gptr;
+    struct host *hptr;
+    char name[ADDR_SIZE];
+    FILE* sf;
+    time_t ct = time( NULL );
+
+    if( !state_file ) return;
+    if( !(sf = fopen( state_file, "w" )) )
+    {
+        if( loglevel >= 1 )
+            printLog( LOG_WARNING, "Could not open state file '%s' for writing.", state_file );
+        return;
+    }
+    fprintf( sf, "%.64s\n", config_hash );
+    fprintf( sf, "# banhammer watch list state %s# Time\t\tCount\tHost\n", ctime( &ct ) );      // ctime includes \n
+
+    STAILQ_FOREACH( gptr, &groups, next )
+    {
+        STAILQ_FOREACH( hptr, &gptr->hosts, next )
+            fprintf( sf, "%ld\t%u\t%s\n", (long)hostTime( hptr ), hptr->count, hostName( gptr, hptr, name, sizeof(name) ) );
+        fprintf( sf, "\n" );
+    }
+
+    fchmod( fileno( sf ), S_IWUSR|S_IRUSR|S_IRGRP|S_IROTH );
+    fchown( fileno( sf ), 0, -1 );
+    fclose( sf );
+}
+#endif
+
+// Add groups from a file to the global group table
+int readConfigFile( const char* file )
+{
+    FILE* f;
+    char* line = NULL;
+    size_t size = 0;
+#ifdef HAVE_LIBMD
+    ssize_t len;
+#endif
+    int rc, ec = 0;
+    struct bgroup* g;
+    unsigned int lc = 0;
+
+    f = fopen( file, "r" );
+    if( !f )
+    {
+        printLog( LOG_WARNING, "Cannot open configuration file '%s'", file );
+        return -1;
+    }
+
+#ifdef HAVE_LIBMD
+    char data[1024];
+    while( (len = fread( data, 1, sizeof(data), f )) > 0 )
+        SHA256_Update( &sha256_ctx, data, len );
+    rewind( f );
+#endif
+
+    // read in all groups from the file
+    while( readline( &line, &size, f ) != -1 )
+    {
+        lc++;
+        if( (*line == '\0') || (*line == '#') ) continue;    // skip blank lines & comments
+
+        // try to parse current line as group definition
+        if( (rc = parseGroupData( line, &g )) )
+        {
+            printLog( LOG_WARNING, "%s:%i  %s", file, lc, error_messages[rc] );
+            ec++;
+        }
+
+        // read in regexps for this group until we hit a blank line
+        while( readline( &line, &size, f ) > 0 )
+        {
+            lc++;
+            if( *line == '#' ) continue;                     // skip comments
+
+            if( g && (rc = addRegexp( line, g )) )
+            {
+                printLog( LOG_WARNING, "%s:%i  %s", file, lc, error_messages[rc] );
+                ec++;
+            }
+        }
+        lc++;    // count the empty line
+
+        // if a block was read, add it block to the global groups table or free it
+        if( g )
+        {
+            if( g->reg_count > 0 )
+                STAILQ_INSERT_TAIL( &groups, g, next );
+            else
+            {
+                rx_free( g->exclude );
+                free( g->sketch );
+                free( g->program );
+                free( g );
+            }
+        }
+    }
+
+    // clean up
+    fclose( f );
+    free( line );
+
+    return ec;
+}
+
+// Set up the match data for one thread for pattern with up to nmatch captures
+static int initMatcher( struct matcher* m, int nmatch )
+{
+    m->allocations = 0;
+    if( !(m->literals = ac_hits_create( prefilter )) )
+        return 1;
+
+#ifdef HAVE_LIBPCRE2
+    // all memory PCRE2 needs for matching comes from our counting allocator
+    // (the allocations made while setting up do not count)
+    m->gc = pcre2_general_context_create( pcreMalloc, pcreFree, &m->allocations );
+    if( !m->gc || !(m->md = pcre2_match_data_create( nmatch, m->gc )) || !(m->mc = pcre2_match_context_create( m->gc )) )
+        return 1;
+    m->ovector = pcre2_get_ovector_pointer( m->md );
+    m->combined = NULL;
+    pcre2_set_callout( m->mc, pcreBranch, m );
+
+    // dedicated JIT stack for all JIT compiled pattern
+    m->js = pcre2_jit_stack_create( jit_stack_start, jit_stack_max, m->gc );
+    if( m->js )
+        pcre2_jit_stack_assign( m->mc, NULL, m->js );
+    else if( loglevel >= 1 )
+        printLog( LOG_WARNING, "Error allocating PCRE2 JIT stack, using default stack." );
+#else
+    m->nmatch = nmatch;
+    if( !(m->pmatch = (regmatch_t*) calloc( nmatch, sizeof(regmatch_t) )) )
+        return 1;
+#endif
+    m->allocations = 0;
+
+    return 0;
+}
+
+// Free the match data of one thread
+static void freeMatcher( struct matcher* m )
+{
+#ifdef HAVE_LIBPCRE2
+    if( m->md ) pcre2_match_data_free( m->md );
+    if( m->mc ) pcre2_match_context_free( m->mc );
+    if( m->js ) pcre2_jit_stack_free( m->js );
+    if( m->gc ) pcre2_general_context_free( m->gc );
+#else
+    free( m->pmatch );
+#endif
+    ac_hits_free( m->literals );
+}
+
+// Match one line against all groups that apply to it and append the hits to
+// the batch. Only reads the configuration, so it can run in several threads.
+static void matchLine( struct matcher* m, const char* line, size_t length, struct batch* b )
+{
+    struct syslog_header hdr = { 0 };
+    struct dispatch *disp;
+    struct bgroup *gptr;
+    struct regexp *rptr;
+    struct hit *h;
+    const char *subject;
+    size_t sublen;
+    unsigned int j;
+    int rc, done;
+
+    // find literals in this line in a single pass, skip lines that cannot match any pattern
+    if( (ac_scan( prefilter, m->literals, line, length ) == 0) && (unfiltered_count == 0) )
+    {
+        b->rejected++;
+        return;
+    }
+
+    // only look at the groups that can apply to the program that logged this line
+    disp = dispatch_default;
+    if( dispatch_programs > 0 )
+    {
+        if( parseHeader( line, length, &hdr ) == 0 )
+            disp = findDispatch( hdr.tag, hdr.taglen );
+        else
+            b->noheader++;
+    }
+
+    // check all groups agains this string
+    for( j = 0; j < disp->count; j++ )
+    {
+        // groups restricted to one program only see the message body
+        gptr = disp->groups[j];
+        subject = gptr->program ? line + hdr.body : line;
+        sublen = gptr->program ? length - hdr.body : length;
+
+        // groups with a combined pattern are matched in one pass
+        if( gptr->branch )
+        {
+            if( matchCombined( gptr, subject, sublen, m, &b->hits[b->nhits] ) )
+            {
+                b->nhits++;
+                // proceed according to settings (continue=yes is not allowed for combined pattern)
+                if( !(gptr->flags & BIF_CONTINUE) )
+                    break;
+            }
+            continue;
+        }
+
+        done = 0;
+        STAILQ_FOREACH( rptr, &gptr->regexps, next )
+        {
+            // skip pattern whose required literal does not occur in the line
+            if( (rptr->literal >= 0) && !ac_hit( m->literals, rptr->literal ) )
+                continue;
+
+            if( loglevel >= 3 )
+                printLog( LOG_DEBUG, "%s", line );
+            h = &b->hits[b->nhits];
+#ifdef HAVE_LIBPCRE2
+            if( rptr->jit )
+                rc = pcre2_jit_match( rptr->re, (PCRE2_SPTR)subject, sublen, 0, PCRE2_NOTEMPTY, m->md, m->mc );
+            else
+                rc = pcre2_match( rptr->re, (PCRE2_SPTR)subject, sublen, 0, PCRE2_NOTEMPTY, m->md, m->mc );
+
+            if( rc <= 0 )
+            {
+                if( rc != PCRE2_ERROR_NOMATCH )
+                {
+                    if( loglevel < 3 ) printLog( LOG_ERR, "%s", line );
+                    printLog( LOG_ERR, "Error in pcre2_match for regexp '%s' (rc=%d).", rptr->exp, rc );
+                }
+            }
+            else if( pcreGetSubstring( subject, m->ovector, rc, rptr->host, &h->host, &h->hostlen ) ||
+                     pcreGetSubstring( subject, m->ovector, rc, 1, &h->host, &h->hostlen ) )
+#else
+            m->pmatch[0].rm_so = 0;
+            m->pmatch[0].rm_eo = sublen;
+            rc = regexec( &rptr->re, subject, m->nmatch, m->pmatch, REG_STARTEND );
+
+            if( rc )
+            {
+                if( rc != REG_NOMATCH )
+                {
+                    if( loglevel < 3 ) printLog( LOG_ERR, "%s", line );
+                    printLog( LOG_ERR, "Error in regexec for regexp '%s' (rc=%d).", rptr->exp, rc );
+                }
+            }
+            else if( regexGetSubstring( subject, &m->pmatch[rptr->host], &h->host, &h->hostlen ) )
+#endif
+            {
+                // we caught a bad guy!
+                if( loglevel >= 3 )
+                    printLog( LOG_DEBUG, "Regular expression '%s' matches with host '%.*s'.", rptr->exp, (int)h->hostlen, h->host );
+                h->group = gptr;
+                h->regexp = rptr;
+                b->nhits++;
+                // proceed according to settings
+                if( !(gptr->flags & BIF_CONTINUE) )
+                    done = 1;
+                else if( gptr->flags & BIF_SKIP )
+                    break;
+            }
+            else
+                if( loglevel >= 1 )
+                {
+                    if( loglevel < 3 ) printLog( LOG_NOTICE, "%s", line );
+                    printLog( LOG_NOTICE, "No substrings in matching regexp '%s' (rc=%d).", rptr->exp, rc );
+                }
+        }
+        if( done ) break;
+    }
+}
+
+// Match all lines of a batch
+static void matchBatch( struct matcher* m, struct batch* b )
+{
+    struct hit* h;
+    size_t k;
+
+    b->nhits = 0;
+    b->rejected = b->noheader = 0;
+    b->allocations = m->allocations;
+
+    for( k = 0; k < b->count; k++ )
+        matchLine( m, b->lines[k].line, b->lines[k].length, b );
+
+    // check numeric addresses against the exclusions and normalize them to the
+    // prefix watched by their group here, so it happens in parallel with several threads
+    for( k = 0; k < b->nhits; k++ )
+    {
+        h = &b->hits[k];
+        h->excluded = 0;
+        if( (h->numeric = parseAddress( h->host, h->hostlen, h->addr )) )
+        {
+            h->excluded = (exclude && rx_match( exclude, h->addr, 128 )) ||
+                          (h->group->exclude && rx_match( h->group->exclude, h->addr, 128 ));
+            maskAddress( h->addr, h->group->prefix4, h->group->prefix6 );
+        }
+    }
+
+    b->allocations = m->allocations - b->allocations;
+}
+
+// Apply the hits of a matched batch to the watch lists (always in the main thread)
+static void commitBatch( struct batch* b )
+{
+    size_t k;
+
+    lines_read += b->count;
+    lines_rejected += b->rejected;
+    lines_noheader += b->noheader;
+    allocations += b->allocations;
+
+    for( k = 0; k < b->nhits; k++ )
+    {
+        b->hits[k].regexp->matches++;
+        if( b->hits[k].excluded )
+        {
+            // excluded addresses leave no trace on the watch list
+            b->hits[k].group->excluded++;
+            if( loglevel >= 3 )
+                printLog( LOG_DEBUG, "Ignoring hit from excluded host '%.*s'.", (int)b->hits[k].hostlen, b->hits[k].host );
+        }
+        else
+            checkHost( b->hits[k].host, b->hits[k].hostlen, b->hits[k].numeric ? b->hits[k].addr : NULL, b->hits[k].group );
+    }
+}
+
+// Read the next batch of lines from standard input, the followed log files or the syslog sockets.
+// Returns the number of lines, 0 at the end of input, or -1 on error.
+static ssize_t readInput( struct lr_line* batch, size_t max )
+{
+    ssize_t n;
+
+    if( caught_info )
+    {
+        caught_info = 0;
+        printTable( );
+    }
+
+    if( !tail && !listener )
+        return lr_read( input, batch, max );
+
+    // followed log files and sockets never end, only a signal makes us stop
+    for( ;; )
+    {
+        n = tail ? tl_read( tail, batch, max ) : sl_read( listener, batch, max );
+        if( caught_info )
+        {
+            caught_info = 0;
+            printTable( );
+        }
+        if( (n >= 0) || ((errno != EAGAIN) && (errno != EINTR)) )
+            return n;
+        if( caught_signal == SIGHUP )
+        {
+            errno = EINTR;
+            return -1;
+        }
+        if( caught_signal )
+            return 0;
+    }
+}
+
+#ifdef HAVE_LIBPTHREAD
+// Check if readInput would return without waiting for input
+static int inputReady( )
+{
+    return tail ? tl_ready( tail ) : listener ? sl_ready( listener ) : lr_ready( input );
 }
+#endif
 
-void saveState( const char* state_file, const char config_hash[65] )
+// Read and match all input in the main thread.
+// Returns the result of the last lr_read.
+static ssize_t matchSerial( struct matcher* m, struct batch* b )
 {
-    struct bgroup *gptr;
-    struct host *hptr;
-    FILE* sf;
-    time_t ct = time( NULL );
+    ssize_t n;
 
-    if( !state_file ) return;
-    if( !(sf = fopen( state_file, "w" )) )
+    while( (n = readInput( b->lines, LINE_BATCH )) > 0 )
     {
-        if( loglevel >= 1 )
-            printLog( LOG_WARNING, "Could not open state file '%s' for writing.", state_file );
-        return;
+        b->count = n;
+        matchBatch( m, b );
+        commitBatch( b );
     }
-    fprintf( sf, "%.64s\n", config_hash );
-    fprintf( sf, "# banhammer watch list state %s# Time\t\tCount\tHost\n", ctime( &ct ) );      // ctime includes \n
 
-    STAILQ_FOREACH( gptr, &groups, next )
+    return n;
+}
+
+#ifdef HAVE_LIBPTHREAD
+// state shared between the main thread and the matching threads
+struct pipeline {
+    pthread_mutex_t lock;           // Protects all of the following
+    pthread_cond_t work;            // Signalled when a batch was queued or the threads should stop
+    pthread_cond_t done;            // Signalled when a batch was matched
+    struct batch* batches;          // Ring of batches
+    unsigned int nbatches;          // Number of batches
+    unsigned long queued;           // Number of batches queued for matching so far
+    unsigned long claimed;          // Number of batches taken by a matching thread so far
+    int stop;                       // Threads should exit once the queue is empty
+};
+
+static struct pipeline pipeline;
+
+// Matching thread: take the oldest queued batch and match it until told to stop
+static void* matchWorker( void* arg )
+{
+    struct matcher* m = (struct matcher*) arg;
+    struct batch* b;
+
+    pthread_mutex_lock( &pipeline.lock );
+    for( ;; )
     {
-        STAILQ_FOREACH( hptr, &gptr->hosts, next )
-            fprintf( sf, "%ld\t%u\t%s\n", hptr->access_time, hptr->count, hptr->hostname );
-        fprintf( sf, "\n" );
+        while( !pipeline.stop && (pipeline.claimed == pipeline.queued) )
+            pthread_cond_wait( &pipeline.work, &pipeline.lock );
+        if( pipeline.claimed == pipeline.queued )
+            break;
+        b = &pipeline.batches[pipeline.claimed++ % pipeline.nbatches];
+        pthread_mutex_unlock( &pipeline.lock );
+
+        matchBatch( m, b );
+
+        pthread_mutex_lock( &pipeline.lock );
+        b->done = 1;
+        pthread_cond_signal( &pipeline.done );
     }
+    pthread_mutex_unlock( &pipeline.lock );
 
-    fchmod( fileno( sf ), S_IWUSR|S_IRUSR|S_IRGRP|S_IROTH );
-    fchown( fileno( sf ), 0, -1 );
-    fclose( sf );
+    return NULL;
 }
-#endif
 
-// Add groups from a file to the global group table
-int readConfigFile( const char* file )
+// Copy the lines of a batch out of the input buffer, which is reused by the next lr_read
+static int copyBatch( struct batch* b )
 {
-    FILE* f;
-    char* line = NULL;
-    size_t size = 0;
-    ssize_t len;
-    int rc, ec = 0;
-    struct bgroup* g;
-    unsigned int lc = 0;
+    size_t k, size = 0;
+    char* p;
 
-    f = fopen( file, "r" );
-    if( !f )
+    for( k = 0; k < b->count; k++ )
+        size += b->lines[k].length + 1;
+
+    if( size > b->datasize )
     {
-        printLog( LOG_WARNING, "Cannot open configuration file '%s'", file );
-        return -1;
+        allocations++;
+        if( !(p = (char*) realloc( b->data, 2*size )) )
+            return 1;
+        b->data = p;
+        b->datasize = 2*size;
     }
 
-#ifdef HAVE_LIBMD
-    char data[1024];
-    while( (len = fread( data, 1, sizeof(data), f )) > 0 )
-        SHA256_Update( &sha256_ctx, data, len );
-    rewind( f );
-#endif
-
-    // read in all groups from the file
-    while( readline( &line, &size, f ) != -1 )
+    p = b->data;
+    for( k = 0; k < b->count; k++ )
     {
-        lc++;
-        if( (*line == '\0') || (*line == '#') ) continue;    // skip blank lines & comments
+        memcpy( p, b->lines[k].line, b->lines[k].length + 1 );
+        b->lines[k].line = p;
+        p += b->lines[k].length + 1;
+    }
 
-        // try to parse current line as group definition
-        if( (rc = parseGroupData( line, &g )) )
+    return 0;
+}
+
+// Read input in the main thread, match it in one thread per matcher, and
+// apply the hits in the main thread in input order, so the watch lists end
+// up exactly as if all lines were matched one after the other.
+// Returns the result of the last lr_read.
+static ssize_t matchThreaded( struct matcher* m, unsigned int nmatchers, struct batch* batches, unsigned int nbatches )
+{
+    pthread_t tid[MAX_THREADS];
+    sigset_t all, old;
+    unsigned long committed = 0;
+    unsigned int i, started = 0;
+    ssize_t n = 1;
+    int error = 0;
+    struct batch* b;
+
+    pthread_mutex_init( &pipeline.lock, NULL );
+    pthread_cond_init( &pipeline.work, NULL );
+    pthread_cond_init( &pipeline.done, NULL );
+    pipeline.batches = batches;
+    pipeline.nbatches = nbatches;
+    pipeline.queued = pipeline.claimed = 0;
+    pipeline.stop = 0;
+
+    // signals are left to the main thread (SIGHUP has to interrupt its read)
+    sigfillset( &all );
+    pthread_sigmask( SIG_BLOCK, &all, &old );
+    for( i = 0; i < nmatchers; i++ )
+        if( pthread_create( &tid[started], NULL, matchWorker, &m[i] ) == 0 )
+            started++;
+    pthread_sigmask( SIG_SETMASK, &old, NULL );
+
+    if( started < nmatchers && loglevel >= 1 )
+        printLog( LOG_WARNING, "Could only start %u of %u matching threads.", started, nmatchers );
+
+    pthread_mutex_lock( &pipeline.lock );
+    while( started > 0 )
+    {
+        // apply the hits of matched batches in input order
+        while( (committed < pipeline.queued) && batches[committed % nbatches].done )
         {
-            printLog( LOG_WARNING, "%s:%i  %s", file, lc, error_messages[rc] );
-            ec++;
+            b = &batches[committed % nbatches];
+            pthread_mutex_unlock( &pipeline.lock );
+            commitBatch( b );
+            pthread_mutex_lock( &pipeline.lock );
+            b->done = 0;
+            committed++;
         }
 
-        // read in regexps for this group until we hit a blank line
-        while( readline( &line, &size, f ) > 0 )
+        // after the end of input, just wait for the remaining batches
+        if( n <= 0 )
         {
-            lc++;
-            if( *line == '#' ) continue;                     // skip comments
+            if( committed == pipeline.queued )
+                break;
+            pthread_cond_wait( &pipeline.done, &pipeline.lock );
+            continue;
+        }
 
-            if( g && (rc = addRegexp( line, g )) )
+        // wait for a batch to be matched if all are in use, or if we would
+        // otherwise block in read while there are hits to be applied
+        if( (pipeline.queued - committed == nbatches) || ((committed < pipeline.queued) && !inputReady( )) )
+        {
+            pthread_cond_wait( &pipeline.done, &pipeline.lock );
+            continue;
+        }
+        pthread_mutex_unlock( &pipeline.lock );
+
+        // the next batch in the ring is free, only we queue batches
+        b = &batches[pipeline.queued % nbatches];
+        n = readInput( b->lines, LINE_BATCH );
+        if( n < 0 )
+            error = errno;
+        else if( n > 0 )
+        {
+            b->count = n;
+            if( copyBatch( b ) )
             {
-                printLog( LOG_WARNING, "%s:%i  %s", file, lc, error_messages[rc] );
-                ec++;
+                printLog( LOG_ERR, "%s", error_messages[ERR_OUT_OF_MEMORY] );
+                error = ENOMEM;
+                n = -1;
             }
         }
-        lc++;    // count the empty line
 
-        // if a block was read, add it block to the global groups table or free it
-        if( g )
+        pthread_mutex_lock( &pipeline.lock );
+        if( n > 0 )
         {
-            if( g->reg_count > 0 )
-                STAILQ_INSERT_TAIL( &groups, g, next );
-            else
-                free( g );
+            pipeline.queued++;
+            pthread_cond_signal( &pipeline.work );
         }
     }
+    pipeline.stop = 1;
+    pthread_cond_broadcast( &pipeline.work );
+    pthread_mutex_unlock( &pipeline.lock );
 
-    // clean up
-    fclose( f );
-    free( line );
+    for( i = 0; i < started; i++ )
+        pthread_join( tid[i], NULL );
 
-    return ec;
+    pthread_cond_destroy( &pipeline.done );
+    pthread_cond_destroy( &pipeline.work );
+    pthread_mutex_destroy( &pipeline.lock );
+
+    // no threads at all, do it ourselves
+    if( started == 0 )
+        return matchSerial( &m[0], &batches[0] );
+
+    errno = error;
+    return n;
 }
+#endif
 
 // The main program loop
 int mainLoop( int argc, char *argv[] )
 {
-    char *line = NULL, ch;
-    int rc, i, done = 0;
-    size_t length;
+    char *p, ch;
+    int rc, i, done = 0, check = 0;
+    ssize_t n;
+    struct matcher *matchers;
+    struct batch *batches;
+    unsigned int nmatchers, nbatches;
 #ifdef WITH_USERS
     struct passwd *pwd;
     struct group *grp;
 #endif
     int nmatch = 0;
-    char *hostname;
-#ifdef HAVE_LIBPCRE2
-    pcre2_match_data *md;
-    PCRE2_SIZE hostlen;
-#else
-    regmatch_t *pmatch;
-#endif
-    struct host *hptr;
+    unsigned int j;
     struct regexp *rptr;
     struct bgroup *gptr;
 
     STAILQ_INIT( &groups );
 
+    // we are being reloaded
+    if( caught_signal == SIGHUP )
+        caught_signal = 0;
+
+    // set up empty prefilter to be filled while reading config files. An
+    // earlier run that returned early on an error may have left one behind.
+    ac_free( prefilter );
+    literal_count = unfiltered_count = 0;
+    if( !(prefilter = ac_create( )) )
+    {
+        printLog( LOG_ERR, "%s", error_messages[ERR_OUT_OF_MEMORY] );
+        return( EX_OSERR );
+    }
+
 #ifdef HAVE_LIBMD
     char config_hash[65] = { 0 };
     char* save_state = NULL;
@@ -941,6 +2989,15 @@ int mainLoop( int argc, char *argv[] )
     const struct option longopts[] = {
         { "directory", required_argument, NULL, 'd' },
         { "file", required_argument, NULL, 'f' },
+        { "maxline", required_argument, NULL, 'l' },
+        { "follow", required_argument, NULL, 'F' },
+        { "offsets", required_argument, NULL, 'o' },
+        { "listen", required_argument, NULL, 'L' },
+        { "exclude", required_argument, NULL, 'x' },
+    #ifdef HAVE_LIBPTHREAD
+        { "threads", required_argument, NULL, 't' },
+        { "resolvers", required_argument, NULL, 'r' },
+    #endif
     #ifdef WITH_USERS
         { "group", required_argument, NULL, 'g' },
         { "user", required_argument, NULL, 'u' },
@@ -957,11 +3014,50 @@ int mainLoop( int argc, char *argv[] )
     };
 
     // process command line
-    while( (ch = getopt_long( argc, argv, "d:f:u:g:S:chqvV", longopts, NULL )) != -1 )
+    max_line = default_max_line;
+    follow_count = 0;
+    listen_count = 0;
+    offsets_file = NULL;
+#ifdef HAVE_LIBPTHREAD
+    threads = 1;
+    resolvers = 2;
+#endif
+    while( (ch = getopt_long( argc, argv, "d:f:l:t:r:u:g:S:F:o:L:x:chqvV", longopts, NULL )) != -1 )
         switch( ch ) {
             case 'c':
                 // in check mode, we don't enter main loop by closing stdin
                 fclose( stdin );
+                check = 1;
+                break;
+
+            case 'F':
+                if( follow_count >= MAX_FOLLOW )
+                {
+                    printLog( LOG_ALERT, "Too many log files to follow (at most %d).", MAX_FOLLOW );
+                    return( EX_CONFIG );
+                }
+                follow_files[follow_count++] = optarg;
+                break;
+
+            case 'o':
+                offsets_file = optarg;
+                break;
+
+            case 'L':
+                if( listen_count >= MAX_LISTEN )
+                {
+                    printLog( LOG_ALERT, "Too many syslog sockets to listen on (at most %d).", MAX_LISTEN );
+                    return( EX_CONFIG );
+                }
+                listen_addresses[listen_count++] = optarg;
+                break;
+
+            case 'x':
+                if( addExclude( &exclude, optarg ) )
+                {
+                    printLog( LOG_ALERT, "Invalid exclusion '%s'.", optarg );
+                    return( EX_CONFIG );
+                }
                 break;
 
             case 'd':
@@ -977,6 +3073,35 @@ int mainLoop( int argc, char *argv[] )
                 done = 1;
                 break;
 
+            case 'l':
+                max_line = strtoul( optarg, &p, 10 );
+                if( (*optarg == '\0') || (*p != '\0') || (max_line < 16) || (max_line > 1024*1024) )
+                {
+                    printLog( LOG_ALERT, "Invalid maximum line length '%s' (16 to 1048576).", optarg );
+                    return( EX_CONFIG );
+                }
+                break;
+
+#ifdef HAVE_LIBPTHREAD
+            case 't':
+                threads = strtoul( optarg, &p, 10 );
+                if( (*optarg == '\0') || (*p != '\0') || (threads < 1) || (threads > MAX_THREADS) )
+                {
+                    printLog( LOG_ALERT, "Invalid number of threads '%s' (1 to %d).", optarg, MAX_THREADS );
+                    return( EX_CONFIG );
+                }
+                break;
+
+            case 'r':
+                resolvers = strtoul( optarg, &p, 10 );
+                if( (*optarg == '\0') || (*p != '\0') || (resolvers > MAX_RESOLVERS) )
+                {
+                    printLog( LOG_ALERT, "Invalid number of resolvers '%s' (0 to %d).", optarg, MAX_RESOLVERS );
+                    return( EX_CONFIG );
+                }
+                break;
+#endif
+
 #ifdef WITH_USERS
             case 'u':
                 uid_name = optarg;
@@ -1032,6 +3157,13 @@ int mainLoop( int argc, char *argv[] )
         return( EX_CONFIG );
     }
 
+    // only one source of input lines
+    if( (follow_count > 0) && (listen_count > 0) )
+    {
+        printLog( LOG_ALERT, "Log files to follow and syslog sockets cannot be combined." );
+        return( EX_USAGE );
+    }
+
     // read default config if none was specified on the command line
     if( !done )
         if( readConfigFile( default_config_file ) )
@@ -1050,6 +3182,26 @@ int mainLoop( int argc, char *argv[] )
         return( EX_CONFIG );
     }
 
+    // reserve host records and their index for all watch lists up front, so matching rarely has to allocate any
+    if( !time_base )
+        time_base = time( NULL );
+    j = 0;
+    STAILQ_FOREACH( gptr, &groups, next )
+    {
+        i = gptr->max_hosts > 0 ? gptr->max_hosts : HOST_CHUNK;
+        j += i;
+        if( sizeIndex( gptr, i < HOST_RESERVE ? i : HOST_RESERVE ) )
+        {
+            printLog( LOG_ERR, "%s", error_messages[ERR_OUT_OF_MEMORY] );
+            return( EX_OSERR );
+        }
+    }
+    if( slabReserve( &host_slab, j < HOST_RESERVE ? j : HOST_RESERVE ) || slabReserve( &name_slab, NAME_CHUNK ) )
+    {
+        printLog( LOG_ERR, "%s", error_messages[ERR_OUT_OF_MEMORY] );
+        return( EX_OSERR );
+    }
+
 #ifdef HAVE_LIBMD
     // Finish hash over all config files and try to load saved state
     SHA256_End( &sha256_ctx, config_hash );
@@ -1057,6 +3209,80 @@ int mainLoop( int argc, char *argv[] )
         loadState( state_file, config_hash );
 #endif
 
+    // open the log files to follow before changing root, keeping the position in files followed already
+    if( follow_count > 0 )
+    {
+        if( !tail )
+        {
+            if( !(tail = tl_create( max_line )) )
+            {
+                printLog( LOG_ERR, "%s", error_messages[ERR_OUT_OF_MEMORY] );
+                return( EX_OSERR );
+            }
+            if( offsets_file && tl_load( tail, offsets_file ) && (loglevel >= 2) )
+                printLog( LOG_INFO, "No log file offsets in '%s', starting at the end of all log files.", offsets_file );
+        }
+        tl_begin( tail );
+        for( j = 0; j < follow_count; j++ )
+        {
+            rc = tl_add( tail, follow_files[j] );
+            if( rc < 0 )
+            {
+                printLog( LOG_ERR, "%s", error_messages[ERR_OUT_OF_MEMORY] );
+                return( EX_OSERR );
+            }
+            if( rc && (loglevel >= 1) )
+                printLog( LOG_WARNING, "Could not open log file '%s', waiting for it to appear.", follow_files[j] );
+        }
+        tl_prune( tail );
+        if( tl_limit( tail, max_line ) )
+        {
+            printLog( LOG_ERR, "Error allocating input buffer for lines of %lu characters.", (unsigned long)max_line );
+            return( EX_OSERR );
+        }
+    }
+    else if( tail )
+    {
+        tl_free( tail );
+        tail = NULL;
+    }
+
+    // bind the syslog sockets before changing root and dropping privileges, keeping those bound already
+    if( listen_count > 0 )
+    {
+        if( !listener && !(listener = sl_create( max_line )) )
+        {
+            printLog( LOG_ERR, "%s", error_messages[ERR_OUT_OF_MEMORY] );
+            return( EX_OSERR );
+        }
+        sl_begin( listener );
+        for( j = 0; j < listen_count; j++ )
+        {
+            rc = sl_add( listener, listen_addresses[j] );
+            if( rc > 0 )
+            {
+                printLog( LOG_ALERT, "Invalid syslog socket address '%s'.", listen_addresses[j] );
+                return( EX_CONFIG );
+            }
+            if( rc < 0 )
+            {
+                printLog( LOG_ERR, "Could not listen on '%s': %s", listen_addresses[j], strerror( errno ) );
+                return( EX_OSERR );
+            }
+        }
+        if( sl_prune( listener ) )
+        {
+            printLog( LOG_ERR, "%s", error_messages[ERR_OUT_OF_MEMORY] );
+            return( EX_OSERR );
+        }
+        sl_limit( listener, max_line );
+    }
+    else if( listener )
+    {
+        sl_free( listener );
+        listener = NULL;
+    }
+
     // chroot to safe directory
     // from now on we don't do file I/O any more (except if we receive a SIGHUP, which is not supported in chroot mode)
     if( root_dir )
@@ -1083,8 +3309,30 @@ int mainLoop( int argc, char *argv[] )
     // Update the list of local network interfaces at this point
     updateLocalInterfaces( );
 
+    // merge pattern of groups that asked for it into a single combined pattern
+    STAILQ_FOREACH( gptr, &groups, next )
+        if( (gptr->flags & BIF_COMBINE) && combineRegexps( gptr ) && (loglevel >= 1) )
+            printLog( LOG_WARNING, "Could not combine pattern for table %d, matching them one by one.", gptr->table );
+
     // find largest number of matching pattern and allocate ovector/pmatch accordingly
     STAILQ_FOREACH( gptr, &groups, next )
+    {
+        if( gptr->branch )
+        {
+#ifdef HAVE_LIBPCRE2
+            rc = pcre2_pattern_info( gptr->combined, PCRE2_INFO_CAPTURECOUNT, &i );
+            if( rc < 0 )
+            {
+                printLog( LOG_ERR, "Error getting number of PCRE2 regexp subpattern for combined regexp of table %d (rc=%d).", gptr->table, rc );
+                return( EX_SOFTWARE );
+            }
+            if( i > nmatch )
+                nmatch = i;
+#else
+            if( gptr->combined.re_nsub > (size_t)nmatch )
+                nmatch = gptr->combined.re_nsub;
+#endif
+        }
         STAILQ_FOREACH( rptr, &gptr->regexps, next )
         {
 #ifdef HAVE_LIBPCRE2
@@ -1097,118 +3345,113 @@ int mainLoop( int argc, char *argv[] )
             if( i > nmatch )
                 nmatch = i;
 #else
-            if( rptr->re.re_nsub > nmatch )
+            if( rptr->re.re_nsub > (size_t)nmatch )
                 nmatch = rptr->re.re_nsub;
 #endif
         }
+    }
 
     nmatch++;
-#ifdef HAVE_LIBPCRE2
-    md = pcre2_match_data_create( nmatch, NULL );
-    if( !md )
+
+    // build the literal prefilter
+    if( ac_compile( prefilter ) )
     {
-        printLog( LOG_ERR, "Error allocating enough memory for match_data (%u matches).", nmatch );
+        printLog( LOG_ERR, "Error building literal prefilter for %u pattern.", literal_count );
         return( EX_OSERR );
     }
-#else
-    pmatch = (regmatch_t*) calloc( nmatch, sizeof(regmatch_t) );
-    if( !pmatch )
+    if( loglevel >= 3 )
+        printLog( LOG_DEBUG, "Literal prefilter covers %u of %u pattern.", literal_count, literal_count + unfiltered_count );
+
+    // build the index of groups by syslog program
+    buildDispatch( );
+
+    // set up the input buffer once, so input read before a SIGHUP is not lost
+    if( !tail && !listener && (input ? lr_limit( input, max_line ) : !(input = lr_create( STDIN_FILENO, max_line ))) )
     {
-        printLog( LOG_ERR, "Error allocating enough memory for pmatch (%lud bytes).", nmatch*sizeof(regmatch_t) );
+        printLog( LOG_ERR, "Error allocating input buffer for lines of %lu characters.", (unsigned long)max_line );
         return( EX_OSERR );
     }
+
+#ifdef HAVE_LIBPTHREAD
+    // start the firewall writer once, so matching never waits for IPFW
+    if( !check && !writer && !(writer = !fw_writer_start( WRITER_BATCH, WRITER_WAIT )) && (loglevel >= 1) )
+        printLog( LOG_WARNING, "Could not start firewall writer thread, adding addresses directly." );
 #endif
 
-    // main loop
-    while( (line = fgetln( stdin, &length )) )
+    // set up the resolver once, so host names queued before a SIGHUP are still blocked
+    if( !check && !resolver )
     {
-        // check all groups agains this string
-        STAILQ_FOREACH( gptr, &groups, next )
-        {
-            done = 0;
-            STAILQ_FOREACH( rptr, &gptr->regexps, next )
-            {
-                if( loglevel >= 3 )
-                    printLog( LOG_DEBUG, "%s", line );
-#ifdef HAVE_LIBPCRE2
-                rc = pcre2_match( rptr->re, (PCRE2_SPTR)line, length, 0, PCRE2_NOTEMPTY, md, NULL );
-
-                if( rc <= 0 )
-                {
-                    if( rc != PCRE2_ERROR_NOMATCH )
-                    {
-                        if( loglevel < 3 ) printLog( LOG_ERR, "%s", line );
-                        printLog( LOG_ERR, "Error in pcre2_match for regexp '%s' (rc=%d).", rptr->exp, rc );
-                    }
-                }
-                else if( (pcre2_substring_get_byname( md, (PCRE2_SPTR)"host", (PCRE2_UCHAR**)&hostname, &hostlen ) == 0) ||
-                         (pcre2_substring_get_bynumber( md, 1, (PCRE2_UCHAR**)&hostname, &hostlen ) == 0) )
-                {
-                    // we caught a bad guy!
-                    if( loglevel >= 3 )
-                        printLog( LOG_DEBUG, "Regular expression '%s' matches with host '%s'.", rptr->exp, hostname );
-                    rptr->matches++;
-                    checkHost( hostname, gptr );
-                    pcre2_substring_free( (PCRE2_UCHAR*)hostname );
-                    // proceed according to settings
-                    if( !(gptr->flags & BIF_CONTINUE) )
-                        done = 1;
-                    else if( gptr->flags & BIF_SKIP )
-                        break;
-                }
-                else
-                    if( loglevel >= 1 )
-                    {
-                        if( loglevel < 3 ) printLog( LOG_NOTICE, "%s", line );
-                        printLog( LOG_NOTICE, "No substrings in matching regexp '%s' (rc=%d).", rptr->exp, rc );
-                    }
+#ifdef HAVE_LIBPTHREAD
+        resolver = rs_create( resolvers, RESOLVER_CACHE, RESOLVER_TTL, RESOLVER_NEGTTL );
 #else
-                pmatch[0].rm_so = 0;
-                pmatch[0].rm_eo = length;
-                rc = regexec( &rptr->re, line, nmatch, pmatch, REG_STARTEND );
-
-                if( rc )
-                {
-                    if( rc != REG_NOMATCH )
-                    {
-                        if( loglevel < 3 ) printLog( LOG_ERR, "%s", line );
-                        printLog( LOG_ERR, "Error in regexec for regexp '%s' (rc=%d).", rptr->exp, rc );
-                    }
-                }
-                else if( regexGetSubstring( line, &pmatch[1], &hostname ) )
-                {
-                    // we caught a bad guy!
-                    if( loglevel >= 3 )
-                        printLog( LOG_DEBUG, "Regular expression '%s' matches with host '%s'.", rptr->exp, hostname );
-                    rptr->matches++;
-                    checkHost( hostname, gptr );
-                    free( hostname );
-                    // proceed according to settings
-                    if( !(gptr->flags & BIF_CONTINUE) )
-                        done = 1;
-                    else if( gptr->flags & BIF_SKIP )
-                        break;
-                }
-                else
-                    if( loglevel >= 1 )
-                    {
-                        if( loglevel < 3 ) printLog( LOG_NOTICE, "%s", line );
-                        printLog( LOG_NOTICE, "No substrings in matching regexp '%s' (rc=%d).", rptr->exp, rc );
-                    }
+        resolver = rs_create( 0, RESOLVER_CACHE, RESOLVER_TTL, RESOLVER_NEGTTL );
 #endif
-            }
-            if( done ) break;
+        if( !resolver )
+        {
+            printLog( LOG_ERR, "%s", error_messages[ERR_OUT_OF_MEMORY] );
+            return( EX_OSERR );
         }
     }
 
-    // save the return code in case we were interrupted (e.g. by SIGHUP)
-    rc = errno;
+    // every pattern can hit at most once per line
+    max_hits = 0;
+    STAILQ_FOREACH( gptr, &groups, next )
+        max_hits += gptr->reg_count;
 
-#ifdef HAVE_LIBPCRE2
-    pcre2_match_data_free( md );
+    // one matcher per thread and enough batches to keep them all busy
+#ifdef HAVE_LIBPTHREAD
+    nmatchers = threads;
+    nbatches = threads > 1 ? 2*threads : 1;
 #else
-    free( pmatch );
+    nmatchers = nbatches = 1;
+#endif
+    matchers = (struct matcher*) calloc( nmatchers, sizeof(struct matcher) );
+    batches = (struct batch*) calloc( nbatches, sizeof(struct batch) );
+    if( !matchers || !batches )
+    {
+        printLog( LOG_ERR, "%s", error_messages[ERR_OUT_OF_MEMORY] );
+        free( matchers );
+        free( batches );
+        return( EX_OSERR );
+    }
+    rc = 0;
+    for( j = 0; j < nmatchers; j++ )
+        rc |= initMatcher( &matchers[j], nmatch );
+    for( j = 0; j < nbatches; j++ )
+        rc |= !(batches[j].hits = (struct hit*) calloc( LINE_BATCH*max_hits, sizeof(struct hit) ));
+    if( rc )
+    {
+        printLog( LOG_ERR, "Error allocating match data for %u thread(s) (%u matches).", nmatchers, nmatch );
+        n = -1;
+        errno = ENOMEM;
+    }
+    else if( check )
+        n = 0;
+
+    // main loop: read batches of lines, match them, and apply the hits in input order
+#ifdef HAVE_LIBPTHREAD
+    else if( threads > 1 )
+        n = matchThreaded( matchers, nmatchers, batches, nbatches );
 #endif
+    else
+        n = matchSerial( &matchers[0], &batches[0] );
+
+    // save the return code in case we were interrupted (e.g. by SIGHUP)
+    rc = n < 0 ? errno : 0;
+
+    for( j = 0; j < nmatchers; j++ )
+        freeMatcher( &matchers[j] );
+    for( j = 0; j < nbatches; j++ )
+    {
+        free( batches[j].hits );
+        free( batches[j].data );
+    }
+    free( matchers );
+    free( batches );
+
+    // all lines handed out were matched and applied by now
+    if( tail && offsets_file && tl_save( tail, offsets_file ) && (loglevel >= 1) )
+        printLog( LOG_WARNING, "Could not save log file offsets to '%s'.", offsets_file );
 
 #ifdef HAVE_LIBMD
     // Save state before freeing
@@ -1216,7 +3459,9 @@ int mainLoop( int argc, char *argv[] )
         saveState( state_file, config_hash );
 #endif
 
-    // free groups
+    // free groups, once the resolver is done with their exclusions
+    rs_wait( resolver );
+    freeDispatch( );
     while( !STAILQ_EMPTY( &groups ) )
     {
         gptr = STAILQ_FIRST( &groups );
@@ -1233,15 +3478,30 @@ int mainLoop( int argc, char *argv[] )
 #endif
             free( rptr );
         }
-        while( !STAILQ_EMPTY( &gptr->hosts ) )
+        if( gptr->branch )
         {
-            hptr = STAILQ_FIRST( &gptr->hosts );
-            STAILQ_REMOVE_HEAD( &gptr->hosts, next );
-            free( hptr->hostname );
-            free( hptr );
+#ifdef HAVE_LIBPCRE2
+            pcre2_code_free( gptr->combined );
+#else
+            regfree( &gptr->combined );
+#endif
+            free( gptr->branch );
         }
+        free( gptr->index );
+        free( gptr->sketch );
+        rx_free( gptr->exclude );
+        free( gptr->program );
         free( gptr );
     }
+    rx_free( exclude );
+    exclude = NULL;
+    // the host records of all watch lists and the names of blocked hosts are released in one go
+    free( blocked_set );
+    blocked_set = NULL;
+    blocked_mask = blocked_count = 0;
+    freeHosts( );
+    ac_free( prefilter );
+    prefilter = NULL;
 
     // reset the error code that caused us to exit
     errno = rc;
@@ -1252,6 +3512,7 @@ int mainLoop( int argc, char *argv[] )
 // The main program
 int main( int argc, char *argv[] )
 {
+    struct sigaction sa;
     int rc;
 
     // open syslog
@@ -1261,8 +3522,16 @@ int main( int argc, char *argv[] )
     openlog( "banhammer", LOG_PID, LOG_AUTH );         // Apple style
 #endif
 
+    // select the firewall backend (set before options are parsed, which happens again on SIGHUP)
+    if( fw_select( getenv( FIREWALL_ENV ) ) )
+    {
+        syslog( LOG_ERR, "Unknown firewall backend %s.", getenv( FIREWALL_ENV ) );
+        closelog( );
+        errx( EX_CONFIG, "Unknown firewall backend %s.", getenv( FIREWALL_ENV ) );
+    }
+
     // see if we are root
-    if( geteuid( ) != 0 )
+    if( fw_privileged( ) && geteuid( ) != 0 )
     {
         syslog( LOG_ALERT, "Banhammer has to be run as root." );
         closelog( );
@@ -1273,13 +3542,17 @@ int main( int argc, char *argv[] )
     rc = fw_init( );
     if( rc )
     {
-        syslog( LOG_ERR, "Error initializing IPFW (rc=%d).", rc );
+        syslog( LOG_ERR, "Error initializing firewall %s (rc=%d).", fw_name( ), rc );
         closelog( );
-        errx( EX_CONFIG, "Error initializing IPFW (rc=%d).", rc );
+        errx( EX_CONFIG, "Error initializing firewall %s (rc=%d).", fw_name( ), rc );
     }
 
     // initialize PRNG
+#ifdef HAVE_SRANDOMDEV
     srandomdev( );
+#else
+    srandom( time( NULL ) ^ getpid( ) );
+#endif
 
     // setup signal handlers
     signal( SIGINT, signalHandler );
@@ -1287,17 +3560,32 @@ int main( int argc, char *argv[] )
     signal( SIGQUIT, signalHandler );
     signal( SIGPIPE, signalHandler );
     signal( SIGINFO, signalHandler );
-    signal( SIGHUP, signalHandler );
-    siginterrupt( SIGHUP, 1 );
+    // without SA_RESTART, so SIGHUP interrupts reading
+    memset( &sa, 0, sizeof(sa) );
+    sa.sa_handler = signalHandler;
+    sigemptyset( &sa.sa_mask );
+    sigaction( SIGHUP, &sa, NULL );
 
     // initialize and run while necessary (allows re-initializing via SIGHUP)
     do {
         rc = mainLoop( argc, argv );
         // reset getopt framework in case we restart due to SIGHUP
+#if HAVE_DECL_OPTRESET
         optreset = 1; opterr = 1; optind = 1;
+#else
+        opterr = 1; optind = 0;     // GNU getopt starts over with optind 0
+#endif
     } while( errno == EINTR );
 
-    // We are done here, clean up
+    // We are done here, clean up (error returns of mainLoop leave the prefilter)
+    ac_free( prefilter );
+    prefilter = NULL;
+    lr_free( input );
+    tl_free( tail );
+    sl_free( listener );
+    // blocks host names still waiting to be resolved and writes all queued addresses
+    rs_free( resolver );
+    fw_writer_stop( );
     fw_close( );
     closelog( );
 
@@ -43,29 +43,75 @@
 #include <netdb.h>
 #include <time.h>
 #include <pwd.h>
+#ifdef HAVE_LIBUTIL
 #include <libutil.h>
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#endif
 #include <getopt.h>
 #include <err.h>
 
 #include "banlib.h"
 
+// statistics are shown on SIGINFO, or on SIGUSR1 where there is none (Linux)
+#ifndef SIGINFO
+#define SIGINFO SIGUSR1
+#endif
+
 // entry type for tables we are watching
 struct table {
     u_int16_t table;
+    unsigned long count;            // Entries the table should have since it was listed
+    unsigned long generation;       // Generation count of the table when it was listed
+    time_t synced;                  // Time the table was listed (0 if never)
+    unsigned long due;              // Entries of the table expiring in this check
     STAILQ_ENTRY(table) next;
 };
 
 // head of list of tables we are watching
 STAILQ_HEAD( _tables, table ) tables = STAILQ_HEAD_INITIALIZER( tables );
 
+// prefix lengths into which blocked addresses are collapsed
+#define COLLAPSE4 24
+#define COLLAPSE6 48
+
+// table entry that may be collapsed into a prefix
+struct entry {
+    unsigned char addr[16];         // Address key of the entry (see parseAddress)
+    unsigned char prefix[16];       // Address key of the prefix it is collapsed into
+    unsigned int masklen;           // Prefix length of the entry within the address key
+    u_int32_t value;                // Associated value (expiration time or 0)
+};
+
+// expiration time of a table entry known from the last listing
+struct expiry {
+    u_int32_t value;                // Expiration time
+    u_int16_t table;                // Table of the entry
+    unsigned int masklen;           // Prefix length of the entry within the address key
+    unsigned char addr[16];         // Address key of the entry
+};
+
+// expired table entry waiting to be removed
+struct removal {
+    unsigned char addr[16];         // Address key of the entry
+    unsigned int masklen;           // Prefix length of the entry within the address key
+    u_int16_t table;                // Table of the entry
+};
+
+// most entries removed from a table with one firewall command
+#define REMOVE_BATCH 1024
+
 // default configuration options
 int loglevel = 2;
 static int sleep_time = 60;
+static int resync_time = 3600;
 static char* state_file = NULL;
 static char* pid_file = NULL;
 static char* root_dir = NULL;
 static char* ip_arg = NULL;
 static int show_hostname = 1;
+static unsigned int collapse_count = 0;
 
 // signal handler variable
 static int done = 0;
@@ -76,6 +122,100 @@ static FILE *sf = NULL;
 // global count of table entried
 static int count = 0;
 
+// table entries collected for collapsing
+static struct entry* entries = NULL;
+static size_t entry_count = 0, entry_size = 0;
+static int entry_failed = 0;
+static size_t collapsed = 0;
+
+// min-heap of the expiration times of all entries in the tables
+static struct expiry* expiries = NULL;
+static size_t expiry_count = 0, expiry_size = 0;
+
+// expired entries to be removed, in any order of tables
+static struct removal* removals = NULL;
+static size_t removal_count = 0, removal_size = 0;
+
+// time the tables are checked at, and entries found in the table being listed
+static time_t clean_time = 0;
+static unsigned long listed = 0;
+
+#ifndef HAVE_LIBUTIL
+// Replacement of the pid file functions of FreeBSD libutil. The pid file is
+// locked as long as it is open, so another instance cannot open it.
+struct pidfh {
+    int fd;                         // Open and locked pid file
+    char* path;                     // Path of the pid file
+};
+
+// Open and lock the pid file, returning the pid of the instance holding it in otherpid
+static struct pidfh* pidfile_open( const char* path, mode_t mode, pid_t* otherpid )
+{
+    struct pidfh* pfh;
+    char buf[16];
+    ssize_t n;
+    int fd;
+
+    *otherpid = 0;
+    if( (fd = open( path, O_RDWR | O_CREAT, mode )) < 0 )
+        return NULL;
+    if( flock( fd, LOCK_EX | LOCK_NB ) )
+    {
+        if( errno == EWOULDBLOCK )
+        {
+            n = read( fd, buf, sizeof(buf) - 1 );
+            buf[n > 0 ? n : 0] = '\0';
+            *otherpid = (pid_t) strtol( buf, NULL, 10 );
+            errno = EEXIST;
+        }
+        close( fd );
+        return NULL;
+    }
+
+    if( !(pfh = (struct pidfh*) malloc( sizeof(struct pidfh) )) || !(pfh->path = strdup( path )) )
+    {
+        free( pfh );
+        close( fd );
+        return NULL;
+    }
+    pfh->fd = fd;
+
+    return pfh;
+}
+
+// Write the current pid to the pid file
+static int pidfile_write( struct pidfh* pfh )
+{
+    char buf[16];
+    int len;
+
+    if( !pfh )
+        return -1;
+
+    len = snprintf( buf, sizeof(buf), "%d\n", (int)getpid( ) );
+    if( ftruncate( pfh->fd, 0 ) || (pwrite( pfh->fd, buf, len, 0 ) != len) )
+        return -1;
+
+    return 0;
+}
+
+// Remove and close the pid file
+static int pidfile_remove( struct pidfh* pfh )
+{
+    int rc;
+
+    if( !pfh )
+        return -1;
+
+    rc = unlink( pfh->path );
+    close( pfh->fd );
+    free( pfh->path );
+    free( pfh );
+
+    return rc;
+}
+#endif
+
 // show usage
 static void usage( )
 {
@@ -83,31 +223,45 @@ static void usage( )
           "\n"
           "Usage: banhammerd -h | -L [-n] -t tables | -C -t tables |\n"
           "                  -A HOST[,TIME] -t tables | -R HOST -t tables\n"
-          "                  -t tables [-s seconds] [-S statefile] [-p pidfile]\n"
-          "                  [-d directory] [-f] [-n] [-v] [-q]\n"
+          "                  -t tables [-s seconds] [-r seconds] [-S statefile]\n"
+          "                  [-p pidfile] [-c count] [-d directory] [-f] [-n] [-v] [-q]\n"
           " --help, -h\tprint this message and exit\n"
-          " --table, -t\tcomma separated list of IPFW table numbers to operate on\n"
+          " --table, -t\tcomma separated list of table numbers to operate on\n"
           " --list, -L\tlist the currently blocked hosts and exit\n"
           " --cron, -C\tperform one cleaning cycle and exit (\"cron mode\")\n"
           " --add, -A\tadd a blocked host to given table(s)\n"
           "          \tTIME is the duration (suffixes: s,m,h,d) or 0 for permanent\n"
           " --remove, -R\tremove a host from given table(s)\n"
-          " --sleep, -s\ttime in seconds between purging expired hosts (default: %d)\n"
-          " --statefile, -S\tsave and restore state of IPFW tables in file \"statefile\"\n"
+          " --sleep, -s\tmost seconds between checks of the tables for new hosts (default: %d)\n"
+          " --resync, -r\tseconds between full listings of unchanged tables (default: %d)\n"
+          " --collapse, -c\tcollapse more than count addresses in the same /%d or /%d\n"
+          "          \tinto one entry when purging\n"
+          " --statefile, -S\tsave and restore state of tables in file \"statefile\"\n"
           " --pidfile, -p\tPID filename\n"
           " --directory, -d\tchroot to this directory before running\n"
           " --foreground, -f\trun in foreground (do not daemonize)\n"
           " --noresolve, -n\tDo not look up hostname of IP addresses when listing\n"
           " --verbose, -v\tincrease log level\n"
           " --quiet, -q\tdecrease log level\n"
-          "\n", sleep_time );
+          "\n", sleep_time, resync_time, COLLAPSE4, COLLAPSE6 );
 }
 
-// show address and associated timeout value
-static void printStat( struct sockaddr *addr, socklen_t addrlen, u_int32_t value, u_int16_t table )
+// append the prefix length to a printed address unless it is a single address
+static void appendMask( char* ip, size_t size, struct sockaddr *addr, u_int8_t masklen )
+{
+    size_t len = strlen( ip );
+
+    if( masklen < (addr->sa_family == AF_INET ? 32 : 128) )
+        snprintf( ip + len, size - len, "/%u", masklen );
+}
+
+// show address prefix and associated timeout value
+static void printStat( struct sockaddr *addr, socklen_t addrlen, u_int8_t masklen, u_int32_t value, u_int16_t table )
 {
     char hostname[NI_MAXHOST], ip[NI_MAXHOST];
-    int days, hrs, min, sec;
+    int days = 0, hrs = 0, min = 0, sec;
+
+    (void)table;
 
     // global counter
     count++;
@@ -127,7 +281,8 @@ static void printStat( struct sockaddr *addr, socklen_t addrlen, u_int32_t value
     // pretty print address and host name
     if( getnameinfo( addr, addrlen, ip, sizeof(ip), NULL, 0, NI_NUMERICHOST ) )
         strncpy( ip, "???", sizeof(ip) );
-    if( !show_hostname || getnameinfo( addr, addrlen, hostname, sizeof(hostname), NULL, 0, NI_NAMEREQD ) )
+    appendMask( ip, sizeof(ip), addr, masklen );
+    if( !show_hostname || (masklen < (addr->sa_family == AF_INET ? 32 : 128)) || getnameinfo( addr, addrlen, hostname, sizeof(hostname), NULL, 0, NI_NAMEREQD ) )
         strncpy( hostname, "---", sizeof(hostname) );
 
     if( value == 0 )
@@ -146,9 +301,9 @@ static int showStats( )
 
     STAILQ_FOREACH( ptr, &tables, next )
     {
-        printf( "ENTRIES IN IPFW TABLE %i\n"
+        printf( "ENTRIES IN TABLE %i (%s)\n"
                "=================================================\n"
-               "IP address\texpires in\t\thost name\n", ptr->table );
+               "IP address\texpires in\t\thost name\n", ptr->table, fw_name( ) );
         count = 0;
         rc |= fw_list( printStat, ptr->table );
         printf( "count: %u\n", count );
@@ -160,27 +315,346 @@ static int showStats( )
         return EXIT_SUCCESS;
 }
 
-// check if "addr" with its associated "value" has timed out and if so, remove it
-static void checkEntry( struct sockaddr *addr, socklen_t addrlen, u_int32_t value, u_int16_t table )
+// find a table we are watching
+static struct table* findTable( u_int16_t table )
 {
+    struct table *ptr;
+
+    STAILQ_FOREACH( ptr, &tables, next )
+        if( ptr->table == table )
+            return ptr;
+    return NULL;
+}
+
+// order removals by their table
+static int compareRemovals( const void* a, const void* b )
+{
+    const struct removal *ra = a, *rb = b;
+
+    return (ra->table > rb->table) - (ra->table < rb->table);
+}
+
+// remove the queued entries from their tables in batches, and log how many
+// were removed from each table. Returns non-zero if some could not be removed.
+static int removeQueued( )
+{
+    static struct sockaddr_storage ss[REMOVE_BATCH];
+    static struct fw_entry batch[REMOVE_BATCH];
+    unsigned long removed, failed;
+    struct table *ptr;
+    size_t i, j;
+    unsigned int k, n;
+    u_int16_t table;
+    int rc = 0;
     char ip[NI_MAXHOST];
 
-    if( (value != 0) && (time( NULL ) > value) )
+    qsort( removals, removal_count, sizeof(struct removal), compareRemovals );
+
+    for( i = 0; i < removal_count; i = j )
     {
-        // pretty print address if needed
-        if( loglevel >= 1 )
-            if( getnameinfo( addr, addrlen, ip, sizeof(ip), NULL, 0, NI_NUMERICHOST ) )
-                strncpy( ip, "???", sizeof(ip) );
+        table = removals[i].table;
+        removed = failed = 0;
+        for( j = i; (j < removal_count) && (removals[j].table == table); )
+        {
+            for( n = 0; (n < REMOVE_BATCH) && (j < removal_count) && (removals[j].table == table); j++ )
+            {
+                if( keyToSockaddr( removals[j].addr, removals[j].masklen, &ss[n], &batch[n].addrlen, &batch[n].masklen ) )
+                    continue;
+                batch[n].addr = (struct sockaddr*)&ss[n];
+                batch[n].value = 0;
+                n++;
+            }
+            removed += fw_del_batch( batch, n, table );
+
+            for( k = 0; (k < n) && (loglevel >= 3); k++ )
+            {
+                if( getnameinfo( batch[k].addr, batch[k].addrlen, ip, sizeof(ip), NULL, 0, NI_NUMERICHOST ) )
+                    strncpy( ip, "???", sizeof(ip) );
+                appendMask( ip, sizeof(ip), batch[k].addr, batch[k].masklen );
+                if( batch[k].result )
+                    printLog( LOG_DEBUG, "Error removing %s from table %i (%s)", ip, table, fw_name( ) );
+                else
+                    printLog( LOG_DEBUG, "Removed %s from table %i (%s)", ip, table, fw_name( ) );
+            }
+            for( k = 0; k < n; k++ )
+                if( batch[k].result )
+                    failed++;
+        }
 
-        if( fw_del( addr, addrlen, table ) )
+        ptr = findTable( table );
+        if( ptr )
+            ptr->count -= removed < ptr->count ? removed : ptr->count;
+        if( removed && (loglevel >= 2) )
+            printLog( LOG_INFO, "Removed %lu expired entries from table %i (%s)", removed, table, fw_name( ) );
+        if( failed )
         {
             if( loglevel >= 1 )
-                printLog( LOG_WARNING, "Error removing %s from IPFW table %i (%i)", ip, table, errno );
+                printLog( LOG_WARNING, "Error removing %lu expired entries from table %i (%s)", failed, table, fw_name( ) );
+            rc = 1;
+        }
+    }
+
+    removal_count = 0;
+    return rc;
+}
+
+// queue an expired address key prefix to be removed by removeQueued.
+// Returns non-zero if it could not be queued.
+static int queueRemoval( const unsigned char addr[16], unsigned int masklen, u_int16_t table )
+{
+    struct removal* r;
+
+    if( removal_count == removal_size )
+    {
+        // without memory the entry expires when the table is listed again
+        r = (struct removal*) realloc( removals, (removal_size ? 2*removal_size : 1024)*sizeof(struct removal) );
+        if( !r )
+            return 1;
+        removals = r;
+        removal_size = removal_size ? 2*removal_size : 1024;
+    }
+
+    r = &removals[removal_count];
+    memcpy( r->addr, addr, 16 );
+    r->masklen = masklen;
+    r->table = table;
+    removal_count++;
+    return 0;
+}
+
+// check if "addr" with its associated "value" has timed out and if so, queue it for removal
+static void checkEntry( struct sockaddr *addr, socklen_t addrlen, u_int8_t masklen, u_int32_t value, u_int16_t table )
+{
+    unsigned char key[16];
+
+    (void)addrlen;
+    if( (value != 0) && (clean_time > value) && sockaddrToKey( addr, key ) )
+        queueRemoval( key, addr->sa_family == AF_INET ? 96 + masklen : masklen, table );
+}
+
+// move an expiration up the heap to its place
+static void siftUp( size_t i )
+{
+    struct expiry e = expiries[i];
+
+    for( ; (i > 0) && (expiries[(i - 1)/2].value > e.value); i = (i - 1)/2 )
+        expiries[i] = expiries[(i - 1)/2];
+    expiries[i] = e;
+}
+
+// move an expiration down the heap to its place
+static void siftDown( size_t i )
+{
+    struct expiry e = expiries[i];
+    size_t c;
+
+    for( ; (c = 2*i + 1) < expiry_count; i = c )
+    {
+        if( (c + 1 < expiry_count) && (expiries[c + 1].value < expiries[c].value) )
+            c++;
+        if( expiries[c].value >= e.value )
+            break;
+        expiries[i] = expiries[c];
+    }
+    expiries[i] = e;
+}
+
+// add the expiration time of an address key prefix to the heap
+static void pushExpiry( const unsigned char addr[16], unsigned int masklen, u_int32_t value, u_int16_t table )
+{
+    struct expiry* e;
+
+    if( expiry_count == expiry_size )
+    {
+        // without memory the entry expires when the table is listed again
+        e = (struct expiry*) realloc( expiries, (expiry_size ? 2*expiry_size : 1024)*sizeof(struct expiry) );
+        if( !e )
+            return;
+        expiries = e;
+        expiry_size = expiry_size ? 2*expiry_size : 1024;
+    }
+
+    e = &expiries[expiry_count];
+    memcpy( e->addr, addr, 16 );
+    e->masklen = masklen;
+    e->value = value;
+    e->table = table;
+    siftUp( expiry_count++ );
+}
+
+// remove the earliest expiration from the heap
+static void popExpiry( )
+{
+    if( --expiry_count > 0 )
+    {
+        expiries[0] = expiries[expiry_count];
+        siftDown( 0 );
+    }
+}
+
+// remove all expirations of a table from the heap
+static void dropExpiries( u_int16_t table )
+{
+    size_t i, j;
+
+    for( i = j = 0; i < expiry_count; i++ )
+        if( expiries[i].table != table )
+            expiries[j++] = expiries[i];
+    expiry_count = j;
+    for( i = expiry_count/2; i-- > 0; )
+        siftDown( i );
+}
+
+// queue "addr" for removal if it has timed out, otherwise remember when it will
+static void scheduleEntry( struct sockaddr *addr, socklen_t addrlen, u_int8_t masklen, u_int32_t value, u_int16_t table )
+{
+    unsigned char key[16];
+    unsigned int keylen;
+
+    (void)addrlen;
+    listed++;
+    if( (value == 0) || !sockaddrToKey( addr, key ) )
+        return;
+    keylen = addr->sa_family == AF_INET ? 96 + masklen : masklen;
+
+    if( (clean_time > value) && !queueRemoval( key, keylen, table ) )
+        return;
+    if( !fw_expiring( ) )
+        pushExpiry( key, keylen, value, table );
+}
+
+// collect an entry that is at most as wide as the prefix it would be collapsed into
+static void collectEntry( struct sockaddr *addr, socklen_t addrlen, u_int8_t masklen, u_int32_t value, u_int16_t table )
+{
+    struct entry* e;
+
+    (void)addrlen; (void)table;
+    if( entry_count == entry_size )
+    {
+        e = (struct entry*) realloc( entries, (entry_size ? 2*entry_size : 1024)*sizeof(struct entry) );
+        if( !e )
+        {
+            entry_failed = 1;
+            return;
         }
-        else
+        entries = e;
+        entry_size = entry_size ? 2*entry_size : 1024;
+    }
+
+    e = &entries[entry_count];
+    if( !sockaddrToKey( addr, e->addr ) )
+        return;
+    e->masklen = addr->sa_family == AF_INET ? 96 + masklen : masklen;
+    memcpy( e->prefix, e->addr, 16 );
+    if( e->masklen < maskAddress( e->prefix, COLLAPSE4, COLLAPSE6 ) )
+        return;
+    e->value = value;
+    entry_count++;
+}
+
+// order entries by their prefix, and the prefix itself before its members
+static int compareEntries( const void* a, const void* b )
+{
+    const struct entry *ea = a, *eb = b;
+    int rc = memcmp( ea->prefix, eb->prefix, 16 );
+
+    return rc ? rc : (ea->masklen > eb->masklen) - (ea->masklen < eb->masklen);
+}
+
+// remove the collected entries first to last-1 from a table in batches
+static void removeMembers( size_t first, size_t last, u_int16_t table )
+{
+    static struct sockaddr_storage ss[REMOVE_BATCH];
+    static struct fw_entry batch[REMOVE_BATCH];
+    unsigned int n;
+
+    while( first < last )
+    {
+        for( n = 0; (n < REMOVE_BATCH) && (first < last); first++ )
+        {
+            if( keyToSockaddr( entries[first].addr, entries[first].masklen, &ss[n], &batch[n].addrlen, &batch[n].masklen ) )
+                continue;
+            batch[n].addr = (struct sockaddr*)&ss[n];
+            batch[n].value = 0;
+            n++;
+        }
+        fw_del_batch( batch, n, table );
+    }
+}
+
+// replace the entries of a table that fall into the same prefix by one entry
+// for the prefix if there are more than collapse_count of them or the prefix is
+// already in the table. The prefix expires with the last of its members.
+static int collapseTable( u_int16_t table )
+{
+    struct sockaddr_storage ss, mss;
+    socklen_t sslen, msslen;
+    u_int8_t fwlen, mfwlen;
+    size_t i, j, k, n;
+    unsigned int masklen;
+    u_int32_t value;
+    int rc = 0;
+    char ip[INET6_ADDRSTRLEN + 4];
+
+    entry_count = 0;
+    entry_failed = 0;
+    if( fw_list( collectEntry, table ) || entry_failed )
+        return 1;
+
+    qsort( entries, entry_count, sizeof(struct entry), compareEntries );
+
+    for( i = 0; i < entry_count; i = j )
+    {
+        // find all entries with the same prefix
+        for( j = i + 1; (j < entry_count) && (memcmp( entries[j].prefix, entries[i].prefix, 16 ) == 0); j++ )
+            ;
+        masklen = maskAddress( entries[i].prefix, COLLAPSE4, COLLAPSE6 );
+        n = entries[i].masklen == masklen ? j - i - 1 : j - i;
+        if( (n == 0) || ((n == j - i) && (n <= collapse_count)) )
+            continue;
+
+        // the prefix expires with the last of its members, permanent ones (0) win
+        value = entries[i].value;
+        for( k = i + 1; (k < j) && (value != 0); k++ )
+            if( (entries[k].value == 0) || (entries[k].value > value) )
+                value = entries[k].value;
+
+        // never block local addresses that are not blocked by a member already
+        formatPrefix( entries[i].prefix, masklen, ip, sizeof(ip) );
+        if( keyToSockaddr( entries[i].prefix, masklen, &ss, &sslen, &fwlen ) )
+            continue;
+        if( isLocal( (struct sockaddr*)&ss, fwlen ) )
+        {
             if( loglevel >= 2 )
-                printLog( LOG_INFO, "Removed %s from IPFW table %i", ip, table );
+                printLog( LOG_INFO, "Not collapsing %s in table %i (%s), it contains a local address", ip, table, fw_name( ) );
+            continue;
+        }
+
+        // add the prefix first, so the members are never unblocked. A table
+        // that cannot hold both refuses the prefix until the members are gone,
+        // so they are removed first and added back if the prefix fails.
+        if( !fw_nesting( ) )
+            removeMembers( j - n, j, table );
+        if( fw_add( (struct sockaddr*)&ss, sslen, fwlen, value, table ) == 1 )
+        {
+            if( loglevel >= 1 )
+                printLog( LOG_WARNING, "Error adding %s to table %i (%s, %i)", ip, table, fw_name( ), errno );
+            if( !fw_nesting( ) )
+                for( k = j - n; k < j; k++ )
+                    if( !keyToSockaddr( entries[k].addr, entries[k].masklen, &mss, &msslen, &mfwlen ) )
+                        fw_add( (struct sockaddr*)&mss, msslen, mfwlen, entries[k].value, table );
+            rc = 1;
+            continue;
+        }
+        if( fw_nesting( ) )
+            removeMembers( j - n, j, table );
+
+        collapsed += n;
+        if( loglevel >= 2 )
+            printLog( LOG_INFO, "Collapsed %lu entries into %s in table %i (%s)", (unsigned long)n, ip, table, fw_name( ) );
     }
+
+    return rc;
 }
 
 // signal handler
@@ -206,19 +680,150 @@ static int cleanOnce( )
     int rc = 0;
     struct table *ptr;
 
+    clean_time = time( NULL );
     STAILQ_FOREACH( ptr, &tables, next )
+    {
         rc |= fw_list( checkEntry, ptr->table );
+        rc |= removeQueued( );
+        if( collapse_count > 0 )
+            rc |= collapseTable( ptr->table );
+    }
 
     return rc ? EX_SOFTWARE : EXIT_SUCCESS;
 }
 
+// list a table, removing expired entries and scheduling the expiration of all
+// others, and collapse it
+static int syncTable( struct table *ptr )
+{
+    unsigned long count;
+    int rc = 0;
+
+    // changes from now on show in the generation count
+    if( fw_info( ptr->table, &count, &ptr->generation ) )
+        ptr->generation = 0;
+
+    dropExpiries( ptr->table );
+    listed = 0;
+    rc |= fw_list( scheduleEntry, ptr->table );
+    ptr->count = listed;
+    rc |= removeQueued( );
+    if( collapse_count > 0 )
+    {
+        collapsed = 0;
+        rc |= collapseTable( ptr->table );
+        if( collapsed )
+        {
+            if( fw_info( ptr->table, &count, &ptr->generation ) )
+                ptr->generation = 0;
+            dropExpiries( ptr->table );
+            listed = 0;
+            rc |= fw_list( scheduleEntry, ptr->table );
+            ptr->count = listed;
+            rc |= removeQueued( );
+        }
+    }
+    ptr->synced = clean_time;
+
+    if( loglevel >= 3 )
+        printLog( LOG_DEBUG, "Listed table %i (%s) with %lu entries", ptr->table, fw_name( ), ptr->count );
+
+    return rc;
+}
+
+// remove all entries whose expiration time has passed. Tables with more of
+// them than fit into one batch are listed again instead of looking up each.
+static int expireDue( )
+{
+    struct sockaddr_storage ss;
+    socklen_t sslen;
+    u_int8_t fwlen;
+    u_int32_t value;
+    struct expiry e;
+    struct table *ptr;
+
+    STAILQ_FOREACH( ptr, &tables, next )
+        ptr->due = 0;
+
+    while( (expiry_count > 0) && (clean_time > expiries[0].value) )
+    {
+        e = expiries[0];
+        popExpiry( );
+        if( keyToSockaddr( e.addr, e.masklen, &ss, &sslen, &fwlen ) )
+            continue;
+        ptr = findTable( e.table );
+        if( ptr && (++ptr->due > REMOVE_BATCH) )
+        {
+            ptr->synced = 0;
+            continue;
+        }
+
+        // the host may have been blocked again since the table was listed
+        switch( fw_find( (struct sockaddr*)&ss, sslen, fwlen, e.table, &value ) )
+        {
+            case 0:
+                if( value == 0 )
+                    continue;
+                if( clean_time <= value )
+                {
+                    pushExpiry( e.addr, e.masklen, value, e.table );
+                    continue;
+                }
+                break;
+            case 1:
+                // removed by someone else
+                if( ptr && ptr->count )
+                    ptr->count--;
+                continue;
+        }
+
+        queueRemoval( e.addr, e.masklen, e.table );
+    }
+
+    return removeQueued( );
+}
+
+// remove expired entries, and list the tables again when they changed or
+// were not listed for resync_time seconds
+static int scheduleOnce( )
+{
+    unsigned long count, generation;
+    struct table *ptr;
+    int rc = 0;
+
+    clean_time = time( NULL );
+    rc |= expireDue( );
+    STAILQ_FOREACH( ptr, &tables, next )
+    {
+        // without table information the table is always listed
+        if( (clean_time >= ptr->synced + resync_time) ||
+            fw_info( ptr->table, &count, &generation ) || (count != ptr->count) || (generation != ptr->generation) )
+            rc |= syncTable( ptr );
+    }
+
+    return rc ? EX_SOFTWARE : EXIT_SUCCESS;
+}
+
+// seconds until the next entry expires, but at most sleep_time
+static unsigned int nextWakeup( )
+{
+    time_t now = time( NULL );
+
+    if( (expiry_count > 0) && ((time_t)expiries[0].value + 1 - now < sleep_time) )
+        return (time_t)expiries[0].value + 1 > now ? expiries[0].value + 1 - now : 1;
+    return sleep_time;
+}
+
 // write a table entry to state_file
-static void saveEntry( struct sockaddr *addr, socklen_t addrlen, u_int32_t value, u_int16_t table )
+static void saveEntry( struct sockaddr *addr, socklen_t addrlen, u_int8_t masklen, u_int32_t value, u_int16_t table )
 {
     char ip[NI_MAXHOST];
 
     if( !getnameinfo( addr, addrlen, ip, sizeof(ip), NULL, 0, NI_NUMERICHOST ) )
+    {
+        appendMask( ip, sizeof(ip), addr, masklen );
         fprintf( sf, "%u\t%u\t%s\n", table, value, ip );
+    }
 }
 
 // save the state of all watched tables in state_file
@@ -234,7 +839,7 @@ static void saveState( )
             printLog( LOG_WARNING, "Could not open state file '%s' for writing.", state_file );
         return;
     }
-    fprintf( sf, "# banhammerd IPFW table state %s# table\tvalue\tIP\n", ctime( &ct ) );
+    fprintf( sf, "# banhammerd %s table state %s# table\tvalue\tIP\n", fw_name( ), ctime( &ct ) );
 
     STAILQ_FOREACH( ptr, &tables, next )
         fw_list( saveEntry, ptr->table );
@@ -375,15 +980,19 @@ static int cleanCycle( int daemonize )
     // load state
     loadState( );
 
-    // the main loop
+    // the main loop: sleep until the next entry expires, checking the tables for new entries in between
     while( !done )
     {
-        cleanOnce( );
-        sleep( sleep_time );
+        scheduleOnce( );
+        sleep( nextWakeup( ) );
     }
 
     // clean up
     saveState( );
+    free( expiries );
+    free( removals );
+    expiries = NULL;
+    expiry_count = expiry_size = 0;
     if( pfh ) pidfile_remove( pfh );
 
     return EXIT_SUCCESS;
@@ -471,14 +1080,20 @@ int main( int argc, char *argv[] )
 
     STAILQ_INIT( &tables );
 
+    // select the firewall backend
+    if( fw_select( getenv( FIREWALL_ENV ) ) )
+        errx( EX_CONFIG, "Unknown firewall backend %s.", getenv( FIREWALL_ENV ) );
+
     // see if we are root
-    if( geteuid( ) != 0 )
+    if( fw_privileged( ) && geteuid( ) != 0 )
         errx( EX_OSERR, "Must be run as root." );
 
     // command line options and their aliases
     const struct option longopts[] = {
         { "table", required_argument, NULL, 't' },
         { "sleep", required_argument, NULL, 's' },
+        { "resync", required_argument, NULL, 'r' },
+        { "collapse", required_argument, NULL, 'c' },
         { "pidfile", required_argument, NULL, 'p' },
         { "directory", required_argument, NULL, 'd' },
         { "statefile", required_argument, NULL, 'S' },
@@ -494,7 +1109,7 @@ int main( int argc, char *argv[] )
         { NULL, 0, NULL, 0 }
     };
 
-    while( (ch = getopt_long( argc, argv, "t:S:p:d:s:hfnvqLCA:R:", longopts, NULL )) != -1 )
+    while( (ch = getopt_long( argc, argv, "t:S:p:d:s:r:c:hfnvqLCA:R:", longopts, NULL )) != -1 )
     {
         switch( ch )
         {
@@ -509,6 +1124,8 @@ int main( int argc, char *argv[] )
                         if( !nptr )
                             errx( EX_OSERR, "Could not allocate memory." );
                         nptr->table = i;
+                        nptr->count = nptr->generation = 0;
+                        nptr->synced = 0;
                         STAILQ_INSERT_TAIL( &tables, nptr, next );
                     }
                     else
@@ -522,6 +1139,19 @@ int main( int argc, char *argv[] )
                     errx( EX_USAGE, "Time to sleep must be at least 1 second." );
                 break;
 
+            case 'r':
+                resync_time = strtol( optarg, NULL, 10 );
+                if( resync_time < 1 )
+                    errx( EX_USAGE, "Time between full listings must be at least 1 second." );
+                break;
+
+            case 'c':
+                i = strtol( optarg, &c, 10 );
+                if( (*c != '\0') || (i < 1) )
+                    errx( EX_USAGE, "Collapse count must be a positive number." );
+                collapse_count = i;
+                break;
+
             case 'f':
                 if( mode != 1 )
                     errx( EX_USAGE, "Options -A, -R, -C, -f and -L are mutually exclusive. Please only specify one of them." );
@@ -587,15 +1217,19 @@ int main( int argc, char *argv[] )
 
     // check if we were given enough tables
     if( STAILQ_EMPTY( &tables ) )
-        errx( EX_USAGE, "You must specify at least one IPFW table to operate on." );
+        errx( EX_USAGE, "You must specify at least one table to operate on." );
 
     // initialize firewall
     rc = fw_init( );
     if( rc )
-        errx( EX_CONFIG, "Error initializing IPFW (rc=%d).", rc );
+        errx( EX_CONFIG, "Error initializing firewall %s (rc=%d).", fw_name( ), rc );
 
     // open syslog
-    openlog( "banhammerd", LOG_PID, LOG_SECURITY );
+#ifdef LOG_SECURITY
+    openlog( "banhammerd", LOG_PID, LOG_SECURITY );    // FreeBSD style
+#else
+    openlog( "banhammerd", LOG_PID, LOG_AUTH );        // Apple style
+#endif
 
     // run the requested mode
     switch( mode )
@@ -621,6 +1255,7 @@ int main( int argc, char *argv[] )
     // clean up
     fw_close( );
     closelog( );
+    free( entries );
 
     while( !STAILQ_EMPTY( &tables ) )
     {
@@ -34,326 +34,1129 @@
 #include <string.h>
 #include <syslog.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <netdb.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <ifaddrs.h>
 #include <errno.h>
 #include <net/if.h>
-#include <netinet/ip_fw.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+// glibc has a <net/route.h> without routing sockets, so netlink is checked first
+#if defined(HAVE_LINUX_RTNETLINK_H)
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#elif defined(HAVE_NET_ROUTE_H)
+#include <net/route.h>
+#endif
+
+#include "banlib.h"
+#include "firewall.h"
 
 extern int loglevel;                    // loglevel, defined in main programs
-static struct ifaddrs *ifAddrs = NULL;  // cached list of local interfaces
-static int ipfw_socket = -1;            // the socket to the IPFW firewall
+static unsigned char (*localAddrs)[16] = NULL;  // address keys of all local interfaces
+static unsigned int localCount = 0;     // number of local interface addresses
+static unsigned int* localIndex = NULL; // hash index of local addresses (position + 1, 0 if unused)
+static unsigned int localMask = 0;      // size of the hash index minus one (a power of two)
+static int localStale = 1;              // local addresses have to be reloaded
+static time_t localLoaded = 0;          // time the local addresses were loaded
+static int routeSocket = -1;            // routing socket notifying of address changes (-1 if none)
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t ifLock = PTHREAD_MUTEX_INITIALIZER;     // protects the local addresses (hosts are blocked by several threads)
+#endif
+static const struct fw_backend* fw = NULL;  // the selected firewall backend
+static char* fwOptions = NULL;          // options of the selected firewall backend
+
+#ifdef HAVE_LIBPTHREAD
+// firewall table addition waiting for the writer thread
+struct fw_pending {
+    struct sockaddr_storage ss; // Address
+    socklen_t sslen;            // Length of the address
+    u_int8_t masklen;           // Prefix length of the address
+    u_int16_t table;            // Table to add it to
+    u_int32_t value;            // Value to store with it
+    time_t rt;                  // Time it is blocked for (for logging)
+    int written;                // Already written in the current round of batches
+};
+
+static pthread_t fwWriter;              // thread adding queued addresses to the firewall in batches
+static int fwRunning = 0;               // writer thread is running and takes new additions
+static int fwStop = 0;                  // writer thread should write all queued additions and stop
+static pthread_mutex_t fwLock = PTHREAD_MUTEX_INITIALIZER;    // protects the queue and statistics below
+static pthread_cond_t fwWork = PTHREAD_COND_INITIALIZER;      // signalled when a batch is due or the writer should stop
+static struct fw_pending* fwQueue = NULL;   // queued additions
+static unsigned int fwQueued = 0;       // number of queued additions
+static unsigned int fwQueueSize = 0;    // room for additions in the queue (grows as needed)
+static struct fw_pending* fwSpare = NULL;   // second queue swapped in by the writer while it writes the first
+static unsigned int fwSpareSize = 0;    // room for additions in the spare queue
+static struct timespec fwDue;           // time the first queued addition has to be written
+static unsigned int fwBatchMax = 0;     // most entries per batch
+static unsigned int fwWait = 0;         // milliseconds to wait for more additions before writing a batch
+static struct fw_pending** fwBatch = NULL;  // additions in the current batch
+static struct fw_entry* fwEntry = NULL;     // entries of the current batch passed to the backend
+static unsigned long fwEntries = 0;     // statistics: additions written in batches
+static unsigned long fwBatches = 0;     // statistics: batches written
+
+#define FW_FAILURES 64                  // number of failed blocks kept until the main thread takes them
+static pthread_mutex_t fwFailLock = PTHREAD_MUTEX_INITIALIZER;    // protects the failed blocks below
+static struct fw_failure fwFailed[FW_FAILURES];     // ring of failed blocks
+static unsigned int fwFailHead = 0;     // oldest failed block in the ring
+static unsigned int fwFailCount = 0;    // number of failed blocks in the ring
+static int fwFailLost = 0;              // failed blocks were dropped because the ring was full
+#endif
 
-// Local constants
-static const int BANLIB_DEL = 0;
-static const int BANLIB_ADD = 1;
+// Prefix of IPv4 addresses in address keys (IPv4-mapped IPv6 addresses)
+static const unsigned char ipv4_mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
 
 /* Firewall routines */
 
 // local forward declaration
-static int fw_table_cmd( int opcode, struct sockaddr* addr, socklen_t addrlen, u_int32_t value, u_int16_t table );
+int sockaddrToKey( const struct sockaddr* sa, unsigned char addr[16] );
+void fw_writer_stop( );
 
-// Inititalize the connection to the firewall.
-int fw_init( )
+// Without notifications of address changes, reload local addresses after this many seconds
+static const time_t LOCAL_RELOAD = 60;
+
+// All firewall backends, the first one is the default
+static const struct fw_backend* fw_backends[] = {
+#ifdef HAVE_IPFW3
+    &fw_ipfw,
+#endif
+#ifdef HAVE_LINUX_NETFILTER_NF_TABLES_H
+    &fw_nft,
+#endif
+    &fw_sim
+};
+
+// Select a firewall backend by name, optionally followed by ":" and its options
+int fw_select( const char* name )
 {
-    if ( ipfw_socket == -1 )
+    const char* c;
+    size_t len;
+    unsigned int i;
+
+    if( !name || !*name )
     {
-        if ( (ipfw_socket = socket( AF_INET, SOCK_RAW, IPPROTO_RAW )) < 0 )
-            return 1;
+        fw = fw_backends[0];
+        return 0;
     }
-    else
-        return 2;
 
-    return 0;
+    len = (c = strchr( name, ':' )) ? (size_t)(c - name) : strlen( name );
+    for( i = 0; i < sizeof(fw_backends)/sizeof(fw_backends[0]); i++ )
+        if( strlen( fw_backends[i]->name ) == len && !strncmp( fw_backends[i]->name, name, len ) )
+        {
+            free( fwOptions );
+            fwOptions = c ? strdup( c + 1 ) : NULL;
+            fw = fw_backends[i];
+            return 0;
+        }
+
+    return 1;
+}
+
+// Name of the selected firewall backend
+const char* fw_name( )
+{
+    return fw ? fw->name : fw_backends[0]->name;
+}
+
+// Check if the selected firewall backend needs root privileges
+int fw_privileged( )
+{
+    return fw ? fw->privileged : fw_backends[0]->privileged;
+}
+
+// Initialize the selected firewall backend
+int fw_init( )
+{
+    if( !fw )
+        fw = fw_backends[0];
+    return fw->init( fwOptions );
 }
 
 // Clean up after yourself, the program is about to quit
 int fw_close( )
 {
-    if ( ipfw_socket != -1 )
-        close( ipfw_socket );
-    return 0;
+    int rc = 0;
+
+    if( fw )
+        rc = fw->close( );
+    free( fwOptions );
+    fwOptions = NULL;
+    return rc;
 }
 
-// store an IP address and associated value in the given firewall table, ignore duplicates
-int fw_add( struct sockaddr* addr, socklen_t addrlen, u_int32_t value, u_int16_t table )
+// store an IP address prefix and associated value in the given firewall table, ignore duplicates
+int fw_add( struct sockaddr* addr, socklen_t addrlen, u_int8_t masklen, u_int32_t value, u_int16_t table )
 {
-    int rc;
+    return fw ? fw->add( addr, addrlen, masklen, value, table ) : 1;
+}
 
-    rc = fw_table_cmd( BANLIB_ADD, addr, addrlen, value, table );
-    return rc == 0 ? 0 : (errno == EEXIST ? 2 : 1);
+// remove a given IP address prefix from the given firewall table, error if not found
+int fw_del( struct sockaddr* addr, socklen_t addrlen, u_int8_t masklen, u_int16_t table )
+{
+    return fw ? fw->del( addr, addrlen, masklen, table ) : 1;
 }
 
-// remove a given IP address from the given firewall table, error if not found
-int fw_del( struct sockaddr* addr, socklen_t addrlen, u_int16_t table )
+// remove n IP address prefixes from the given firewall table, with one command
+// if the backend can, otherwise (or if that fails as a whole) one by one
+unsigned int fw_del_batch( struct fw_entry* entries, unsigned int n, u_int16_t table )
 {
-    int rc;
+    unsigned int i, removed = 0;
 
-    rc = fw_table_cmd( BANLIB_DEL, addr, addrlen, 0, table );
-    return rc == 0 ? 0 : 1;
+    if( n == 0 )
+        return 0;
+    if( !fw || !fw->del_batch || fw->del_batch( entries, n, table ) )
+        for( i = 0; i < n; i++ )
+            entries[i].result = fw_del( entries[i].addr, entries[i].addrlen, entries[i].masklen, table );
+
+    for( i = 0; i < n; i++ )
+        if( entries[i].result == 0 )
+            removed++;
+    return removed;
 }
 
-// Handle different table types (mark available since FBSD 14)
-#ifdef HAVE_IPFW_VTYPE_MARK
-#define VTYPE (IPFW_VTYPE_MARK | IPFW_VTYPE_TAG)
-#define VALUE(v, vt) (((vt) & IPFW_VTYPE_MARK) ? ((v).value.mark) : ((v).value.tag))
-#else
-#define VTYPE IPFW_VTYPE_TAG
-#define VALUE(v, vt) ((v).value.tag)
+// Get all IP addresses and associated values in given table and call
+// a callback function with each of them.
+// Note: The callback may alter the state of the table. This function
+// always reflects the unaltered state of the table for all callbacks.
+int fw_list( void (*callback)(struct sockaddr*, socklen_t, u_int8_t, u_int32_t, u_int16_t), u_int16_t table )
+{
+    return fw ? fw->list( callback, table ) : -1;
+}
+
+// Get the number of entries in a table and its generation count (0 if the
+// backend does not have one)
+int fw_info( u_int16_t table, unsigned long* count, unsigned long* generation )
+{
+    return (fw && fw->info) ? fw->info( table, count, generation ) : -1;
+}
+
+// Look up the value of an IP address prefix in a table
+int fw_find( struct sockaddr* addr, socklen_t addrlen, u_int8_t masklen, u_int16_t table, u_int32_t* value )
+{
+    return (fw && fw->find) ? fw->find( addr, addrlen, masklen, table, value ) : -1;
+}
+
+// Check if the selected firewall backend removes expired entries itself
+int fw_expiring( )
+{
+    return fw ? fw->expiring : fw_backends[0]->expiring;
+}
+
+// Check if the selected firewall backend can hold a prefix together with
+// entries within it
+int fw_nesting( )
+{
+    return fw ? fw->nesting : fw_backends[0]->nesting;
+}
+
+/* Higher level utility routines */
+
+// read a line from a file and remove the trailing newline
+ssize_t readline( char **line, size_t *size, FILE *f )
+{
+    ssize_t rc;
+
+    rc = getline( line, size, f );
+    if( (rc > 0) && ((*line)[rc-1] == '\n') )
+    {
+        (*line)[rc-1] = '\0';
+        rc--;
+    }
+
+    return rc;
+}
+
+// release list of local interface addresses so they are reloaded when needed
+void updateLocalInterfaces( )
+{
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_lock( &ifLock );
 #endif
+    localStale = 1;
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_unlock( &ifLock );
+#endif
+}
 
-// internal helper to execute an IPFW table command.
-// Opcode is BANLIB_ADD or BANLIB_DEL
-static int fw_table_cmd( int opcode, struct sockaddr* addr, socklen_t addrlen, u_int32_t value, u_int16_t table )
+// check if the first bits of two addresses are the same
+static int samePrefix( const void* a, const void* b, unsigned int bits )
 {
-    ipfw_obj_header *oh;
-	ipfw_obj_ctlv *ctlv;
-	ipfw_obj_tentry *tent;
-    socklen_t l;
-    int rc;
+    const unsigned char *pa = a, *pb = b;
 
-    if( ipfw_socket == -1 )
-        return -1;
+    if( memcmp( pa, pb, bits/8 ) != 0 )
+        return 0;
+    return (bits%8 == 0) || (((pa[bits/8] ^ pb[bits/8]) & (0xff00 >> (bits%8))) == 0);
+}
+
+// hash function for address keys (FNV-1a)
+static unsigned int hashKey( const unsigned char addr[16] )
+{
+    unsigned int i, h = 2166136261u;
+
+    for( i = 0; i < 16; i++ )
+        h = (h ^ addr[i]) * 16777619u;
+
+    return h;
+}
+
+// Open a non-blocking routing socket that receives a message whenever an
+// interface address is added or removed. Returns -1 if not supported.
+static int openRouteSocket( )
+{
+    int s = -1;
+#if defined(HAVE_LINUX_RTNETLINK_H)
+    struct sockaddr_nl sa = { 0 };
+
+    sa.nl_family = AF_NETLINK;
+    sa.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+    s = socket( AF_NETLINK, SOCK_RAW, NETLINK_ROUTE );
+    if( (s >= 0) && bind( s, (struct sockaddr*)&sa, sizeof(sa) ) )
+    {
+        close( s );
+        s = -1;
+    }
+#elif defined(HAVE_NET_ROUTE_H)
+    s = socket( PF_ROUTE, SOCK_RAW, 0 );
+#ifdef ROUTE_MSGFILTER
+    // don't bother us with all the other routing messages
+    if( s >= 0 )
+    {
+        unsigned int filter = ROUTE_FILTER( RTM_NEWADDR ) | ROUTE_FILTER( RTM_DELADDR ) | ROUTE_FILTER( RTM_IFINFO );
+        setsockopt( s, PF_ROUTE, ROUTE_MSGFILTER, &filter, sizeof(filter) );
+    }
+#endif
+#endif
+    if( (s >= 0) && (fcntl( s, F_SETFL, O_NONBLOCK ) || fcntl( s, F_SETFD, FD_CLOEXEC )) )
+    {
+        close( s );
+        s = -1;
+    }
 
-    // prepare IPFW3 command
-    l = sizeof(ipfw_obj_header) + sizeof(ipfw_obj_ctlv) + sizeof(ipfw_obj_tentry);
-    oh = (ipfw_obj_header*)calloc( 1, l );
-    if( !oh ) return -1;
-    oh->opheader.opcode = (opcode == BANLIB_ADD) ? IP_FW_TABLE_XADD : IP_FW_TABLE_XDEL;
-    oh->opheader.version = 1;
-    oh->ntlv.head.type = IPFW_TLV_TBL_NAME;
-    oh->ntlv.head.length = sizeof(ipfw_obj_ntlv);
-    oh->ntlv.idx = 1;
-	oh->ntlv.set = 0;
-    oh->ntlv.type = IPFW_TABLE_ADDR;
-    snprintf( oh->ntlv.name, sizeof(oh->ntlv.name), "%hu", table );
-    oh->idx = 1;
-
-    ctlv = (ipfw_obj_ctlv*)(oh + 1);
-    ctlv->count = 1;
-    ctlv->head.length = sizeof(*ctlv) + sizeof(*tent);
-    //ctlv->flags |= IPFW_CTF_ATOMIC;
-
-    tent = (ipfw_obj_tentry*)(ctlv + 1);
-    tent->head.length = sizeof(ipfw_obj_tentry);
-    tent->head.flags |= (opcode == BANLIB_ADD) ? IPFW_TF_UPDATE : 0;
-    tent->idx = oh->idx;
-    // set all other values in case this is a legacy table (masked out again by IPFW)
-    tent->v.value.tag = value;
-    tent->v.value.pipe = value;
-    tent->v.value.divert = value;
-    tent->v.value.skipto = value;
-    tent->v.value.netgraph = value;
-    tent->v.value.fib = value;
-    tent->v.value.nat = value;
-    tent->v.value.nh4 = value;
-    tent->v.value.dscp = (uint8_t)value;
-    tent->v.value.limit = value;
-#ifdef HAVE_IPFW_VTYPE_MARK
-    tent->v.value.mark = value;
+    return s;
+}
+
+// Read all pending messages from the routing socket and check if any of them
+// announces a change of interface addresses
+static int localChanged( )
+{
+    union {
+#if defined(HAVE_LINUX_RTNETLINK_H)
+        struct nlmsghdr nlh;
+#elif defined(HAVE_NET_ROUTE_H)
+        struct rt_msghdr rtm;
 #endif
+        char buf[8192];
+    } msg;
+    ssize_t len;
+    int changed = 0;
 
-    switch( addr->sa_family )
+    while( (len = recv( routeSocket, &msg, sizeof(msg), 0 )) != 0 )
+    {
+        if( len < 0 )
+        {
+            // messages were lost if the socket overflowed, so assume the worst
+            if( errno == EINTR )
+                continue;
+            if( (errno != EAGAIN) && (errno != EWOULDBLOCK) )
+                changed = 1;
+            break;
+        }
+#if defined(HAVE_LINUX_RTNETLINK_H)
+        // only address changes are subscribed to
+        changed = 1;
+#elif defined(HAVE_NET_ROUTE_H)
+        // all routing messages start with the same header up to the type
+        if( ((size_t)len <= offsetof(struct rt_msghdr, rtm_type)) || (msg.rtm.rtm_type == RTM_NEWADDR) || (msg.rtm.rtm_type == RTM_DELADDR) || (msg.rtm.rtm_type == RTM_IFINFO) )
+            changed = 1;
+#endif
+    }
+
+    return changed;
+}
+
+// Reload the address keys of all local interfaces into the hash index.
+// Must be called with ifLock held.
+static void loadLocalAddresses( )
+{
+    struct ifaddrs *ifAddrs = NULL, *ifa;
+    unsigned char (*addrs)[16];
+    unsigned int *index, n = 0, size, h;
+
+    // subscribe to changes first, so none are missed while loading
+    if( routeSocket == -1 )
+        routeSocket = openRouteSocket( );
+    else
+        localChanged( );
+    localLoaded = time( NULL );
+
+    if( getifaddrs( &ifAddrs ) )
+        return;
+    for( ifa = ifAddrs; ifa; ifa = ifa->ifa_next )
+        n++;
+    for( size = 16; size < 2*n; size *= 2 )
+        ;
+    addrs = (unsigned char(*)[16]) calloc( n ? n : 1, sizeof(addrs[0]) );
+    index = (unsigned int*) calloc( size, sizeof(unsigned int) );
+    if( !addrs || !index )
+    {
+        // keep the old addresses and try again next time
+        free( addrs );
+        free( index );
+        freeifaddrs( ifAddrs );
+        return;
+    }
+
+    n = 0;
+    for( ifa = ifAddrs; ifa; ifa = ifa->ifa_next )
+    {
+        if( !ifa->ifa_addr || !sockaddrToKey( ifa->ifa_addr, addrs[n] ) )
+            continue;
+        // linear probing, skipping addresses found on several interfaces
+        for( h = hashKey( addrs[n] ) & (size - 1); index[h] && memcmp( addrs[index[h] - 1], addrs[n], 16 ); h = (h + 1) & (size - 1) )
+            ;
+        if( !index[h] )
+            index[h] = ++n;
+    }
+    freeifaddrs( ifAddrs );
+
+    free( localAddrs );
+    free( localIndex );
+    localAddrs = addrs;
+    localIndex = index;
+    localCount = n;
+    localMask = size - 1;
+    localStale = 0;
+}
+
+// check if the given address prefix of masklen bits contains one of our local interfaces
+int isLocal( struct sockaddr *sa, unsigned int masklen )
+{
+    unsigned char addr[16];
+    unsigned int i, h;
+    int rc = 0;
+    const struct in_addr loopback4 = { htonl( INADDR_LOOPBACK ) };
+
+    // Check for loopback and supported address family
+    switch( sa->sa_family )
     {
         case AF_INET:
-            if( addrlen < sizeof(struct in_addr) )
-            {
-                free( oh );
+            // anything in 127.0.0.0/8
+            if( samePrefix( &((struct sockaddr_in*)sa)->sin_addr, &loopback4, masklen < 8 ? masklen : 8 ) )
                 return 1;
-            }
-            tent->subtype = AF_INET;
-            tent->masklen = 32;
-            tent->k.addr = ((struct sockaddr_in*)addr)->sin_addr;
+            if( masklen > 32 )
+                masklen = 32;
+            masklen += 96;
             break;
 
 #ifdef WITH_IPV6
         case AF_INET6:
-            if( addrlen < sizeof(struct in6_addr) )
-            {
-                free( oh );
+            if( samePrefix( &((struct sockaddr_in6*)sa)->sin6_addr, &in6addr_loopback, masklen ) )
                 return 1;
-            }
-            tent->subtype = AF_INET6;
-            tent->masklen = 128;
-            tent->k.addr6 = ((struct sockaddr_in6*)addr)->sin6_addr;
+            if( masklen > 128 )
+                masklen = 128;
             break;
 #endif
 
         default:
-            free( oh );
-            return 1;
+            return 0;
+    }
+    sockaddrToKey( sa, addr );
+
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_lock( &ifLock );
+#endif
+
+    // reload local interfaces if they changed
+    if( localStale || ((routeSocket == -1) ? (time( NULL ) - localLoaded >= LOCAL_RELOAD) : localChanged( )) )
+        loadLocalAddresses( );
+
+    if( masklen == 128 )
+    {
+        // single addresses are looked up in the hash index
+        for( h = hashKey( addr ) & localMask; localIndex && localIndex[h]; h = (h + 1) & localMask )
+            if( !memcmp( localAddrs[localIndex[h] - 1], addr, 16 ) )
+            {
+                rc = 1;
+                break;
+            }
+    }
+    else
+    {
+        // prefixes have to be compared to every address
+        for( i = 0; (i < localCount) && !rc; i++ )
+            rc = samePrefix( addr, localAddrs[i], masklen );
     }
 
-    rc = setsockopt( ipfw_socket, IPPROTO_IP, IP_FW3, &(oh->opheader), l );
-    free( oh );
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_unlock( &ifLock );
+#endif
+
     return rc;
 }
 
-// Get all IP addresses and associated values in given table and call
-// a callback function with each of them.
-// Note: The callback may alter the state of the table. This function
-// always reflects the unaltered state of the table for all callbacks.
-int fw_list( void (*callback)(struct sockaddr*, socklen_t, u_int32_t, u_int16_t), u_int16_t table )
+// Parse a dotted quad of len characters with up to three decimal digits per
+// part (leading zeros are allowed and do not mean octal)
+static int parseIPv4( const char* s, size_t len, unsigned char* addr )
 {
-    ipfw_obj_header *oh;
-    ipfw_xtable_info *ti;
-	ipfw_obj_tentry *tent;
-    socklen_t l;
-    struct sockaddr_in sa4 = { 0 };
-#ifdef WITH_IPV6
-    struct sockaddr_in6 sa6 = { 0 };
-#endif
+    unsigned int part, val, digits;
+    size_t i = 0;
 
-    if( ipfw_socket == -1 )
-        return -1;
+    for( part = 0; part < 4; part++ )
+    {
+        for( val = 0, digits = 0; (i < len) && (s[i] >= '0') && (s[i] <= '9') && (digits < 3); i++, digits++ )
+            val = 10*val + (s[i] - '0');
+        if( (digits == 0) || (val > 255) )
+            return 0;
+        addr[part] = val;
+        if( part < 3 )
+        {
+            if( (i >= len) || (s[i] != '.') )
+                return 0;
+            i++;
+        }
+    }
 
-    // obtain table info
-    l = sizeof(ipfw_obj_header) + sizeof(ipfw_xtable_info);
-    if( (oh = (ipfw_obj_header*)calloc( 1, l )) == NULL )
-        return 1;
-    oh->opheader.opcode = IP_FW_TABLE_XINFO;
-    oh->opheader.version = 1;
-    oh->ntlv.head.type = IPFW_TLV_TBL_NAME;
-    oh->ntlv.head.length = sizeof(ipfw_obj_ntlv);
-    oh->ntlv.idx = 1;
-	oh->ntlv.set = 0;
-    snprintf( oh->ntlv.name, sizeof(oh->ntlv.name), "%hu", table );
-    oh->idx = 1;
-    if( getsockopt( ipfw_socket, IPPROTO_IP, IP_FW3, &(oh->opheader), &l ) < 0 )
-    {
-        free( oh );
+    return i == len;
+}
+
+// Parse a numeric IPv4 or IPv6 address of len characters into a 16 byte
+// address key, with IPv4 addresses as IPv4-mapped IPv6 addresses.
+// Returns 0 if it is not a numeric address (e.g. a host name).
+int parseAddress( const char* host, size_t len, unsigned char addr[16] )
+{
+    unsigned int words[8], n = 0, val, digits, k;
+    int gap = -1;
+    size_t i = 0, start;
+
+    // IPv4 (by far the most common case)
+    if( (len <= 15) && parseIPv4( host, len, &addr[12] ) )
+    {
+        memcpy( addr, ipv4_mapped, sizeof(ipv4_mapped) );
         return 1;
     }
-    ti = (ipfw_xtable_info*)(oh + 1);
-    if( ti->type != IPFW_TABLE_ADDR || (ti->vmask & VTYPE) == 0 )     // also accepts VTYPE_LEGACY
+
+    // IPv6: up to eight groups of hex digits, one "::" gap, and an optional IPv4 tail
+    if( (len < 2) || (len > 45) )
+        return 0;
+    if( (host[0] == ':') && (host[1] == ':') )
     {
-        free( oh );
-        return 1;
+        gap = 0;
+        i = 2;
     }
-    if( ti->count == 0 )
+    while( i < len )
     {
-        free( oh );
+        start = i;
+        for( val = 0, digits = 0; (i < len) && (digits < 4); i++, digits++ )
+        {
+            if( (host[i] >= '0') && (host[i] <= '9') )
+                val = 16*val + (host[i] - '0');
+            else if( (host[i] >= 'a') && (host[i] <= 'f') )
+                val = 16*val + (host[i] - 'a' + 10);
+            else if( (host[i] >= 'A') && (host[i] <= 'F') )
+                val = 16*val + (host[i] - 'A' + 10);
+            else
+                break;
+        }
+
+        // the last two groups can be written as dotted quad
+        if( (i < len) && (host[i] == '.') )
+        {
+            if( (n > 6) || !parseIPv4( &host[start], len - start, &addr[0] ) )
+                return 0;
+            words[n++] = (addr[0] << 8) | addr[1];
+            words[n++] = (addr[2] << 8) | addr[3];
+            break;
+        }
+
+        if( (digits == 0) || (n >= 8) )
+            return 0;
+        words[n++] = val;
+        if( i == len )
+            break;
+        if( (host[i] != ':') || (++i == len) )
+            return 0;
+        if( host[i] == ':' )
+        {
+            if( gap >= 0 )
+                return 0;
+            gap = n;
+            i++;
+        }
+    }
+
+    // expand the gap with zeros
+    if( gap >= 0 )
+    {
+        if( n >= 8 )
+            return 0;
+        for( k = 0; k < n - gap; k++ )
+            words[7-k] = words[n-1-k];
+        for( k = gap; k < gap + 8 - n; k++ )
+            words[k] = 0;
+    }
+    else if( n != 8 )
         return 0;
+
+    for( k = 0; k < 8; k++ )
+    {
+        addr[2*k] = words[k] >> 8;
+        addr[2*k+1] = words[k] & 0xff;
     }
 
-    // obtain table entries
-    l = sizeof(ipfw_obj_header) + sizeof(ipfw_xtable_info) + ti->size;
-    if( (oh = (ipfw_obj_header*)realloc( oh, l )) == NULL )
-        return 1;
-    oh->opheader.opcode = IP_FW_TABLE_XLIST;
-    if( getsockopt( ipfw_socket, IPPROTO_IP, IP_FW3, oh, &l ) < 0 )
+    return 1;
+}
+
+// Print an address key as numeric IPv4 or IPv6 address
+const char* formatAddress( const unsigned char addr[16], char* buf, size_t size )
+{
+
+    if( memcmp( addr, ipv4_mapped, sizeof(ipv4_mapped) ) == 0 )
+        snprintf( buf, size, "%u.%u.%u.%u", addr[12], addr[13], addr[14], addr[15] );
+    else if( !inet_ntop( AF_INET6, addr, buf, size ) )
+        strncpy( buf, "???", size );
+
+    return buf;
+}
+
+// Print an address key and its prefix length, omitting the length of single addresses
+const char* formatPrefix( const unsigned char addr[16], unsigned int masklen, char* buf, size_t size )
+{
+    size_t len;
+
+    formatAddress( addr, buf, size );
+    len = strlen( buf );
+    if( masklen < 128 )
+        snprintf( buf + len, size - len, "/%u", memcmp( addr, ipv4_mapped, sizeof(ipv4_mapped) ) == 0 ? masklen - 96 : masklen );
+
+    return buf;
+}
+
+// Clear all but the first prefix4 bits of an IPv4 or prefix6 bits of an IPv6
+// address key. Returns the prefix length within the address key.
+unsigned int maskAddress( unsigned char addr[16], unsigned int prefix4, unsigned int prefix6 )
+{
+    unsigned int masklen, i;
+
+    if( memcmp( addr, ipv4_mapped, sizeof(ipv4_mapped) ) == 0 )
+        masklen = 96 + (prefix4 < 32 ? prefix4 : 32);
+    else
+        masklen = prefix6 < 128 ? prefix6 : 128;
+
+    if( masklen%8 )
+        addr[masklen/8] &= 0xff00 >> (masklen%8);
+    for( i = (masklen + 7)/8; i < 16; i++ )
+        addr[i] = 0;
+
+    return masklen;
+}
+
+// Parse a numeric address prefix "address/length" into an address key and its
+// prefix length within the key (masking the address).
+// Returns 0 if host is no prefix, 1 if it is, and -1 if it is an invalid one.
+int parsePrefix( const char* host, unsigned char addr[16], unsigned int* masklen )
+{
+    const char* slash = strchr( host, '/' );
+    char* end;
+    unsigned long len;
+
+    if( !slash )
+        return 0;
+    len = strtoul( slash + 1, &end, 10 );
+    if( (slash[1] < '0') || (slash[1] > '9') || (*end != '\0') || !parseAddress( host, slash - host, addr ) ||
+        (len > (memcmp( addr, ipv4_mapped, sizeof(ipv4_mapped) ) == 0 ? 32 : 128)) )
+        return -1;
+    *masklen = maskAddress( addr, len, len );
+
+    return 1;
+}
+
+// Convert an address key with a prefix length within the key to a socket
+// address and the prefix length used by the firewall.
+// Returns non-zero if the address is not supported.
+int keyToSockaddr( const unsigned char addr[16], unsigned int masklen, struct sockaddr_storage* ss, socklen_t* sslen, u_int8_t* fwlen )
+{
+    struct sockaddr_in* sin = (struct sockaddr_in*)ss;
+#ifdef WITH_IPV6
+    struct sockaddr_in6* sin6 = (struct sockaddr_in6*)ss;
+#endif
+
+    memset( ss, 0, sizeof(*ss) );
+    if( memcmp( addr, ipv4_mapped, sizeof(ipv4_mapped) ) == 0 )
     {
-        free( oh );
-        return 1;
+        sin->sin_family = AF_INET;
+        memcpy( &sin->sin_addr, &addr[12], 4 );
+        *sslen = sizeof(*sin);
+        *fwlen = masklen > 96 ? masklen - 96 : 0;
+        return 0;
     }
 
-    // call the callback for each address in table
-    ti = (ipfw_xtable_info*)(oh + 1);
-    tent = (ipfw_obj_tentry*)(ti + 1);
-    sa4.sin_family = AF_INET;
 #ifdef WITH_IPV6
-    sa6.sin6_family = AF_INET6;
+    sin6->sin6_family = AF_INET6;
+    memcpy( &sin6->sin6_addr, addr, 16 );
+    *sslen = sizeof(*sin6);
+    *fwlen = masklen;
+    return 0;
+#else
+    return 1;
 #endif
-    for( l = 0; l < ti->count; l++ )
+}
+
+// Convert an IPv4 or IPv6 socket address to an address key.
+// Returns 0 if the address family is not supported.
+int sockaddrToKey( const struct sockaddr* sa, unsigned char addr[16] )
+{
+    switch( sa->sa_family )
     {
-        if( tent->subtype == AF_INET )
+        case AF_INET:
+            memcpy( addr, ipv4_mapped, sizeof(ipv4_mapped) );
+            memcpy( &addr[12], &((const struct sockaddr_in*)sa)->sin_addr, 4 );
+            return 1;
+
+        case AF_INET6:
+            memcpy( addr, &((const struct sockaddr_in6*)sa)->sin6_addr, 16 );
+            return 1;
+
+        default:
+            return 0;
+    }
+}
+
+// pretty-print an address prefix for the log
+static void printPrefix( struct sockaddr* sa, socklen_t salen, u_int8_t masklen, char* ip, size_t size )
+{
+    size_t len;
+
+    if( getnameinfo( sa, salen, ip, size, NULL, 0, NI_NUMERICHOST ) )
+        strncpy( ip, "???", size );
+    len = strlen( ip );
+    if( masklen < (sa->sa_family == AF_INET ? 32 : 128) )
+        snprintf( ip + len, size - len, "/%u", masklen );
+}
+
+// Log the result rc of fw_add for an address prefix
+static int logAdd( struct sockaddr* sa, socklen_t salen, u_int8_t masklen, uint32_t table, time_t rt, int rc )
+{
+    char ip[NI_MAXHOST + 4] = { 0 };
+
+    // pretty-print the IP of the host to block if needed
+    if( loglevel >=1 )
+        printPrefix( sa, salen, masklen, ip, sizeof(ip) );
+
+    if( rc == 2 )
+    {
+        // don't count existing IPs as errors
+        if( loglevel >= 2 )
+            syslog( LOG_INFO, "IP %s already in table %d (%s).", ip, table, fw_name( ) );
+    }
+    else if( rc )
+    {
+        if( loglevel >= 1 )
+            syslog( LOG_NOTICE, "Failed to add IP %s to table %d (%s, rc=%d).", ip, table, fw_name( ), rc );
+        return -1;
+    }
+    else
+        if( loglevel >= 2 )
         {
-            sa4.sin_addr = tent->k.addr;
-            (*callback)( (struct sockaddr*)&sa4, sizeof(sa4), VALUE(tent->v, ti->vmask), table );
+            if( rt > 0 )
+                syslog( LOG_INFO, "Added %s to table %i (%s) for %ld seconds.", ip, table, fw_name( ), rt );
+            else
+                syslog( LOG_INFO, "Added %s to table %d (%s).", ip, table, fw_name( ) );
         }
-#ifdef WITH_IPV6
-        else if( tent->subtype == AF_INET6 )
+
+    return 0;
+}
+
+#ifdef HAVE_LIBPTHREAD
+// Add n queued addresses of the same table to the firewall with one command
+// and log the results
+static void fwWriteBatch( struct fw_pending** batch, unsigned int n )
+{
+    unsigned char key[16];
+    unsigned int i;
+
+    for( i = 0; i < n; i++ )
+    {
+        fwEntry[i].addr = (struct sockaddr*)&batch[i]->ss;
+        fwEntry[i].addrlen = batch[i]->sslen;
+        fwEntry[i].masklen = batch[i]->masklen;
+        fwEntry[i].value = batch[i]->value;
+    }
+
+    if( !fw->add_batch || fw->add_batch( fwEntry, n, batch[0]->table ) )
+    {
+        // add them one by one to find out which ones failed
+        for( i = 0; i < n; i++ )
+            fwEntry[i].result = fw_add( fwEntry[i].addr, fwEntry[i].addrlen, fwEntry[i].masklen, fwEntry[i].value, batch[i]->table );
+    }
+
+    for( i = 0; i < n; i++ )
+        if( logAdd( fwEntry[i].addr, fwEntry[i].addrlen, fwEntry[i].masklen, batch[i]->table, batch[i]->rt, fwEntry[i].result ) &&
+            sockaddrToKey( fwEntry[i].addr, key ) )
+            fw_report_failure( key, NULL, batch[i]->table );
+
+    pthread_mutex_lock( &fwLock );
+    fwEntries += n;
+    fwBatches++;
+    pthread_mutex_unlock( &fwLock );
+}
+
+// Add n queued addresses to the firewall in batches of the same table
+static void fwWrite( struct fw_pending* queue, unsigned int n )
+{
+    unsigned int i, j, k;
+
+    for( i = 0; i < n; i++ )
+        queue[i].written = 0;
+
+    for( i = 0; i < n; i++ )
+    {
+        if( queue[i].written )
+            continue;
+        for( j = i, k = 0; (j < n) && (k < fwBatchMax); j++ )
+            if( !queue[j].written && (queue[j].table == queue[i].table) )
+            {
+                queue[j].written = 1;
+                fwBatch[k++] = &queue[j];
+            }
+        fwWriteBatch( fwBatch, k );
+    }
+}
+
+// Write batches of queued additions until told to stop
+static void* fwWriterLoop( void* arg )
+{
+    struct fw_pending* queue;
+    unsigned int n, size;
+
+    (void)arg;
+    pthread_mutex_lock( &fwLock );
+    for( ;; )
+    {
+        // wait until a batch is full or its first addition waited long enough
+        while( !fwStop && (fwQueued < fwBatchMax) )
         {
-            sa6.sin6_addr = tent->k.addr6;
-            (*callback)( (struct sockaddr*)&sa6, sizeof(sa6), VALUE(tent->v, ti->vmask), table );
+            if( !fwQueued )
+                pthread_cond_wait( &fwWork, &fwLock );
+            else if( pthread_cond_timedwait( &fwWork, &fwLock, &fwDue ) == ETIMEDOUT )
+                break;
         }
-#endif
-        tent = (ipfw_obj_tentry*)((caddr_t)tent + tent->head.length);
+        if( !fwQueued )
+        {
+            if( fwStop )
+                break;
+            continue;
+        }
+
+        // take all queued additions, new ones go to the spare queue meanwhile
+        queue = fwQueue;
+        n = fwQueued;
+        size = fwQueueSize;
+        fwQueue = fwSpare;
+        fwQueueSize = fwSpareSize;
+        fwQueued = 0;
+        pthread_mutex_unlock( &fwLock );
+
+        fwWrite( queue, n );
+
+        pthread_mutex_lock( &fwLock );
+        fwSpare = queue;
+        fwSpareSize = size;
     }
+    pthread_mutex_unlock( &fwLock );
 
-    free( oh );
-    return 0;
+    return NULL;
 }
 
-/* Higher level utility routines */
+// Queue an address prefix for the writer thread.
+// Returns non-zero if there is no writer thread or no memory.
+static int fwQueueAdd( struct sockaddr* sa, socklen_t salen, u_int8_t masklen, uint32_t value, uint32_t table, time_t rt )
+{
+    struct fw_pending* q;
 
-// read a line from a file and remove the trailing newline
-ssize_t readline( char **line, size_t *size, FILE *f )
+    if( salen > sizeof(q->ss) )
+        return -1;
+
+    pthread_mutex_lock( &fwLock );
+    if( !fwRunning )
+    {
+        pthread_mutex_unlock( &fwLock );
+        return -1;
+    }
+
+    // the queue grows instead of making anybody wait for the writer
+    if( fwQueued == fwQueueSize )
+    {
+        if( !(q = (struct fw_pending*) realloc( fwQueue, 2*fwQueueSize*sizeof(struct fw_pending) )) )
+        {
+            pthread_mutex_unlock( &fwLock );
+            return -1;
+        }
+        fwQueue = q;
+        fwQueueSize *= 2;
+    }
+
+    q = &fwQueue[fwQueued];
+    memcpy( &q->ss, sa, salen );
+    q->sslen = salen;
+    q->masklen = masklen;
+    q->table = table;
+    q->value = value;
+    q->rt = rt;
+
+    if( fwQueued++ == 0 )
+    {
+        // the first addition of a batch sets its deadline
+        clock_gettime( CLOCK_REALTIME, &fwDue );
+        fwDue.tv_sec += fwWait/1000;
+        fwDue.tv_nsec += (fwWait%1000)*1000000L;
+        if( fwDue.tv_nsec >= 1000000000L )
+        {
+            fwDue.tv_sec++;
+            fwDue.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_signal( &fwWork );
+    }
+    else if( fwQueued == fwBatchMax )
+        pthread_cond_signal( &fwWork );
+    pthread_mutex_unlock( &fwLock );
+
+    return 0;
+}
+#endif
+
+// Start the thread writing additions to the firewall tables in batches
+int fw_writer_start( unsigned int max, unsigned int wait )
 {
-    ssize_t rc;
+#ifdef HAVE_LIBPTHREAD
+    sigset_t all, old;
+    int rc;
 
-    rc = getline( line, size, f );
-    if( (rc > 0) && ((*line)[rc-1] == '\n') )
+    if( fwRunning || !max )
+        return -1;
+
+    fwBatchMax = max;
+    fwWait = wait;
+    fwQueueSize = fwSpareSize = 2*max;
+    fwEntry = (struct fw_entry*) calloc( max, sizeof(struct fw_entry) );
+    fwBatch = (struct fw_pending**) calloc( max, sizeof(struct fw_pending*) );
+    fwQueue = (struct fw_pending*) calloc( fwQueueSize, sizeof(struct fw_pending) );
+    fwSpare = (struct fw_pending*) calloc( fwSpareSize, sizeof(struct fw_pending) );
+    if( !fw || !fwEntry || !fwBatch || !fwQueue || !fwSpare )
     {
-        (*line)[rc-1] = '\0';
-        rc--;
+        fw_writer_stop( );
+        return -1;
     }
 
-    return rc;
+    // signals are handled by the main thread only
+    fwStop = 0;
+    sigfillset( &all );
+    pthread_sigmask( SIG_BLOCK, &all, &old );
+    rc = pthread_create( &fwWriter, NULL, fwWriterLoop, NULL );
+    pthread_sigmask( SIG_SETMASK, &old, NULL );
+    if( rc )
+    {
+        fw_writer_stop( );
+        return -1;
+    }
+    fwRunning = 1;
+
+    return 0;
+#else
+    return -1;
+#endif
 }
 
-// release list of local interface addresses so they are reloaded when needed
-void updateLocalInterfaces( )
+// Write all queued additions and stop the writer thread
+void fw_writer_stop( )
 {
-    if( ifAddrs ) freeifaddrs( ifAddrs );
-    ifAddrs = NULL;
+#ifdef HAVE_LIBPTHREAD
+    int running;
+
+    pthread_mutex_lock( &fwLock );
+    running = fwRunning;
+    fwRunning = 0;
+    fwStop = 1;
+    pthread_cond_signal( &fwWork );
+    pthread_mutex_unlock( &fwLock );
+    if( running )
+        pthread_join( fwWriter, NULL );
+
+    free( fwEntry );
+    free( fwBatch );
+    free( fwQueue );
+    free( fwSpare );
+    fwEntry = NULL;
+    fwBatch = NULL;
+    fwQueue = fwSpare = NULL;
+    fwQueued = fwQueueSize = fwSpareSize = 0;
+#endif
 }
 
-// check if the given address matches one of our local interfaces
-int isLocal( struct sockaddr *sa )
+// Statistics of the writer thread
+void fw_writer_stats( unsigned long* entries, unsigned long* batches, unsigned int* queued )
 {
-    struct ifaddrs *ifa;
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_lock( &fwLock );
+    *entries = fwEntries;
+    *batches = fwBatches;
+    *queued = fwQueued;
+    pthread_mutex_unlock( &fwLock );
+#else
+    *entries = *batches = 0;
+    *queued = 0;
+#endif
+}
 
-    // Check for loopback and supported address family
-    switch( sa->sa_family )
+// Report a failed block from another thread
+void fw_report_failure( const unsigned char addr[16], const char* host, uint32_t table )
+{
+#ifdef HAVE_LIBPTHREAD
+    struct fw_failure* f;
+
+    pthread_mutex_lock( &fwFailLock );
+    if( fwFailCount == FW_FAILURES )
+        fwFailLost = 1;
+    else
     {
-        case AF_INET:
-            if( IN_LOOPBACK( ntohl( ((struct sockaddr_in*)sa)->sin_addr.s_addr ) ) )
-                return 1;
-            break;
+        f = &fwFailed[(fwFailHead + fwFailCount++) % FW_FAILURES];
+        if( addr )
+            memcpy( f->addr, addr, 16 );
+        else
+            memset( f->addr, 0, 16 );
+        snprintf( f->host, sizeof(f->host), "%s", host ? host : "" );
+        f->table = table;
+    }
+    pthread_mutex_unlock( &fwFailLock );
+#else
+    (void)addr; (void)host; (void)table;
+#endif
+}
 
-#ifdef WITH_IPV6
-        case AF_INET6:
-            if( IN6_IS_ADDR_LOOPBACK( &((struct sockaddr_in6*)sa)->sin6_addr ) )
-                return 1;
-            break;
+// Take the oldest failed block
+int fw_failure( struct fw_failure* f )
+{
+#ifdef HAVE_LIBPTHREAD
+    int rc = 0;
+
+    pthread_mutex_lock( &fwFailLock );
+    if( fwFailLost )
+    {
+        // the caller has to assume that anything could have failed
+        fwFailLost = 0;
+        fwFailHead = fwFailCount = 0;
+        rc = -1;
+    }
+    else if( fwFailCount )
+    {
+        *f = fwFailed[fwFailHead];
+        fwFailHead = (fwFailHead + 1) % FW_FAILURES;
+        fwFailCount--;
+        rc = 1;
+    }
+    pthread_mutex_unlock( &fwFailLock );
+
+    return rc;
+#else
+    (void)f;
+    return 0;
 #endif
+}
 
-        default:
-            return 0;
+// Add a single resolved address prefix of masklen bits to the firewall table and log the result
+static int addAddress( struct sockaddr* sa, socklen_t salen, u_int8_t masklen, uint32_t value, uint32_t table, time_t rt, int bl )
+{
+    char ip[NI_MAXHOST + 4] = { 0 };
+
+    if( !bl && isLocal( sa, masklen ) )
+    {
+        if( loglevel >= 2 )
+        {
+            printPrefix( sa, salen, masklen, ip, sizeof(ip) );
+            syslog( LOG_INFO, "Not blocking local IP %s.", ip );
+        }
+        return 0;
     }
 
-    // load local interfaces if needed
-    if( !ifAddrs ) getifaddrs( &ifAddrs );
-    ifa = ifAddrs;
+#ifdef HAVE_LIBPTHREAD
+    // leave it to the writer thread if there is one, which logs the result
+    if( !fwQueueAdd( sa, salen, masklen, value, table, rt ) )
+        return 0;
+#endif
+
+    return logAdd( sa, salen, masklen, table, rt, fw_add( sa, salen, masklen, value, table ) );
+}
 
-    // Check each interface
-    while( ifa )
+// Add the given address key (see parseAddress) with a prefix length of masklen
+// bits within the key (see maskAddress) to firewall table without resolving it.
+// Otherwise the same as addHostLong.
+int addAddressLong( const unsigned char addr[16], unsigned int masklen, uint32_t value, uint32_t table, time_t rt, int bl )
+{
+    struct sockaddr_storage ss;
+    socklen_t sslen;
+    u_int8_t fwlen;
+    char ip[INET6_ADDRSTRLEN + 4];
+
+    if( keyToSockaddr( addr, masklen, &ss, &sslen, &fwlen ) )
     {
-        if( ifa->ifa_addr->sa_family == sa->sa_family )
-            switch( sa->sa_family )
-            {
-                case AF_INET:
-                    if( ((struct sockaddr_in*)sa)->sin_addr.s_addr == ((struct sockaddr_in*)ifa->ifa_addr)->sin_addr.s_addr )
-                        return 1;
-                    break;
+        if( loglevel >= 1 )
+            syslog( LOG_NOTICE, "Failed to block '%s': no IPv6 support", formatPrefix( addr, masklen, ip, sizeof(ip) ) );
+        return -1;
+    }
 
-#ifdef WITH_IPV6
-                case AF_INET6:
-                    if( IN6_ARE_ADDR_EQUAL( &((struct sockaddr_in6*)ifa->ifa_addr)->sin6_addr, &((struct sockaddr_in6*)sa)->sin6_addr ) )
-                        return 1;
-                    break;
+    return addAddress( (struct sockaddr*)&ss, sslen, fwlen, value, table, rt, bl );
+}
+
+// Resolve a host name to at most max address keys (IPv4 only without IPv6
+// support). Returns the number of addresses, or -1 if it could not be resolved.
+int resolveHost( const char* host, unsigned char addrs[][16], unsigned int max )
+{
+    struct addrinfo *res = NULL, *ai;
+    struct addrinfo hints = { 0 };
+    unsigned int n = 0, i;
+    int rc;
+
+    hints.ai_flags = AI_ADDRCONFIG;
+    // prevent getaddrinfo from returning various socktype/protocol combinations for the same address
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_protocol = IPPROTO_UDP;
+#ifndef WITH_IPV6
+    // only ask for IPv4 addresses
+    hints.ai_family = AF_INET;
+#else
+    hints.ai_family = PF_UNSPEC;
 #endif
-            }
-        ifa = ifa->ifa_next;
+    rc = getaddrinfo( host, NULL, &hints, &res );
+    if( rc )
+    {
+        if( loglevel >= 1 )
+            syslog( LOG_NOTICE, "Failed to resolve '%s' for blocking: %s (rc=%d)", host, gai_strerror( rc ), rc );
+        return -1;
     }
 
-    return 0;
+    for( ai = res; ai && (n < max); ai = ai->ai_next )
+    {
+        if( !sockaddrToKey( ai->ai_addr, addrs[n] ) )
+            continue;
+        // skip duplicates
+        for( i = 0; (i < n) && memcmp( addrs[i], addrs[n], 16 ); i++ )
+            ;
+        if( i == n )
+            n++;
+    }
+
+    freeaddrinfo( res );
+
+    return n;
 }
 
-// Add the given host (DNS name or IP address) to firewall table.
+// Add the given host (DNS name, IP address, or numeric address/length prefix) to firewall table.
 // If rt>0 it specifies the number of seconds the host is blocked for, which is
 // used in the log messages.
 // If bl is non-zero, there is no check to prevent blocking local IPs
@@ -361,9 +1164,21 @@ int addHostLong( const char* host, uint32_t value, uint32_t table, time_t rt, in
 {
     struct addrinfo *res = NULL, *ai;
     struct addrinfo hints = { 0 };
-    char ip[NI_MAXHOST] = { 0 };
+    unsigned char addr[16];
+    unsigned int masklen;
     int rc, err = 0;
 
+    // numeric address prefixes are added as they are
+    rc = parsePrefix( host, addr, &masklen );
+    if( rc > 0 )
+        return addAddressLong( addr, masklen, value, table, rt, bl );
+    else if( rc < 0 )
+    {
+        if( loglevel >= 1 )
+            syslog( LOG_NOTICE, "Invalid address prefix '%s' for blocking", host );
+        return -1;
+    }
+
     hints.ai_flags = AI_ADDRCONFIG;
     // prevent getaddrinfo from returning various socktype/protocol combinations for the same address
     hints.ai_socktype = SOCK_DGRAM;
@@ -385,42 +1200,7 @@ int addHostLong( const char* host, uint32_t value, uint32_t table, time_t rt, in
     ai = res;
     while( ai != NULL )
     {
-        // pretty-print the IP of the host to block if needed
-        if( loglevel >=1 )
-            if( getnameinfo( ai->ai_addr, ai->ai_addrlen, ip, sizeof(ip), NULL, 0, NI_NUMERICHOST ) )
-                strncpy( ip, "???", sizeof(ip) );
-
-        if( !bl && isLocal( ai->ai_addr ) )
-        {
-            if( loglevel >= 2 )
-                syslog( LOG_INFO, "Not blocking local IP %s.", ip );
-            ai = ai->ai_next;
-            continue;
-        }
-
-        rc = fw_add( ai->ai_addr, ai->ai_addrlen, value, table );
-
-        if( rc == 2 )
-        {
-            // don't count existing IPs as errors
-            if( loglevel >= 2 )
-                syslog( LOG_INFO, "IP %s already in IPFW table %d.", ip, table );
-        }
-        else if( rc )
-        {
-            if( loglevel >= 1 )
-                syslog( LOG_NOTICE, "Failed to add IP %s to IPFW table %d (rc=%d).", ip, table, rc );
-            err--;
-        }
-        else
-            if( loglevel >= 2 )
-            {
-                if( rt > 0 )
-                    syslog( LOG_INFO, "Added %s to IPFW table %i for %ld seconds.", ip, table, rt );
-                else
-                    syslog( LOG_INFO, "Added %s to IPFW table %d.", ip, table );
-            }
-
+        err += addAddress( ai->ai_addr, ai->ai_addrlen, ai->ai_family == AF_INET ? 32 : 128, value, table, rt, bl );
         ai = ai->ai_next;
     }
 
@@ -435,15 +1215,47 @@ int addHost( const char* host, uint32_t value, uint32_t table )
     return addHostLong( host, value, table, 0, 0 );
 }
 
-// Remove the given host (DNS name or IP address) from firewall table.
+// Remove the given address key with a prefix length of masklen bits within the
+// key from firewall table. Removing non-existing entries is not considered an error.
+int removeAddress( const unsigned char addr[16], unsigned int masklen, uint32_t table )
+{
+    struct sockaddr_storage ss;
+    socklen_t sslen;
+    u_int8_t fwlen;
+    char ip[INET6_ADDRSTRLEN + 4];
+
+    if( keyToSockaddr( addr, masklen, &ss, &sslen, &fwlen ) )
+        return -1;
+
+    fw_del( (struct sockaddr*)&ss, sslen, fwlen, table );
+    if( loglevel >= 2 )
+        syslog( LOG_INFO, "Removed %s from table %d (%s).", formatPrefix( addr, masklen, ip, sizeof(ip) ), table, fw_name( ) );
+
+    return 0;
+}
+
+// Remove the given host (DNS name, IP address, or numeric address/length prefix) from firewall table.
 // Removing non-existing entries is not considered an error.
 int removeHost( const char* host, uint32_t table )
 {
     struct addrinfo *res = NULL, *ai;
     struct addrinfo hints = { 0 };
+    unsigned char addr[16];
+    unsigned int masklen;
     char ip[NI_MAXHOST] = { 0 };
     int rc;
 
+    // numeric address prefixes are removed as they are
+    rc = parsePrefix( host, addr, &masklen );
+    if( rc > 0 )
+        return removeAddress( addr, masklen, table );
+    else if( rc < 0 )
+    {
+        if( loglevel >= 1 )
+            syslog( LOG_NOTICE, "Invalid address prefix '%s' for removing", host );
+        return -1;
+    }
+
     hints.ai_flags = AI_ADDRCONFIG;
     // prevent getaddrinfo from returning various socktype/protocol combinations for the same address
     hints.ai_socktype = SOCK_DGRAM;
@@ -465,13 +1277,13 @@ int removeHost( const char* host, uint32_t table )
     ai = res;
     while( ai != NULL )
     {
-        rc = fw_del( ai->ai_addr, ai->ai_addrlen, table );
+        rc = fw_del( ai->ai_addr, ai->ai_addrlen, ai->ai_family == AF_INET ? 32 : 128, table );
 
         if( loglevel >=2 )
         {
             if( getnameinfo( ai->ai_addr, ai->ai_addrlen, ip, sizeof(ip), NULL, 0, NI_NUMERICHOST ) )
                 strncpy( ip, "???", sizeof(ip) );
-            syslog( LOG_INFO, "Removed %s from IPFW table %d.", ip, table );
+            syslog( LOG_INFO, "Removed %s from table %d (%s).", ip, table, fw_name( ) );
         }
 
         ai = ai->ai_next;
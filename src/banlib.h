@@ -25,20 +25,95 @@
 
 /* Low level firewall functionality */
 
+// Select the firewall backend ("ipfw", "nft" or the in-memory simulation
+// "sim"), optionally followed by ":" and options of the backend. Has to be
+// called before fw_init. NULL selects the default backend (IPFW if available,
+// otherwise nftables).
+// Returns non-zero if there is no such backend.
+int fw_select( const char* name );
+
+// Environment variable the programs select the firewall backend with
+#define FIREWALL_ENV "BANHAMMER_FIREWALL"
+
+// Name of the selected firewall backend
+const char* fw_name( );
+
+// Returns non-zero if the selected firewall backend needs root privileges
+int fw_privileged( );
+
 // Initialize firewall
 int fw_init( );
 
 // Close firewall
 int fw_close( );
 
-// Add an address and associated value to a table
-int fw_add( struct sockaddr *addr, socklen_t addrlen, u_int32_t value, u_int16_t table );
+// Add an address prefix of masklen bits (32 or 128 for single addresses) and associated value to a table
+int fw_add( struct sockaddr *addr, socklen_t addrlen, u_int8_t masklen, u_int32_t value, u_int16_t table );
+
+// Remove an address prefix of masklen bits from a table
+int fw_del( struct sockaddr *addr, socklen_t addrlen, u_int8_t masklen, u_int16_t table );
+
+// Address prefix added to or removed from a table as part of a batch
+struct fw_entry {
+    struct sockaddr* addr;      // Address
+    socklen_t addrlen;          // Length of the address
+    u_int8_t masklen;           // Prefix length of the address
+    u_int32_t value;            // Value to store with it (ignored when removing)
+    int result;                 // Set by the firewall: result as returned by fw_add or fw_del
+};
+
+// Remove n address prefixes from a table, with as few firewall commands as
+// possible, setting the result of every entry. Returns the number removed.
+// Not to be used while the writer thread (fw_writer_start) runs.
+unsigned int fw_del_batch( struct fw_entry* entries, unsigned int n, u_int16_t table );
+
+// List all address prefixes and associated values in a table using a callback function
+int fw_list( void (*callback)(struct sockaddr *addr, socklen_t addrlen, u_int8_t masklen, u_int32_t, u_int16_t), u_int16_t table );
+
+// Get the number of entries in a table and a count that changes with every
+// modification of the table (always 0 if the firewall has none).
+// Returns non-zero on error or if not supported by the firewall.
+int fw_info( u_int16_t table, unsigned long* count, unsigned long* generation );
+
+// Look up the value associated with an address prefix in a table.
+// Returns 0 if found, 1 if the prefix is not in the table, and -1 if that
+// cannot be told (error, or not supported by the firewall).
+int fw_find( struct sockaddr *addr, socklen_t addrlen, u_int8_t masklen, u_int16_t table, u_int32_t* value );
+
+// Returns non-zero if the firewall removes entries itself when their value
+// (expiration time) has passed
+int fw_expiring( );
+
+// Returns non-zero if a table can hold a prefix and entries within it at once.
+// Otherwise adding a prefix overlapping other entries fails.
+int fw_nesting( );
+
+// Start a thread adding the addresses blocked by addHostLong and addAddressLong
+// to the firewall tables in the background. Additions to the same table are
+// written in batches of up to max entries, at most wait milliseconds after the
+// first one was queued. Returns non-zero if the thread could not be started.
+int fw_writer_start( unsigned int max, unsigned int wait );
 
-// Remove an address from a table
-int fw_del( struct sockaddr *addr, socklen_t addrlen, u_int16_t table );
+// Write all queued additions and stop the writer thread
+void fw_writer_stop( );
 
-// List all addresses and associated values in a table using a callback function
-int fw_list( void (*callback)(struct sockaddr *addr, socklen_t addrlen, u_int32_t, u_int16_t), u_int16_t table );
+// Statistics: additions written in batches, batches written, and additions queued
+void fw_writer_stats( unsigned long* entries, unsigned long* batches, unsigned int* queued );
+
+// A block that failed after it was handed to the writer or resolver threads
+struct fw_failure {
+    unsigned char addr[16];     // Address key (see parseAddress), unless host is set
+    char host[256];             // Host name that could not be blocked, or empty
+    uint32_t table;             // Table it was to be added to
+};
+
+// Report a failed block of an address key or, if addr is NULL, a host name
+// from a thread other than the main thread (see fw_failure)
+void fw_report_failure( const unsigned char addr[16], const char* host, uint32_t table );
+
+// Take the oldest reported failure. Returns 1 if there was one, 0 if there
+// are none, and -1 if some were lost because too many were reported.
+int fw_failure( struct fw_failure* f );
 
 
 /* Higher level utility functions */
@@ -46,13 +121,53 @@ int fw_list( void (*callback)(struct sockaddr *addr, socklen_t addrlen, u_int32_
 // read a line from a file and remove the trailing newline
 ssize_t readline( char **line, size_t *size, FILE *f );
 
-// check if the given address matches one of our local interfaces
-int isLocal( struct sockaddr *sa );
+// check if the given address prefix of masklen bits contains one of our local interfaces
+int isLocal( struct sockaddr *sa, unsigned int masklen );
 
 // refresh list of local interface addresses
 void updateLocalInterfaces( );
 
-// Add the given host (DNS name or IP address) to firewall table.
+// Parse a numeric IPv4 or IPv6 address of len characters into a 16 byte
+// address key, with IPv4 addresses as IPv4-mapped IPv6 addresses.
+// Returns 0 if it is not a numeric address (e.g. a host name).
+int parseAddress( const char* host, size_t len, unsigned char addr[16] );
+
+// Parse a numeric address prefix "address/length" into an address key and its
+// prefix length within the key (see maskAddress).
+// Returns 0 if host is no prefix, 1 if it is, and -1 if it is an invalid one.
+int parsePrefix( const char* host, unsigned char addr[16], unsigned int* masklen );
+
+// Print an address key as numeric IPv4 or IPv6 address
+const char* formatAddress( const unsigned char addr[16], char* buf, size_t size );
+
+// Print an address key with a prefix length of masklen bits within the key as
+// "address/length", or only the address if masklen is 128
+const char* formatPrefix( const unsigned char addr[16], unsigned int masklen, char* buf, size_t size );
+
+// Clear all but the first prefix4 bits of an IPv4 or prefix6 bits of an IPv6
+// address key. Returns the prefix length within the address key (IPv4
+// addresses are preceded by 96 bits in the key).
+unsigned int maskAddress( unsigned char addr[16], unsigned int prefix4, unsigned int prefix6 );
+
+// Convert an IPv4 or IPv6 socket address to an address key.
+// Returns 0 if the address family is not supported.
+int sockaddrToKey( const struct sockaddr* sa, unsigned char addr[16] );
+
+// Convert an address key with a prefix length of masklen bits within the key
+// to a socket address and the prefix length used by the firewall (fw_add).
+// Returns non-zero if the address is not supported.
+int keyToSockaddr( const unsigned char addr[16], unsigned int masklen, struct sockaddr_storage* ss, socklen_t* sslen, u_int8_t* fwlen );
+
+// Add the given address key (see parseAddress) with a prefix length of masklen
+// bits within the key (see maskAddress) to firewall table without resolving it.
+// Otherwise the same as addHostLong.
+int addAddressLong( const unsigned char addr[16], unsigned int masklen, uint32_t value, uint32_t table, time_t rt, int bl );
+
+// Resolve a host name to at most max address keys (see parseAddress).
+// Returns the number of addresses, or -1 if it could not be resolved.
+int resolveHost( const char* host, unsigned char addrs[][16], unsigned int max );
+
+// Add the given host (DNS name, IP address, or numeric address/length prefix) to firewall table.
 // If rt>0 it specifies the number of seconds the host is blocked for, which is
 // used in the log messages.
 // If bl is non-zero, there is no check to prevent blocking local IPs
@@ -61,7 +176,10 @@ int addHostLong( const char* host, uint32_t value, uint32_t table, time_t rt, in
 // Add the given host (DNS name or IP address) to firewall table
 int addHost( const char* host, uint32_t value, uint32_t table );
 
-// Remove the given host (DNS name or IP address) from firewall table
+// Remove the given address key with a prefix length of masklen bits within the key from firewall table
+int removeAddress( const unsigned char addr[16], unsigned int masklen, uint32_t table );
+
+// Remove the given host (DNS name, IP address, or numeric address/length prefix) from firewall table
 int removeHost( const char* host, uint32_t table );
 
 // Log a message either to the console (if run interactively) or to syslog
@@ -5,12 +5,19 @@
    don't. */
 #define HAVE_DECL_GETLINE 1
 
+/* Define to 1 if you have the declaration of 'optreset', and to 0 if you
+   don't. */
+#define HAVE_DECL_OPTRESET 1
+
 /* Define to 1 if you have the <fcntl.h> header file. */
 #define HAVE_FCNTL_H 1
 
 /* Define to 1 if you have the 'getdelim' function. */
 /* #undef HAVE_GETDELIM */
 
+/* Define to 1 if you have the 'inotify_init1' function. */
+/* #undef HAVE_INOTIFY_INIT1 */
+
 /* Define to 1 if you have the <inttypes.h> header file. */
 #define HAVE_INTTYPES_H 1
 
@@ -20,12 +27,27 @@
 /* Define to 1 if you have IPFW_VTYPE_MARK */
 #define HAVE_IPFW_VTYPE_MARK 1
 
+/* Define to 1 if you have the 'kqueue' function. */
+#define HAVE_KQUEUE 1
+
 /* Define to 1 if you have the 'md' library (-lmd). */
 #define HAVE_LIBMD 1
 
 /* Define to 1 if you have PCRE2 installed */
 /* #undef HAVE_LIBPCRE2 */
 
+/* Define to 1 if you have the 'pthread' library (-lpthread). */
+#define HAVE_LIBPTHREAD 1
+
+/* Define to 1 if you have the 'util' library (-lutil). */
+#define HAVE_LIBUTIL 1
+
+/* Define to 1 if you have the <linux/netfilter/nf_tables.h> header file. */
+/* #undef HAVE_LINUX_NETFILTER_NF_TABLES_H */
+
+/* Define to 1 if you have the <linux/rtnetlink.h> header file. */
+/* #undef HAVE_LINUX_RTNETLINK_H */
+
 /* Define to 1 if your system has a GNU libc compatible 'malloc' function, and
    to 0 otherwise. */
 #define HAVE_MALLOC 1
@@ -42,9 +64,15 @@
 /* Define to 1 if you have the <net/if.h> header file. */
 #define HAVE_NET_IF_H 1
 
+/* Define to 1 if you have the <net/route.h> header file. */
+#define HAVE_NET_ROUTE_H 1
+
 /* Define to 1 if you have the 'random' function. */
 #define HAVE_RANDOM 1
 
+/* Define to 1 if you have the 'recvmmsg' function. */
+#define HAVE_RECVMMSG 1
+
 /* Define to 1 if you have the 'regcomp' function. */
 #define HAVE_REGCOMP 1
 
@@ -0,0 +1,65 @@
+/*
+ Copyright 2013-2025 Alexander Wittig. All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Firewall backends behind the low level firewall functions of banlib */
+
+// struct fw_entry is declared in banlib.h
+
+// Operations of a firewall backend (see the fw_* functions in banlib.h)
+struct fw_backend {
+    const char* name;           // Name the backend is selected by
+    int privileged;             // Backend needs to be run as root
+    int expiring;               // Backend removes expired entries itself
+    int nesting;                // Backend can hold a prefix and entries within it at once
+    // Initialize the backend with its options (text following "name:", or NULL)
+    int (*init)( const char* options );
+    int (*close)( );
+    int (*add)( struct sockaddr* addr, socklen_t addrlen, u_int8_t masklen, u_int32_t value, u_int16_t table );
+    int (*del)( struct sockaddr* addr, socklen_t addrlen, u_int8_t masklen, u_int16_t table );
+    // Add n entries to a table with one command, setting the result of each.
+    // Returns non-zero if the command failed as a whole. Only called from the
+    // writer thread. May be NULL if the backend adds entries one by one.
+    int (*add_batch)( struct fw_entry* entries, unsigned int n, u_int16_t table );
+    // Remove n entries from a table with one command, the same way. Never
+    // called while the writer thread runs. May be NULL.
+    int (*del_batch)( struct fw_entry* entries, unsigned int n, u_int16_t table );
+    int (*list)( void (*callback)(struct sockaddr*, socklen_t, u_int8_t, u_int32_t, u_int16_t), u_int16_t table );
+    // May be NULL if not supported
+    int (*info)( u_int16_t table, unsigned long* count, unsigned long* generation );
+    int (*find)( struct sockaddr* addr, socklen_t addrlen, u_int8_t masklen, u_int16_t table, u_int32_t* value );
+};
+
+// IPFW tables via the IPFW3 socket option interface (ipfw.c)
+#ifdef HAVE_IPFW3
+extern const struct fw_backend fw_ipfw;
+#endif
+
+// Linux nftables sets via netlink (nftables.c)
+#ifdef HAVE_LINUX_NETFILTER_NF_TABLES_H
+extern const struct fw_backend fw_nft;
+#endif
+
+// In-memory simulation of IPFW tables (fwsim.c)
+extern const struct fw_backend fw_sim;
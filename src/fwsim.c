@@ -0,0 +1,537 @@
+/*
+ Copyright 2013-2025 Alexander Wittig. All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <config.h>
+
+#define _WITH_GETLINE
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/file.h>
+#include <netinet/in.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+#include "banlib.h"
+#include "firewall.h"
+
+/*
+ In-memory simulation of the IPFW address tables used by banhammer, so the
+ programs can run without IPFW. Tables are created by the first addition like
+ numbered IPFW tables. Adding an existing prefix updates its value, listing
+ returns IPv4 before IPv6 prefixes in address order like the radix tables,
+ and deleting a missing prefix fails. Values are kept as 32 bit numbers.
+
+ Options (comma separated after "sim:"):
+    latency=usec    every command takes this many microseconds
+    errors=percent  this percentage of commands fails as a whole (EIO)
+    file=path       keep the tables in a file shared by all processes using it
+                    (re-read and locked for every command)
+*/
+
+// Simulated table entry
+struct sim_entry {
+    unsigned char addr[16];     // Address key of the prefix (see parseAddress)
+    unsigned int masklen;       // Prefix length within the address key
+    u_int32_t value;            // Value stored with it
+};
+
+// Simulated table with its entries in listing order
+struct sim_table {
+    u_int16_t table;            // Table number
+    struct sim_entry* entries;  // Entries
+    unsigned int count;         // Number of entries
+    unsigned int size;          // Room for entries
+};
+
+static struct sim_table* simTables = NULL;  // all tables created so far
+static unsigned int simCount = 0;       // number of tables
+static unsigned int simLatency = 0;     // microseconds every command takes
+static unsigned int simErrors = 0;      // percentage of commands failing
+static char* simFile = NULL;            // file holding the tables (NULL if only in memory)
+static FILE* simFp = NULL;              // the locked file while executing a command
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t simLock = PTHREAD_MUTEX_INITIALIZER;   // protects the tables (the writer thread adds while the main thread deletes)
+#define SIM_LOCK pthread_mutex_lock( &simLock )
+#define SIM_UNLOCK pthread_mutex_unlock( &simLock )
+#else
+#define SIM_LOCK
+#define SIM_UNLOCK
+#endif
+
+// Prefix of IPv4 addresses in address keys (IPv4-mapped IPv6 addresses)
+static const unsigned char ipv4_mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+// Compare an entry to an address key prefix in listing order
+static int sim_compare( const struct sim_entry* e, const unsigned char addr[16], unsigned int masklen )
+{
+    int v4e = !memcmp( e->addr, ipv4_mapped, 12 ), v4 = !memcmp( addr, ipv4_mapped, 12 );
+    int rc;
+
+    if( v4e != v4 )
+        return v4 - v4e;
+    if( (rc = memcmp( e->addr, addr, 16 )) )
+        return rc;
+    return (int)e->masklen - (int)masklen;
+}
+
+// Find the position of an address key prefix in a table.
+// Returns non-zero if it is there, otherwise pos is where it belongs.
+static int sim_find( const struct sim_table* t, const unsigned char addr[16], unsigned int masklen, unsigned int* pos )
+{
+    unsigned int lo = 0, hi = t->count, mid;
+    int rc;
+
+    while( lo < hi )
+    {
+        mid = (lo + hi)/2;
+        rc = sim_compare( &t->entries[mid], addr, masklen );
+        if( rc == 0 )
+        {
+            *pos = mid;
+            return 1;
+        }
+        if( rc < 0 )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *pos = lo;
+    return 0;
+}
+
+// Get a table, creating it if requested. Returns NULL if there is no such table.
+static struct sim_table* sim_table( u_int16_t table, int create )
+{
+    struct sim_table* t;
+    unsigned int i;
+
+    for( i = 0; i < simCount; i++ )
+        if( simTables[i].table == table )
+            return &simTables[i];
+    if( !create )
+        return NULL;
+
+    if( !(t = (struct sim_table*) realloc( simTables, (simCount + 1)*sizeof(struct sim_table) )) )
+        return NULL;
+    simTables = t;
+    t = &simTables[simCount++];
+    t->table = table;
+    t->entries = NULL;
+    t->count = t->size = 0;
+    return t;
+}
+
+// Add or update an address key prefix in a table.
+// Returns 0 if it was added, 2 if it was updated, and 1 if out of memory.
+static int sim_insert( struct sim_table* t, const unsigned char addr[16], unsigned int masklen, u_int32_t value )
+{
+    struct sim_entry* e;
+    unsigned int pos;
+
+    if( sim_find( t, addr, masklen, &pos ) )
+    {
+        t->entries[pos].value = value;
+        return 2;
+    }
+
+    if( t->count == t->size )
+    {
+        if( !(e = (struct sim_entry*) realloc( t->entries, (t->size ? 2*t->size : 64)*sizeof(struct sim_entry) )) )
+            return 1;
+        t->entries = e;
+        t->size = t->size ? 2*t->size : 64;
+    }
+    memmove( &t->entries[pos + 1], &t->entries[pos], (t->count - pos)*sizeof(struct sim_entry) );
+    memcpy( t->entries[pos].addr, addr, 16 );
+    t->entries[pos].masklen = masklen;
+    t->entries[pos].value = value;
+    t->count++;
+
+    return 0;
+}
+
+// Convert an address prefix to an address key prefix as IPFW stores it (host bits cleared).
+// Returns non-zero if the address is not supported.
+static int sim_key( struct sockaddr* addr, socklen_t addrlen, u_int8_t masklen, unsigned char key[16], unsigned int* keylen )
+{
+    if( !sockaddrToKey( addr, key ) )
+        return 1;
+    if( addr->sa_family == AF_INET )
+    {
+        if( (addrlen < sizeof(struct sockaddr_in)) || (masklen > 32) )
+            return 1;
+    }
+    else if( (addrlen < sizeof(struct sockaddr_in6)) || (masklen > 128) )
+        return 1;
+
+    *keylen = maskAddress( key, masklen, masklen );
+    return 0;
+}
+
+// Read the tables from the locked file
+static int sim_load( )
+{
+    char *line = NULL, *c, *p;
+    size_t size = 0;
+    unsigned char addr[16];
+    unsigned int i, masklen;
+    struct sim_table* t;
+    unsigned long table, value;
+    int fd, prefix, rc = 0;
+
+    if( (fd = open( simFile, O_RDWR | O_CREAT, 0600 )) < 0 )
+        return -1;
+    if( flock( fd, LOCK_EX ) || !(simFp = fdopen( fd, "r+" )) )
+    {
+        close( fd );
+        return -1;
+    }
+
+    for( i = 0; i < simCount; i++ )
+        simTables[i].count = 0;
+
+    // every line holds a table and optionally one of its prefixes and value
+    while( readline( &line, &size, simFp ) > 0 )
+    {
+        c = line;
+        table = strtoul( strsep( &c, " " ), NULL, 10 );
+        if( !(t = sim_table( table, 1 )) )
+        {
+            rc = -1;
+            break;
+        }
+        if( !(p = strsep( &c, " " )) || !c )
+            continue;
+        value = strtoul( c, NULL, 10 );
+        if( (prefix = parsePrefix( p, addr, &masklen )) == 0 && parseAddress( p, strlen( p ), addr ) )
+            masklen = 128;
+        else if( prefix != 1 )
+            continue;
+        if( sim_insert( t, addr, masklen, value ) == 1 )
+        {
+            rc = -1;
+            break;
+        }
+    }
+    free( line );
+
+    return rc;
+}
+
+// Write the tables back to the locked file
+static void sim_save( )
+{
+    char buf[INET6_ADDRSTRLEN + 4];
+    unsigned int i, j;
+
+    rewind( simFp );
+    if( ftruncate( fileno( simFp ), 0 ) )
+        return;
+    for( i = 0; i < simCount; i++ )
+    {
+        if( simTables[i].count == 0 )
+            fprintf( simFp, "%hu\n", simTables[i].table );
+        for( j = 0; j < simTables[i].count; j++ )
+            fprintf( simFp, "%hu %s %u\n", simTables[i].table,
+                     formatPrefix( simTables[i].entries[j].addr, simTables[i].entries[j].masklen, buf, sizeof(buf) ),
+                     simTables[i].entries[j].value );
+    }
+    fflush( simFp );
+}
+
+// Start a command: wait for its latency, lock the tables and decide if it fails.
+// Returns non-zero if the command fails.
+static int sim_begin( )
+{
+    if( simLatency )
+        usleep( simLatency );
+
+    SIM_LOCK;
+    if( simErrors && (unsigned int)(random( ) % 100) < simErrors )
+    {
+        SIM_UNLOCK;
+        errno = EIO;
+        return -1;
+    }
+    if( simFile && sim_load( ) )
+    {
+        if( simFp )
+            fclose( simFp );
+        simFp = NULL;
+        SIM_UNLOCK;
+        errno = EIO;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Finish a command, writing the tables back to the file if they were modified
+static void sim_end( int modified )
+{
+    if( simFp )
+    {
+        if( modified )
+            sim_save( );
+        fclose( simFp );        // also releases the lock
+        simFp = NULL;
+    }
+    SIM_UNLOCK;
+}
+
+// Initialize the simulation with its options
+static int sim_init( const char* options )
+{
+    char *opts, *c, *o, *v;
+    int rc = 0;
+
+    if( !options )
+        return 0;
+    if( !(opts = strdup( options )) )
+        return 1;
+
+    c = opts;
+    while( (o = strsep( &c, "," )) )
+    {
+        if( !*o )
+            continue;
+        if( (v = strchr( o, '=' )) )
+            *v++ = '\0';
+        if( !v || !*v )
+            rc = 2;
+        else if( !strcmp( o, "latency" ) )
+            simLatency = strtoul( v, NULL, 10 );
+        else if( !strcmp( o, "errors" ) )
+        {
+            simErrors = strtoul( v, NULL, 10 );
+            if( simErrors > 100 )
+                rc = 2;
+        }
+        else if( !strcmp( o, "file" ) )
+        {
+            free( simFile );
+            if( !(simFile = strdup( v )) )
+                rc = 1;
+        }
+        else
+            rc = 2;
+    }
+    free( opts );
+
+    return rc;
+}
+
+// Drop all tables
+static int sim_close( )
+{
+    unsigned int i;
+
+    for( i = 0; i < simCount; i++ )
+        free( simTables[i].entries );
+    free( simTables );
+    free( simFile );
+    simTables = NULL;
+    simCount = 0;
+    simFile = NULL;
+    return 0;
+}
+
+// store an IP address prefix and associated value, updating the value of an existing one
+static int sim_add( struct sockaddr* addr, socklen_t addrlen, u_int8_t masklen, u_int32_t value, u_int16_t table )
+{
+    unsigned char key[16];
+    unsigned int keylen;
+    struct sim_table* t;
+    int rc;
+
+    if( sim_key( addr, addrlen, masklen, key, &keylen ) )
+        return 1;
+    if( sim_begin( ) )
+        return 1;
+    rc = (t = sim_table( table, 1 )) ? sim_insert( t, key, keylen, value ) : 1;
+    sim_end( rc != 1 );
+
+    // an update is no error for a single addition (IPFW_TF_UPDATE)
+    return rc == 2 ? 0 : rc;
+}
+
+// remove an IP address prefix, error if not found
+static int sim_del( struct sockaddr* addr, socklen_t addrlen, u_int8_t masklen, u_int16_t table )
+{
+    unsigned char key[16];
+    unsigned int keylen, pos;
+    struct sim_table* t;
+
+    if( sim_key( addr, addrlen, masklen, key, &keylen ) )
+        return 1;
+    if( sim_begin( ) )
+        return 1;
+    if( !(t = sim_table( table, 0 )) || !sim_find( t, key, keylen, &pos ) )
+    {
+        sim_end( 0 );
+        errno = ESRCH;
+        return 1;
+    }
+    t->count--;
+    memmove( &t->entries[pos], &t->entries[pos + 1], (t->count - pos)*sizeof(struct sim_entry) );
+    sim_end( 1 );
+
+    return 0;
+}
+
+// Add n entries with one command, reporting updated ones as already existing
+// like the per-entry results of IPFW
+static int sim_add_batch( struct fw_entry* entries, unsigned int n, u_int16_t table )
+{
+    unsigned char key[16];
+    unsigned int i, keylen;
+    struct sim_table* t;
+
+    if( sim_begin( ) )
+        return -1;
+    if( !(t = sim_table( table, 1 )) )
+    {
+        sim_end( 0 );
+        return -1;
+    }
+    for( i = 0; i < n; i++ )
+        entries[i].result = sim_key( entries[i].addr, entries[i].addrlen, entries[i].masklen, key, &keylen ) ?
+                            1 : sim_insert( t, key, keylen, entries[i].value );
+    sim_end( 1 );
+
+    return 0;
+}
+
+// Remove n entries with one command, missing ones fail like with IPFW
+static int sim_del_batch( struct fw_entry* entries, unsigned int n, u_int16_t table )
+{
+    unsigned char key[16];
+    unsigned int i, keylen, pos;
+    struct sim_table* t;
+
+    if( sim_begin( ) )
+        return -1;
+    t = sim_table( table, 0 );
+    for( i = 0; i < n; i++ )
+    {
+        entries[i].result = 1;
+        if( !t || sim_key( entries[i].addr, entries[i].addrlen, entries[i].masklen, key, &keylen ) || !sim_find( t, key, keylen, &pos ) )
+            continue;
+        t->count--;
+        memmove( &t->entries[pos], &t->entries[pos + 1], (t->count - pos)*sizeof(struct sim_entry) );
+        entries[i].result = 0;
+    }
+    sim_end( 1 );
+
+    return 0;
+}
+
+// Call a callback function with a copy of every entry of a table
+static int sim_list( void (*callback)(struct sockaddr*, socklen_t, u_int8_t, u_int32_t, u_int16_t), u_int16_t table )
+{
+    struct sim_entry* copy = NULL;
+    struct sim_table* t;
+    struct sockaddr_storage ss;
+    socklen_t sslen;
+    u_int8_t fwlen;
+    unsigned int i, n;
+
+    if( sim_begin( ) )
+        return 1;
+    if( !(t = sim_table( table, 0 )) )
+    {
+        sim_end( 0 );
+        return 1;
+    }
+    n = t->count;
+    if( n && !(copy = (struct sim_entry*) malloc( n*sizeof(struct sim_entry) )) )
+    {
+        sim_end( 0 );
+        return 1;
+    }
+    if( n )
+        memcpy( copy, t->entries, n*sizeof(struct sim_entry) );
+    sim_end( 0 );
+
+    // the callback may alter the table
+    for( i = 0; i < n; i++ )
+        if( !keyToSockaddr( copy[i].addr, copy[i].masklen, &ss, &sslen, &fwlen ) )
+            (*callback)( (struct sockaddr*)&ss, sslen, fwlen, copy[i].value, table );
+    free( copy );
+
+    return 0;
+}
+
+// Get the number of entries in a table, there is no generation count like in IPFW
+static int sim_info( u_int16_t table, unsigned long* count, unsigned long* generation )
+{
+    struct sim_table* t;
+
+    if( sim_begin( ) )
+        return 1;
+    if( (t = sim_table( table, 0 )) )
+    {
+        *count = t->count;
+        *generation = 0;
+    }
+    sim_end( 0 );
+
+    return t ? 0 : 1;
+}
+
+// Look up the value of an IP address prefix in a table
+static int sim_lookup( struct sockaddr* addr, socklen_t addrlen, u_int8_t masklen, u_int16_t table, u_int32_t* value )
+{
+    unsigned char key[16];
+    unsigned int keylen, pos;
+    struct sim_table* t;
+    int rc = 1;
+
+    if( sim_key( addr, addrlen, masklen, key, &keylen ) )
+        return 1;
+    if( sim_begin( ) )
+        return -1;
+    if( (t = sim_table( table, 0 )) && sim_find( t, key, keylen, &pos ) )
+    {
+        *value = t->entries[pos].value;
+        rc = 0;
+    }
+    sim_end( 0 );
+
+    return rc;
+}
+
+const struct fw_backend fw_sim = {
+    "sim", 0, 0, 1,
+    sim_init, sim_close, sim_add, sim_del, sim_add_batch, sim_del_batch, sim_list, sim_info, sim_lookup
+};
@@ -0,0 +1,454 @@
+/*
+ Copyright 2013-2025 Alexander Wittig. All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <config.h>
+
+#ifdef HAVE_IPFW3
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <net/if.h>
+#include <netinet/ip_fw.h>
+
+#include "banlib.h"
+#include "firewall.h"
+
+static int ipfw_socket = -1;            // the socket to the IPFW firewall
+static ipfw_obj_header* batchCmd = NULL;    // IPFW command buffer for batches (reused)
+static unsigned int batchSize = 0;      // room for entries in the batch command
+static ipfw_obj_header* listBuf = NULL; // IPFW table listing buffer (reused)
+static socklen_t listSize = 0;          // size of the listing buffer
+
+// Local constants
+static const int BANLIB_DEL = 0;
+static const int BANLIB_ADD = 1;
+
+// local forward declaration
+static int fw_table_cmd( int opcode, struct sockaddr* addr, socklen_t addrlen, u_int8_t masklen, u_int32_t value, u_int16_t table );
+
+// Inititalize the connection to the firewall. There are no options.
+static int ipfw_init( const char* options )
+{
+    if ( ipfw_socket == -1 )
+    {
+        if ( (ipfw_socket = socket( AF_INET, SOCK_RAW, IPPROTO_RAW )) < 0 )
+            return 1;
+    }
+    else
+        return 2;
+
+    return 0;
+}
+
+// Clean up after yourself, the program is about to quit
+static int ipfw_close( )
+{
+    if ( ipfw_socket != -1 )
+        close( ipfw_socket );
+    ipfw_socket = -1;
+    free( batchCmd );
+    batchCmd = NULL;
+    batchSize = 0;
+    free( listBuf );
+    listBuf = NULL;
+    listSize = 0;
+    return 0;
+}
+
+// store an IP address prefix and associated value in the given firewall table, ignore duplicates
+static int ipfw_add( struct sockaddr* addr, socklen_t addrlen, u_int8_t masklen, u_int32_t value, u_int16_t table )
+{
+    int rc;
+
+    rc = fw_table_cmd( BANLIB_ADD, addr, addrlen, masklen, value, table );
+    return rc == 0 ? 0 : (errno == EEXIST ? 2 : 1);
+}
+
+// remove a given IP address prefix from the given firewall table, error if not found
+static int ipfw_del( struct sockaddr* addr, socklen_t addrlen, u_int8_t masklen, u_int16_t table )
+{
+    int rc;
+
+    rc = fw_table_cmd( BANLIB_DEL, addr, addrlen, masklen, 0, table );
+    return rc == 0 ? 0 : 1;
+}
+
+// Handle different table types (mark available since FBSD 14)
+#ifdef HAVE_IPFW_VTYPE_MARK
+#define VTYPE (IPFW_VTYPE_MARK | IPFW_VTYPE_TAG)
+#define VALUE(v, vt) (((vt) & IPFW_VTYPE_MARK) ? ((v).value.mark) : ((v).value.tag))
+#else
+#define VTYPE IPFW_VTYPE_TAG
+#define VALUE(v, vt) ((v).value.tag)
+#endif
+
+// fill in the header of an IPFW command naming a table (zeroed before)
+static void fw_table_name( ipfw_obj_header* oh, int opcode, u_int16_t table )
+{
+    oh->opheader.opcode = opcode;
+    oh->opheader.version = 1;
+    oh->ntlv.head.type = IPFW_TLV_TBL_NAME;
+    oh->ntlv.head.length = sizeof(ipfw_obj_ntlv);
+    oh->ntlv.idx = 1;
+	oh->ntlv.set = 0;
+    snprintf( oh->ntlv.name, sizeof(oh->ntlv.name), "%hu", table );
+    oh->idx = 1;
+}
+
+// fill in the header of an IPFW table command for table, followed by count
+// table entries (the command has to be zeroed before)
+static socklen_t fw_table_header( ipfw_obj_header* oh, int opcode, u_int16_t table, unsigned int count )
+{
+	ipfw_obj_ctlv *ctlv;
+
+    oh->opheader.opcode = (opcode == BANLIB_ADD) ? IP_FW_TABLE_XADD : IP_FW_TABLE_XDEL;
+    oh->opheader.version = 1;
+    oh->ntlv.head.type = IPFW_TLV_TBL_NAME;
+    oh->ntlv.head.length = sizeof(ipfw_obj_ntlv);
+    oh->ntlv.idx = 1;
+	oh->ntlv.set = 0;
+    oh->ntlv.type = IPFW_TABLE_ADDR;
+    snprintf( oh->ntlv.name, sizeof(oh->ntlv.name), "%hu", table );
+    oh->idx = 1;
+
+    ctlv = (ipfw_obj_ctlv*)(oh + 1);
+    ctlv->count = count;
+    ctlv->head.length = sizeof(*ctlv) + count*sizeof(ipfw_obj_tentry);
+    //ctlv->flags |= IPFW_CTF_ATOMIC;
+
+    return sizeof(ipfw_obj_header) + ctlv->head.length;
+}
+
+// fill in a zeroed IPFW table entry for an IP address prefix.
+// Returns non-zero if the address is not supported.
+static int fw_table_entry( ipfw_obj_tentry* tent, int opcode, struct sockaddr* addr, socklen_t addrlen, u_int8_t masklen, u_int32_t value )
+{
+    tent->head.length = sizeof(ipfw_obj_tentry);
+    tent->head.flags |= (opcode == BANLIB_ADD) ? IPFW_TF_UPDATE : 0;
+    tent->idx = 1;
+    // set all other values in case this is a legacy table (masked out again by IPFW)
+    tent->v.value.tag = value;
+    tent->v.value.pipe = value;
+    tent->v.value.divert = value;
+    tent->v.value.skipto = value;
+    tent->v.value.netgraph = value;
+    tent->v.value.fib = value;
+    tent->v.value.nat = value;
+    tent->v.value.nh4 = value;
+    tent->v.value.dscp = (uint8_t)value;
+    tent->v.value.limit = value;
+#ifdef HAVE_IPFW_VTYPE_MARK
+    tent->v.value.mark = value;
+#endif
+
+    switch( addr->sa_family )
+    {
+        case AF_INET:
+            if( (addrlen < sizeof(struct in_addr)) || (masklen > 32) )
+                return 1;
+            tent->subtype = AF_INET;
+            tent->masklen = masklen;
+            tent->k.addr = ((struct sockaddr_in*)addr)->sin_addr;
+            return 0;
+
+#ifdef WITH_IPV6
+        case AF_INET6:
+            if( (addrlen < sizeof(struct in6_addr)) || (masklen > 128) )
+                return 1;
+            tent->subtype = AF_INET6;
+            tent->masklen = masklen;
+            tent->k.addr6 = ((struct sockaddr_in6*)addr)->sin6_addr;
+            return 0;
+#endif
+
+        default:
+            return 1;
+    }
+}
+
+// internal helper to execute an IPFW table command.
+// Opcode is BANLIB_ADD or BANLIB_DEL, masklen the prefix length of the address.
+static int fw_table_cmd( int opcode, struct sockaddr* addr, socklen_t addrlen, u_int8_t masklen, u_int32_t value, u_int16_t table )
+{
+    ipfw_obj_header *oh;
+    socklen_t l;
+    int rc;
+
+    if( ipfw_socket == -1 )
+        return -1;
+
+    // prepare IPFW3 command
+    l = sizeof(ipfw_obj_header) + sizeof(ipfw_obj_ctlv) + sizeof(ipfw_obj_tentry);
+    oh = (ipfw_obj_header*)calloc( 1, l );
+    if( !oh ) return -1;
+    fw_table_header( oh, opcode, table, 1 );
+    if( fw_table_entry( (ipfw_obj_tentry*)((ipfw_obj_ctlv*)(oh + 1) + 1), opcode, addr, addrlen, masklen, value ) )
+    {
+        free( oh );
+        return 1;
+    }
+
+    rc = setsockopt( ipfw_socket, IPPROTO_IP, IP_FW3, &(oh->opheader), l );
+    free( oh );
+    return rc;
+}
+
+// make the listing buffer at least l bytes large, keeping its contents.
+// It only grows, so listing a table again needs no allocations.
+static int fw_list_buffer( socklen_t l )
+{
+    ipfw_obj_header *oh;
+
+    if( l <= listSize )
+        return 0;
+    if( !(oh = (ipfw_obj_header*) realloc( listBuf, l )) )
+        return 1;
+    listBuf = oh;
+    listSize = l;
+    return 0;
+}
+
+// Get all IP addresses and associated values in given table and call
+// a callback function with each of them.
+// Note: The callback may alter the state of the table. This function
+// always reflects the unaltered state of the table for all callbacks.
+static int ipfw_list( void (*callback)(struct sockaddr*, socklen_t, u_int8_t, u_int32_t, u_int16_t), u_int16_t table )
+{
+    ipfw_obj_header *oh;
+    ipfw_xtable_info *ti;
+	ipfw_obj_tentry *tent;
+    socklen_t l;
+    struct sockaddr_in sa4 = { 0 };
+#ifdef WITH_IPV6
+    struct sockaddr_in6 sa6 = { 0 };
+#endif
+
+    if( ipfw_socket == -1 )
+        return -1;
+
+    // obtain table info
+    l = sizeof(ipfw_obj_header) + sizeof(ipfw_xtable_info);
+    if( fw_list_buffer( l ) )
+        return 1;
+    oh = listBuf;
+    memset( oh, 0, l );
+    fw_table_name( oh, IP_FW_TABLE_XINFO, table );
+    if( getsockopt( ipfw_socket, IPPROTO_IP, IP_FW3, &(oh->opheader), &l ) < 0 )
+        return 1;
+    ti = (ipfw_xtable_info*)(oh + 1);
+    if( ti->type != IPFW_TABLE_ADDR || (ti->vmask & VTYPE) == 0 )     // also accepts VTYPE_LEGACY
+        return 1;
+    if( ti->count == 0 )
+        return 0;
+
+    // obtain table entries
+    l = sizeof(ipfw_obj_header) + sizeof(ipfw_xtable_info) + ti->size;
+    if( fw_list_buffer( l ) )
+        return 1;
+    oh = listBuf;
+    oh->opheader.opcode = IP_FW_TABLE_XLIST;
+    if( getsockopt( ipfw_socket, IPPROTO_IP, IP_FW3, oh, &l ) < 0 )
+        return 1;
+
+    // call the callback for each address in table
+    ti = (ipfw_xtable_info*)(oh + 1);
+    tent = (ipfw_obj_tentry*)(ti + 1);
+    sa4.sin_family = AF_INET;
+#ifdef WITH_IPV6
+    sa6.sin6_family = AF_INET6;
+#endif
+    for( l = 0; l < ti->count; l++ )
+    {
+        if( tent->subtype == AF_INET )
+        {
+            sa4.sin_addr = tent->k.addr;
+            (*callback)( (struct sockaddr*)&sa4, sizeof(sa4), tent->masklen, VALUE(tent->v, ti->vmask), table );
+        }
+#ifdef WITH_IPV6
+        else if( tent->subtype == AF_INET6 )
+        {
+            sa6.sin6_addr = tent->k.addr6;
+            (*callback)( (struct sockaddr*)&sa6, sizeof(sa6), tent->masklen, VALUE(tent->v, ti->vmask), table );
+        }
+#endif
+        tent = (ipfw_obj_tentry*)((caddr_t)tent + tent->head.length);
+    }
+
+    return 0;
+}
+
+// Add or remove n entries of a table with one IPFW command and read back the
+// result of every entry. Unsupported addresses are left out of the command.
+static int fw_table_batch( int opcode, struct fw_entry* entries, unsigned int n, u_int16_t table )
+{
+    ipfw_obj_tentry *tent;
+    ipfw_obj_header *oh;
+    unsigned int i, k = 0;
+    socklen_t l;
+
+    if( ipfw_socket == -1 )
+        return -1;
+
+    // the command buffer grows to the largest batch seen
+    if( n > batchSize )
+    {
+        if( !(oh = (ipfw_obj_header*) realloc( batchCmd, sizeof(ipfw_obj_header) + sizeof(ipfw_obj_ctlv) + n*sizeof(ipfw_obj_tentry) )) )
+            return -1;
+        batchCmd = oh;
+        batchSize = n;
+    }
+
+    tent = (ipfw_obj_tentry*)((ipfw_obj_ctlv*)(batchCmd + 1) + 1);
+    memset( batchCmd, 0, sizeof(ipfw_obj_header) + sizeof(ipfw_obj_ctlv) + n*sizeof(ipfw_obj_tentry) );
+    for( i = 0; i < n; i++ )
+    {
+        entries[i].result = fw_table_entry( &tent[k], opcode, entries[i].addr, entries[i].addrlen, entries[i].masklen, entries[i].value ) ? 1 : -1;
+        if( entries[i].result == -1 )
+            k++;
+    }
+    if( !k )
+        return 0;
+    l = fw_table_header( batchCmd, opcode, table, k );
+
+    // reading the command back returns the result of every entry
+    if( getsockopt( ipfw_socket, IPPROTO_IP, IP_FW3, &(batchCmd->opheader), &l ) < 0 )
+        return -1;
+
+    for( i = 0, k = 0; i < n; i++ )
+    {
+        if( entries[i].result != -1 )
+            continue;
+        switch( tent[k++].result )
+        {
+            case IPFW_TR_ADDED:
+            case IPFW_TR_DELETED:
+                entries[i].result = 0;
+                break;
+            case IPFW_TR_UPDATED:
+            case IPFW_TR_EXISTS:
+                entries[i].result = 2;
+                break;
+            default:
+                entries[i].result = 1;
+        }
+    }
+
+    return 0;
+}
+
+// Add n entries to a table with one IPFW command
+static int ipfw_add_batch( struct fw_entry* entries, unsigned int n, u_int16_t table )
+{
+    return fw_table_batch( BANLIB_ADD, entries, n, table );
+}
+
+// Remove n entries from a table with one IPFW command
+static int ipfw_del_batch( struct fw_entry* entries, unsigned int n, u_int16_t table )
+{
+    return fw_table_batch( BANLIB_DEL, entries, n, table );
+}
+
+// Get the number of entries in a table. IPFW has no generation count.
+static int ipfw_info( u_int16_t table, unsigned long* count, unsigned long* generation )
+{
+    ipfw_obj_header *oh;
+    socklen_t l;
+
+    if( ipfw_socket == -1 )
+        return -1;
+
+    l = sizeof(ipfw_obj_header) + sizeof(ipfw_xtable_info);
+    if( (oh = (ipfw_obj_header*)calloc( 1, l )) == NULL )
+        return 1;
+    fw_table_name( oh, IP_FW_TABLE_XINFO, table );
+    if( getsockopt( ipfw_socket, IPPROTO_IP, IP_FW3, &(oh->opheader), &l ) < 0 )
+    {
+        free( oh );
+        return 1;
+    }
+    *count = ((ipfw_xtable_info*)(oh + 1))->count;
+    *generation = 0;
+
+    free( oh );
+    return 0;
+}
+
+// Look up the value of an IP address prefix in a table.
+// Returns 0 if found, 1 if it is not in the table, and -1 if that cannot be
+// told (the lookup finds the most specific prefix containing the address).
+static int ipfw_find( struct sockaddr* addr, socklen_t addrlen, u_int8_t masklen, u_int16_t table, u_int32_t* value )
+{
+    ipfw_obj_header *oh;
+    ipfw_obj_tentry *tent;
+    socklen_t l;
+    int rc;
+
+    if( ipfw_socket == -1 )
+        return -1;
+
+    l = sizeof(ipfw_obj_header) + sizeof(ipfw_obj_tentry);
+    if( (oh = (ipfw_obj_header*)calloc( 1, l )) == NULL )
+        return -1;
+    fw_table_name( oh, IP_FW_TABLE_XFIND, table );
+    oh->ntlv.type = IPFW_TABLE_ADDR;
+    tent = (ipfw_obj_tentry*)(oh + 1);
+    if( fw_table_entry( tent, BANLIB_DEL, addr, addrlen, masklen, 0 ) )
+    {
+        free( oh );
+        return -1;
+    }
+
+    if( getsockopt( ipfw_socket, IPPROTO_IP, IP_FW3, &(oh->opheader), &l ) < 0 )
+        rc = (errno == ENOENT || errno == ESRCH) ? 1 : -1;
+    else if( tent->masklen > masklen )
+        rc = -1;
+    else if( tent->masklen < masklen )
+        rc = 1;
+    else
+    {
+        // only the value types of the table are set
+        *value = tent->v.value.tag;
+#ifdef HAVE_IPFW_VTYPE_MARK
+        if( *value == 0 )
+            *value = tent->v.value.mark;
+#endif
+        rc = 0;
+    }
+
+    free( oh );
+    return rc;
+}
+
+const struct fw_backend fw_ipfw = {
+    "ipfw", 1, 0, 1,
+    ipfw_init, ipfw_close, ipfw_add, ipfw_del, ipfw_add_batch, ipfw_del_batch, ipfw_list, ipfw_info, ipfw_find
+};
+#endif
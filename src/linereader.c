@@ -0,0 +1,279 @@
+/*
+ Copyright 2013-2025 Alexander Wittig. All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <poll.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "linereader.h"
+
+// Amount of input requested from the kernel with each read(2)
+static const size_t LR_BLOCK = 64*1024;
+
+// buffered input
+struct linereader {
+    int fd;                     // File descriptor to read from
+    char* buf;                  // Input buffer
+    size_t size;                // Size of the buffer
+    size_t start;               // Start of the unprocessed input in the buffer
+    size_t end;                 // End of the input in the buffer
+    size_t scanned;             // Length of the partial line at start known not to contain a newline
+    size_t maxline;             // Maximum line length, longer lines are cut off
+    int skip;                   // Discarding the rest of a line that was cut off
+    int eof;                    // End of input was reached
+    int finish;                 // Hand out a partial line at the end once (see lr_finish)
+    int follow;                 // End of input is only temporary (growing file)
+    off_t base;                 // Input offset of the start of the buffer
+    unsigned long truncated;    // Statistics: lines cut off
+};
+
+// Find the next newline in buf[from,to). Returns to if there is none.
+// Most lines are short, so this compares 16 characters at a time where the
+// CPU allows it instead of calling into the library for every line.
+static size_t lr_newline( const char* buf, size_t from, size_t to )
+{
+    const char* p;
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8( '\n' );
+    int mask;
+
+    for( ; from + 16 <= to; from += 16 )
+    {
+        mask = _mm_movemask_epi8( _mm_cmpeq_epi8( _mm_loadu_si128( (const __m128i*)&buf[from] ), nl ) );
+        if( mask )
+            return from + ffs( mask ) - 1;
+    }
+#endif
+
+    // remainder (or everything) is left to the C library
+    p = memchr( &buf[from], '\n', to - from );
+    return p ? (size_t)(p - buf) : to;
+}
+
+struct linereader* lr_create( int fd, size_t maxline )
+{
+    struct linereader* lr;
+
+    lr = (struct linereader*) calloc( 1, sizeof(struct linereader) );
+    if( !lr )
+        return NULL;
+
+    lr->fd = fd;
+    if( lr_limit( lr, maxline ) )
+    {
+        free( lr );
+        return NULL;
+    }
+
+    return lr;
+}
+
+void lr_free( struct linereader* lr )
+{
+    if( !lr ) return;
+    free( lr->buf );
+    free( lr );
+}
+
+int lr_limit( struct linereader* lr, size_t maxline )
+{
+    size_t size;
+    char* buf;
+
+    // the buffer holds a partial line of maximum length, a full block, and the terminating '\0'
+    size = maxline + LR_BLOCK + 1;
+
+    // move the buffered input to the front, it has to fit in the new buffer
+    if( lr->start > 0 )
+    {
+        memmove( lr->buf, &lr->buf[lr->start], lr->end - lr->start );
+        lr->base += lr->start;
+        lr->end -= lr->start;
+        lr->start = 0;
+    }
+    if( size < lr->end + 1 )
+        size = lr->end + 1;
+
+    if( size != lr->size )
+    {
+        if( !(buf = (char*) realloc( lr->buf, size )) )
+            return 1;
+        lr->buf = buf;
+        lr->size = size;
+    }
+    lr->maxline = maxline;
+
+    return 0;
+}
+
+ssize_t lr_read( struct linereader* lr, struct lr_line* batch, size_t max )
+{
+    size_t n = 0, nl;
+    ssize_t rc;
+
+    for( ;; )
+    {
+        // split all buffered complete lines
+        while( (n < max) && (lr->start < lr->end) )
+        {
+            nl = lr_newline( lr->buf, lr->start + lr->scanned, lr->end );
+
+            if( lr->skip )
+            {
+                // throw away everything up to the end of the overlong line
+                lr->start = nl < lr->end ? nl + 1 : lr->end;
+                lr->skip = (nl == lr->end);
+                lr->scanned = 0;
+            }
+            else if( (nl - lr->start > lr->maxline) )
+            {
+                // line is too long (whether its end was read or not), cut it off
+                batch[n].line = &lr->buf[lr->start];
+                batch[n].length = lr->maxline;
+                batch[n].line[lr->maxline] = '\0';
+                n++;
+                lr->truncated++;
+                lr->skip = (nl == lr->end);
+                lr->start = nl < lr->end ? nl + 1 : lr->start + lr->maxline + 1;
+                lr->scanned = 0;
+            }
+            else if( nl < lr->end )
+            {
+                // complete line
+                batch[n].line = &lr->buf[lr->start];
+                batch[n].length = nl - lr->start;
+                lr->buf[nl] = '\0';
+                n++;
+                lr->start = nl + 1;
+                lr->scanned = 0;
+            }
+            else
+            {
+                // partial line, remember how far we looked
+                lr->scanned = lr->end - lr->start;
+                break;
+            }
+        }
+
+        // hand out what we have instead of waiting for more input
+        if( n > 0 )
+            return n;
+
+        // a final line without newline still counts
+        if( lr->eof || lr->finish )
+        {
+            lr->finish = 0;
+            if( lr->start == lr->end )
+                return 0;
+            batch[0].line = &lr->buf[lr->start];
+            batch[0].length = lr->end - lr->start;
+            batch[0].line[batch[0].length] = '\0';
+            lr->start = lr->end;
+            lr->scanned = 0;
+            return 1;
+        }
+
+        // move the partial line to the front of the buffer to make room
+        if( lr->start > 0 )
+        {
+            memmove( lr->buf, &lr->buf[lr->start], lr->end - lr->start );
+            lr->base += lr->start;
+            lr->end -= lr->start;
+            lr->start = 0;
+        }
+
+        // one read(2) usually brings in a whole burst of lines
+        rc = read( lr->fd, &lr->buf[lr->end], lr->size - lr->end - 1 );
+        if( rc < 0 )
+            return -1;
+        if( rc == 0 )
+        {
+            // a followed file may still grow, keep the partial line until it is complete
+            if( lr->follow )
+                return 0;
+            lr->eof = 1;
+        }
+        lr->end += rc;
+    }
+}
+
+int lr_buffered( struct linereader* lr )
+{
+    // a complete (or overlong) line is already buffered
+    return lr->eof || (lr->finish && (lr->start < lr->end)) || (lr->end - lr->start > lr->maxline) ||
+           (lr_newline( lr->buf, lr->start + lr->scanned, lr->end ) < lr->end);
+}
+
+int lr_ready( struct linereader* lr )
+{
+    struct pollfd pfd;
+
+    if( lr_buffered( lr ) )
+        return 1;
+
+    // or read(2) would not block
+    pfd.fd = lr->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll( &pfd, 1, 0 ) > 0;
+}
+
+void lr_follow( struct linereader* lr )
+{
+    lr->follow = 1;
+}
+
+int lr_finish( struct linereader* lr )
+{
+    lr->finish = (lr->start < lr->end);
+    return lr->finish;
+}
+
+void lr_reset( struct linereader* lr, int fd, off_t offset )
+{
+    lr->fd = fd;
+    lr->base = offset;
+    lr->start = lr->end = lr->scanned = 0;
+    lr->skip = lr->eof = lr->finish = 0;
+}
+
+off_t lr_offset( const struct linereader* lr )
+{
+    return lr->base + lr->start;
+}
+
+unsigned long lr_truncated( const struct linereader* lr )
+{
+    return lr->truncated;
+}
@@ -0,0 +1,74 @@
+/*
+ Copyright 2013-2025 Alexander Wittig. All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Block oriented line reader for the input of banhammer */
+
+struct linereader;
+
+// One line handed out by lr_read. It is terminated by '\0' instead of the
+// newline and stays valid until the next call to lr_read.
+struct lr_line {
+    char* line;                 // Start of the line
+    size_t length;              // Length of the line without newline
+};
+
+// Create a reader on file descriptor fd for lines of up to maxline characters
+struct linereader* lr_create( int fd, size_t maxline );
+
+// Free a reader and its buffer (the file descriptor is not closed)
+void lr_free( struct linereader* lr );
+
+// Change the maximum line length, keeping all buffered input
+int lr_limit( struct linereader* lr, size_t maxline );
+
+// Fill batch with up to max complete lines, reading more input only if no
+// complete line is buffered. Returns the number of lines, 0 at the end of
+// input, or -1 if read(2) failed (e.g. with EINTR if interrupted by a signal).
+ssize_t lr_read( struct linereader* lr, struct lr_line* batch, size_t max );
+
+// Check if a complete line is buffered
+int lr_buffered( struct linereader* lr );
+
+// Check if lr_read would return without waiting for input
+int lr_ready( struct linereader* lr );
+
+// Treat the end of input as temporary (for files that are still written to):
+// lr_read returns 0 whenever no complete line is available and a partial
+// line at the end is kept until it is completed.
+void lr_follow( struct linereader* lr );
+
+// Let the next lr_read hand out a partial line at the end of the buffered
+// input as a line, as at the end of input (e.g. before a followed file is
+// replaced). Returns non-zero if there is one.
+int lr_finish( struct linereader* lr );
+
+// Discard all buffered input and continue reading from fd, which is at offset
+void lr_reset( struct linereader* lr, int fd, off_t offset );
+
+// Input offset of the first character not handed out by lr_read yet
+off_t lr_offset( const struct linereader* lr );
+
+// Number of lines that were cut off at the maximum line length
+unsigned long lr_truncated( const struct linereader* lr );
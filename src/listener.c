@@ -0,0 +1,691 @@
+/*
+ Copyright 2013-2025 Alexander Wittig. All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/queue.h>
+#include <netinet/in.h>
+
+#include "linereader.h"
+#include "listener.h"
+
+// Longest time to wait for messages (in seconds) before returning, so that
+// signals are handled in time
+static const int SL_INTERVAL = 1;
+
+// Longest header fields as limited by RFC 5424 (longer ones are cut off)
+#define SL_HOST 255
+#define SL_TAG 48
+#define SL_PID 128
+
+// Room in front of each received message for the rewritten syslog header
+// (time stamp, host name, tag and pid with their separators)
+#define SL_HEAD 512
+
+// Largest and smallest socket receive buffer to ask for
+#define SL_RCVBUF_MAX (8*1024*1024)
+#define SL_RCVBUF_MIN (256*1024)
+
+// Default syslog port
+static const char* SL_PORT = "514";
+
+static const char* months[12] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+#ifdef HAVE_RECVMMSG
+#define SL_MSG(l, k) ((l)->msgs[k].msg_hdr)
+#else
+#define SL_MSG(l, k) ((l)->msgs[k])
+#endif
+
+// a socket messages are received on
+struct slsocket {
+    char* address;              // Address as given to sl_add
+    char* path;                 // Path of a UNIX socket (removed on close) or NULL for UDP
+    int fd;                     // Socket
+    unsigned int round;         // Last sl_begin round in which the socket was added
+    STAILQ_ENTRY(slsocket) next;    // Singly linked list entry
+};
+
+STAILQ_HEAD( _slsockets, slsocket );
+
+// the set of sockets and the buffers messages are received into
+struct listener {
+    struct _slsockets sockets;  // Sockets
+    unsigned int nsockets;      // Number of sockets
+    struct slsocket* last;      // Socket read from last
+    struct pollfd* fds;         // All sockets for waiting
+    size_t maxline;             // Maximum message length
+    unsigned int round;         // Current sl_begin round
+    char* buf;                  // Slots for received messages, each with room for a header in front
+    size_t slot;                // Size of one slot
+    size_t nslots;              // Number of slots
+#ifdef HAVE_RECVMMSG
+    struct mmsghdr* msgs;       // Message headers, one per slot
+#else
+    struct msghdr* msgs;        // Message headers, one per slot
+#endif
+    struct iovec* iov;          // Receive buffers, one per slot
+    struct sockaddr_storage* from;  // Sender addresses, one per slot
+    char hostname[SL_HOST+1];   // Host name for messages from UNIX sockets
+    time_t stamped;             // Time of the current time stamp
+    char now[16];               // Current time stamp for messages without one
+    unsigned long received;     // Statistics: messages received
+    unsigned long truncated;    // Statistics: messages cut off
+};
+
+// Make room for max messages
+static int sl_slots( struct listener* l, size_t max )
+{
+    void* p;
+
+    if( max <= l->nslots )
+        return 0;
+
+    l->slot = SL_HEAD + l->maxline + 1;
+    if( !(p = realloc( l->buf, max*l->slot )) )
+        return 1;
+    l->buf = (char*) p;
+    if( !(p = realloc( l->msgs, max*sizeof(*l->msgs) )) )
+        return 1;
+    l->msgs = p;
+    if( !(p = realloc( l->iov, max*sizeof(struct iovec) )) )
+        return 1;
+    l->iov = (struct iovec*) p;
+    if( !(p = realloc( l->from, max*sizeof(struct sockaddr_storage) )) )
+        return 1;
+    l->from = (struct sockaddr_storage*) p;
+    l->nslots = max;
+
+    return 0;
+}
+
+// Update the time stamp used for messages without one
+static void sl_stamp( struct listener* l )
+{
+    time_t t = time( NULL );
+    struct tm tm;
+
+    if( t == l->stamped )
+        return;
+    l->stamped = t;
+    localtime_r( &t, &tm );
+    strftime( l->now, sizeof(l->now), "%b %e %H:%M:%S", &tm );
+}
+
+// Split off the next space separated field of an RFC 5424 header.
+// Returns NULL for an empty field or the nil value "-".
+static const char* sl_field( char** p, const char* end, size_t* len )
+{
+    char *f = *p, *q;
+
+    for( q = f; (q < end) && (*q != ' '); q++ )
+        ;
+    *len = q - f;
+    *p = q < end ? q + 1 : q;
+
+    return ((*len == 0) || ((*len == 1) && (*f == '-'))) ? NULL : f;
+}
+
+// Check if c can be part of a host name or address
+static int sl_hostchar( char c )
+{
+    return isalnum( (unsigned char)c ) || (c == '.') || (c == '-') || (c == '_') || (c == ':');
+}
+
+// Turn the message received into slot k into a syslog line with a complete
+// RFC 3164 header. Missing time stamps and host names are filled in, an RFC
+// 5424 header is rewritten. The message itself is not moved, the new header
+// is written into the room in front of it.
+static void sl_format( struct listener* l, struct slsocket* s, size_t k, struct lr_line* line )
+{
+    char *p = l->buf + k*l->slot + SL_HEAD, *end = p + line->length, *q;
+    const char *ts = NULL, *host = NULL, *tag = NULL, *pid = NULL, *f;
+    size_t hostlen = 0, taglen = 0, pidlen = 0, n;
+    char head[SL_HEAD], stamp[16], addr[NI_MAXHOST];
+    int month, quoted;
+
+    // trailing newlines and NUL characters are not part of the message
+    while( (end > p) && ((end[-1] == '\n') || (end[-1] == '\r') || (end[-1] == '\0')) )
+        end--;
+    *end = '\0';
+
+    // priority
+    if( *p == '<' )
+    {
+        for( q = p + 1; (q < end) && (q - p <= 4) && isdigit( (unsigned char)*q ); q++ )
+            ;
+        if( (q > p + 1) && (q < end) && (*q == '>') )
+            p = q + 1;
+    }
+
+    if( (end - p >= 2) && (p[0] == '1') && (p[1] == ' ') )
+    {
+        // RFC 5424: 1 TIMESTAMP HOSTNAME APP-NAME PROCID MSGID STRUCTURED-DATA [MSG]
+        p += 2;
+        f = sl_field( &p, end, &n );
+        if( f && (n >= 19) && (f[4] == '-') && (f[7] == '-') && (f[10] == 'T') && (f[13] == ':') && (f[16] == ':') )
+        {
+            month = 10*(f[5] - '0') + (f[6] - '0');
+            if( (month >= 1) && (month <= 12) )
+            {
+                snprintf( stamp, sizeof(stamp), "%s %c%c %.8s", months[month-1], f[8] == '0' ? ' ' : f[8], f[9], &f[11] );
+                ts = stamp;
+            }
+        }
+        host = sl_field( &p, end, &hostlen );
+        tag = sl_field( &p, end, &taglen );
+        pid = sl_field( &p, end, &pidlen );
+        sl_field( &p, end, &n );
+
+        // structured data elements, ending at the first ']' outside of quoted values
+        if( (p < end) && (*p == '-') )
+            p++;
+        else
+            while( (p < end) && (*p == '[') )
+            {
+                for( p++, quoted = 0; (p < end) && (quoted || (*p != ']')); p++ )
+                    if( (*p == '\\') && (p + 1 < end) )
+                        p++;
+                    else if( *p == '"' )
+                        quoted = !quoted;
+                if( p < end )
+                    p++;
+            }
+        if( (p < end) && (*p == ' ') )
+            p++;
+
+        // byte order mark of UTF-8 messages
+        if( (end - p >= 3) && (memcmp( p, "\xef\xbb\xbf", 3 ) == 0) )
+            p += 3;
+    }
+    else
+    {
+        // RFC 3164: TIMESTAMP HOSTNAME TAG[PID]: MSG, where local messages have
+        // no host name and some senders leave out the time stamp as well
+        if( (end - p >= 16) && (p[3] == ' ') && (p[6] == ' ') && (p[9] == ':') && (p[12] == ':') && (p[15] == ' ') )
+        {
+            ts = p;
+            p += 16;
+        }
+        if( !s->path )
+        {
+            // a host name is followed by a space, while a tag contains a '[' or ends with a ':'
+            for( q = p; (q < end) && sl_hostchar( *q ); q++ )
+                ;
+            if( (q > p) && (q < end) && (*q == ' ') && (q[-1] != ':') )
+            {
+                host = p;
+                hostlen = q - p;
+                p = q + 1;
+            }
+        }
+
+        // the line is complete as received
+        if( ts && host && (host == ts + 16) )
+        {
+            line->line = (char*) ts;
+            line->length = end - ts;
+            return;
+        }
+    }
+
+    if( !ts )
+        ts = l->now;
+    if( !host )
+    {
+        host = s->path || getnameinfo( (struct sockaddr*)&l->from[k], SL_MSG( l, k ).msg_namelen,
+                                       addr, sizeof(addr), NULL, 0, NI_NUMERICHOST ) ? l->hostname : addr;
+        hostlen = strlen( host );
+    }
+    if( hostlen > SL_HOST )
+        hostlen = SL_HOST;
+    if( taglen > SL_TAG )
+        taglen = SL_TAG;
+    if( pidlen > SL_PID )
+        pidlen = SL_PID;
+
+    // header in front of the message (the fields may overlap its place)
+    memcpy( head, ts, 15 );
+    n = 15;
+    head[n++] = ' ';
+    memcpy( &head[n], host, hostlen );
+    n += hostlen;
+    head[n++] = ' ';
+    if( tag )
+    {
+        memcpy( &head[n], tag, taglen );
+        n += taglen;
+        if( pid )
+        {
+            head[n++] = '[';
+            memcpy( &head[n], pid, pidlen );
+            n += pidlen;
+            head[n++] = ']';
+        }
+        head[n++] = ':';
+        head[n++] = ' ';
+    }
+    line->line = p - n;
+    memcpy( line->line, head, n );
+    line->length = end - line->line;
+}
+
+// Receive up to max messages from a socket into batch and the slots starting
+// at first. Returns the number of messages received.
+static size_t sl_receive( struct listener* l, struct slsocket* s, struct lr_line* batch, size_t first, size_t max )
+{
+    struct msghdr* h;
+    size_t k;
+    ssize_t n;
+
+    for( k = first; k < first + max; k++ )
+    {
+        l->iov[k].iov_base = l->buf + k*l->slot + SL_HEAD;
+        l->iov[k].iov_len = l->maxline;
+        h = &SL_MSG( l, k );
+        memset( h, 0, sizeof(struct msghdr) );
+        h->msg_iov = &l->iov[k];
+        h->msg_iovlen = 1;
+        h->msg_name = &l->from[k];
+        h->msg_namelen = sizeof(struct sockaddr_storage);
+    }
+
+#ifdef HAVE_RECVMMSG
+    // all waiting messages with a single system call
+    n = recvmmsg( s->fd, &l->msgs[first], max, MSG_DONTWAIT, NULL );
+    if( n <= 0 )
+        return 0;
+    for( k = first; k < first + n; k++ )
+        batch[k].length = l->msgs[k].msg_len;
+#else
+    for( n = 0; n < (ssize_t)max; n++ )
+    {
+        ssize_t len = recvmsg( s->fd, &l->msgs[first + n], MSG_DONTWAIT );
+        if( len < 0 )
+            break;
+        batch[first + n].length = len;
+    }
+    if( n == 0 )
+        return 0;
+#endif
+
+    sl_stamp( l );
+    for( k = first; k < first + n; k++ )
+    {
+        if( SL_MSG( l, k ).msg_flags & MSG_TRUNC )
+            l->truncated++;
+        sl_format( l, s, k, &batch[k] );
+    }
+    l->received += n;
+
+    return n;
+}
+
+// Create a datagram socket bound to addr
+static int sl_socket( int family, const struct sockaddr* addr, socklen_t len )
+{
+    int fd, on = 1, size, e;
+
+    if( (fd = socket( family, SOCK_DGRAM, 0 )) < 0 )
+        return -1;
+    if( family == AF_INET6 )
+        setsockopt( fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on) );
+
+    // a large receive buffer absorbs bursts while a batch is matched
+    for( size = SL_RCVBUF_MAX; (size >= SL_RCVBUF_MIN) && setsockopt( fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size) ); size /= 2 )
+        ;
+
+    if( bind( fd, addr, len ) )
+    {
+        e = errno;
+        close( fd );
+        errno = e;
+        return -1;
+    }
+
+    return fd;
+}
+
+// Add a bound socket to the set
+static int sl_append( struct listener* l, const char* address, const char* path, int fd )
+{
+    struct slsocket* s;
+
+    s = (struct slsocket*) calloc( 1, sizeof(struct slsocket) );
+    if( s )
+    {
+        s->address = strdup( address );
+        s->path = path ? strdup( path ) : NULL;
+    }
+    if( !s || !s->address || (path && !s->path) )
+    {
+        if( s )
+        {
+            free( s->address );
+            free( s->path );
+        }
+        free( s );
+        close( fd );
+        errno = ENOMEM;
+        return -1;
+    }
+    s->fd = fd;
+    s->round = l->round;
+    STAILQ_INSERT_TAIL( &l->sockets, s, next );
+    l->nsockets++;
+
+    return 0;
+}
+
+// Listen on a UNIX datagram socket
+static int sl_unix( struct listener* l, const char* path )
+{
+    struct sockaddr_un sun;
+    struct stat sb;
+    int fd;
+
+    if( strlen( path ) >= sizeof(sun.sun_path) )
+        return 1;
+    memset( &sun, 0, sizeof(sun) );
+    sun.sun_family = AF_UNIX;
+    strcpy( sun.sun_path, path );
+
+    // replace a socket left behind by an earlier run
+    if( !lstat( path, &sb ) && S_ISSOCK( sb.st_mode ) )
+        unlink( path );
+    if( (fd = sl_socket( AF_UNIX, (struct sockaddr*)&sun, sizeof(sun) )) < 0 )
+        return -1;
+    // anyone may log, just like to /var/run/log
+    chmod( path, 0666 );
+
+    if( sl_append( l, path, path, fd ) )
+    {
+        unlink( path );
+        return -1;
+    }
+
+    return 0;
+}
+
+// Listen on UDP for [host:]port, host or [ipv6]:port
+static int sl_udp( struct listener* l, const char* address )
+{
+    char buf[NI_MAXHOST+32], *host = buf, *port;
+    struct addrinfo hints, *res, *ai;
+    int fds[8], nfds = 0, i, e;
+
+    if( strlen( address ) >= sizeof(buf) )
+        return 1;
+    strcpy( buf, address );
+
+    if( *host == '[' )
+    {
+        host++;
+        if( !(port = strchr( host, ']' )) )
+            return 1;
+        *port++ = '\0';
+        if( *port == ':' )
+            port++;
+        else if( *port )
+            return 1;
+    }
+    else if( (port = strchr( host, ':' )) && !strchr( port + 1, ':' ) )
+        *port++ = '\0';
+    else if( port )
+        port = NULL;                    // IPv6 address without port
+    else if( strspn( host, "0123456789" ) == strlen( host ) )
+    {
+        port = host;
+        host = NULL;
+    }
+    if( !port || !*port )
+        port = (char*) SL_PORT;
+    if( host && (!*host || (strcmp( host, "*" ) == 0)) )
+        host = NULL;
+
+    memset( &hints, 0, sizeof(hints) );
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+    if( getaddrinfo( host, port, &hints, &res ) )
+        return 1;
+
+    // all addresses or none
+    for( ai = res; ai && (nfds < (int)(sizeof(fds)/sizeof(fds[0]))); ai = ai->ai_next )
+    {
+        if( (fds[nfds] = sl_socket( ai->ai_family, ai->ai_addr, ai->ai_addrlen )) < 0 )
+        {
+            e = errno;
+            while( nfds > 0 )
+                close( fds[--nfds] );
+            freeaddrinfo( res );
+            errno = e;
+            return -1;
+        }
+        nfds++;
+    }
+    freeaddrinfo( res );
+
+    for( i = 0; i < nfds; i++ )
+        if( sl_append( l, address, NULL, fds[i] ) )
+        {
+            while( ++i < nfds )
+                close( fds[i] );
+            return -1;
+        }
+
+    return 0;
+}
+
+// Close a socket and free it
+static void sl_close( struct slsocket* s )
+{
+    close( s->fd );
+    if( s->path )
+        unlink( s->path );
+    free( s->address );
+    free( s->path );
+    free( s );
+}
+
+struct listener* sl_create( size_t maxline )
+{
+    struct listener* l;
+    char* p;
+
+    l = (struct listener*) calloc( 1, sizeof(struct listener) );
+    if( !l )
+        return NULL;
+
+    STAILQ_INIT( &l->sockets );
+    l->maxline = maxline;
+
+    // local messages are logged with the short host name, like syslogd does
+    if( gethostname( l->hostname, sizeof(l->hostname) - 1 ) || !l->hostname[0] )
+        strcpy( l->hostname, "localhost" );
+    if( (p = strchr( l->hostname, '.' )) )
+        *p = '\0';
+
+    return l;
+}
+
+void sl_free( struct listener* l )
+{
+    struct slsocket* s;
+
+    if( !l ) return;
+
+    while( !STAILQ_EMPTY( &l->sockets ) )
+    {
+        s = STAILQ_FIRST( &l->sockets );
+        STAILQ_REMOVE_HEAD( &l->sockets, next );
+        sl_close( s );
+    }
+    free( l->fds );
+    free( l->buf );
+    free( l->msgs );
+    free( l->iov );
+    free( l->from );
+    free( l );
+}
+
+void sl_limit( struct listener* l, size_t maxline )
+{
+    // the slots are laid out again on the next read
+    l->maxline = maxline;
+    l->nslots = 0;
+}
+
+void sl_begin( struct listener* l )
+{
+    l->round++;
+}
+
+int sl_add( struct listener* l, const char* address )
+{
+    struct slsocket* s;
+    int found = 0;
+
+    // sockets opened already stay open, as we may not be allowed to bind them again
+    STAILQ_FOREACH( s, &l->sockets, next )
+        if( strcmp( s->address, address ) == 0 )
+        {
+            s->round = l->round;
+            found = 1;
+        }
+    if( found )
+        return 0;
+
+    return address[0] == '/' ? sl_unix( l, address ) : sl_udp( l, address );
+}
+
+int sl_prune( struct listener* l )
+{
+    struct slsocket *s, *n;
+    struct pollfd* fds;
+    unsigned int i = 0;
+
+    for( s = STAILQ_FIRST( &l->sockets ); s; s = n )
+    {
+        n = STAILQ_NEXT( s, next );
+        if( s->round != l->round )
+        {
+            STAILQ_REMOVE( &l->sockets, s, slsocket, next );
+            sl_close( s );
+            l->nsockets--;
+        }
+    }
+    l->last = NULL;
+
+    if( !(fds = (struct pollfd*) realloc( l->fds, (l->nsockets + 1)*sizeof(struct pollfd) )) )
+        return 1;
+    l->fds = fds;
+    STAILQ_FOREACH( s, &l->sockets, next )
+    {
+        fds[i].fd = s->fd;
+        fds[i].events = POLLIN;
+        fds[i++].revents = 0;
+    }
+
+    return 0;
+}
+
+ssize_t sl_read( struct listener* l, struct lr_line* batch, size_t max )
+{
+    struct slsocket* s;
+    size_t n;
+    unsigned int i;
+    int pass, rc;
+
+    if( sl_slots( l, max ) )
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for( pass = 0; pass < 2; pass++ )
+    {
+        // take turns, starting with the socket after the one read last
+        n = 0;
+        s = l->last;
+        for( i = 0; (i < l->nsockets) && (n < max); i++ )
+        {
+            s = (s && STAILQ_NEXT( s, next )) ? STAILQ_NEXT( s, next ) : STAILQ_FIRST( &l->sockets );
+            n += sl_receive( l, s, batch, n, max - n );
+        }
+        l->last = s;
+        if( n > 0 )
+            return n;
+
+        if( pass == 0 )
+        {
+            rc = poll( l->fds, l->nsockets, SL_INTERVAL*1000 );
+            if( rc < 0 )
+            {
+                errno = EINTR;
+                return -1;
+            }
+            if( rc == 0 )
+                break;
+        }
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+int sl_ready( struct listener* l )
+{
+    return (l->nsockets > 0) && (poll( l->fds, l->nsockets, 0 ) > 0);
+}
+
+unsigned int sl_count( const struct listener* l )
+{
+    return l->nsockets;
+}
+
+unsigned long sl_received( const struct listener* l )
+{
+    return l->received;
+}
+
+unsigned long sl_truncated( const struct listener* l )
+{
+    return l->truncated;
+}
@@ -0,0 +1,65 @@
+/*
+ Copyright 2013-2025 Alexander Wittig. All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Receive syslog messages directly from UNIX datagram and UDP sockets */
+
+struct listener;
+
+// Create an empty set of sockets for messages of up to maxline characters
+struct listener* sl_create( size_t maxline );
+
+// Close all sockets and free the set
+void sl_free( struct listener* l );
+
+// Change the maximum message length
+void sl_limit( struct listener* l, size_t maxline );
+
+// Start a new list of sockets. Sockets not added again before sl_prune is
+// called are closed, all others stay open.
+void sl_begin( struct listener* l );
+
+// Listen on address: an absolute path for a UNIX datagram socket, or
+// [host:]port, host or [ipv6]:port for UDP. Returns 0 on success, 1 if the
+// address is invalid, and -1 with errno set if binding failed.
+int sl_add( struct listener* l, const char* address );
+
+// Close sockets that were not added since sl_begin. Must be called after
+// adding sockets. Returns non-zero if out of memory.
+int sl_prune( struct listener* l );
+
+// Fill batch with up to max messages, converted to syslog lines
+// ("Mmm dd hh:mm:ss host tag[pid]: message"). If none is available, wait for
+// one for a while. Returns the number of lines or -1 with errno EAGAIN if
+// nothing arrived in time and EINTR if the wait was interrupted by a signal.
+// The lines stay valid until the next call to sl_read.
+ssize_t sl_read( struct listener* l, struct lr_line* batch, size_t max );
+
+// Check if sl_read would return messages without waiting
+int sl_ready( struct listener* l );
+
+// Statistics: number of sockets, messages received, messages cut off
+unsigned int sl_count( const struct listener* l );
+unsigned long sl_received( const struct listener* l );
+unsigned long sl_truncated( const struct listener* l );
@@ -0,0 +1,711 @@
+/*
+ Copyright 2013-2025 Alexander Wittig. All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <config.h>
+
+#ifdef HAVE_LINUX_NETFILTER_NF_TABLES_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <endian.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/netlink.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nf_tables.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+#include "banlib.h"
+#include "firewall.h"
+
+/*
+ Linux nftables sets, written via netlink. Table N of banhammer is kept in the
+ interval sets "tableN_v4" and "tableN_v6" of an nftables table, which are
+ created by the first addition. Addresses with an expiration time as value are
+ added with a timeout, so the kernel removes them without banhammerd. Adding
+ an existing prefix succeeds and refreshes its timeout (Linux 6.10+). A prefix
+ overlapping other intervals of the set is refused with EEXIST, which is a
+ failure, since nothing was added. Listing returns the expiration time, or 0 for
+ permanent entries, as value.
+
+ Options (comma separated after "nft:"):
+    table=name      nftables table holding the sets (default "banhammer")
+    family=name     family of the table: inet (default), ip, ip6, bridge, netdev
+*/
+
+// nftables data types of set keys (datatype.h of nftables)
+#define NFT_TYPE_IPADDR 7
+#define NFT_TYPE_IP6ADDR 8
+
+#define NFT_BUFFER 65536        // size of the receive buffer (large enough for dumps)
+#define NFT_ELEMENT 192         // room needed for the messages of one set element pair
+
+// table whose sets were created by us
+struct nft_known {
+    u_int16_t table;            // Table number
+    int sets;                   // Sets created (bit 0: IPv4, bit 1: IPv6)
+};
+
+// set element as listed by the kernel
+struct nft_elem {
+    unsigned char key[16];      // Key (address in network byte order)
+    int end;                    // Element ends an interval
+    u_int32_t value;            // Expiration time (0 if permanent)
+};
+
+static int nftSocket = -1;              // netlink socket to nftables
+static u_int32_t nftSeq = 0;            // sequence number of the last message
+static char nftTable[NFT_TABLE_MAXNAMELEN] = "banhammer";   // table holding the sets
+static u_int8_t nftFamily = NFPROTO_INET;   // family of the table
+static char* nftBuf = NULL;             // messages to send (reused)
+static size_t nftLen = 0;               // length of the messages
+static size_t nftSize = 0;              // room for messages
+static char* nftRecv = NULL;            // receive buffer
+static struct nft_known* nftKnown = NULL;   // tables whose sets were created
+static unsigned int nftKnownCount = 0;  // number of those tables
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t nftLock = PTHREAD_MUTEX_INITIALIZER;   // one transaction at a time on the socket
+#define NFT_LOCK pthread_mutex_lock( &nftLock )
+#define NFT_UNLOCK pthread_mutex_unlock( &nftLock )
+#else
+#define NFT_LOCK
+#define NFT_UNLOCK
+#endif
+
+// make room for size more bytes of messages
+static int nft_reserve( size_t size )
+{
+    char* b;
+
+    if( nftLen + size <= nftSize )
+        return 0;
+    size = 2*(nftLen + size);
+    if( !(b = (char*) realloc( nftBuf, size )) )
+        return -1;
+    nftBuf = b;
+    nftSize = size;
+    return 0;
+}
+
+// append a message header, returning its offset
+static size_t nft_msg( u_int16_t type, u_int16_t flags, u_int8_t family, u_int16_t resid )
+{
+    struct nlmsghdr* nlh = (struct nlmsghdr*)(nftBuf + nftLen);
+    struct nfgenmsg* nfg = (struct nfgenmsg*)NLMSG_DATA( nlh );
+    size_t off = nftLen;
+
+    memset( nlh, 0, NLMSG_SPACE(sizeof(struct nfgenmsg)) );
+    nlh->nlmsg_type = type;
+    nlh->nlmsg_flags = NLM_F_REQUEST | flags;
+    nlh->nlmsg_seq = ++nftSeq;
+    nfg->nfgen_family = family;
+    nfg->version = NFNETLINK_V0;
+    nfg->res_id = htons( resid );
+    nftLen += NLMSG_SPACE(sizeof(struct nfgenmsg));
+    nlh->nlmsg_len = nftLen - off;
+    return off;
+}
+
+// finish the message at offset off
+static void nft_msg_end( size_t off )
+{
+    ((struct nlmsghdr*)(nftBuf + off))->nlmsg_len = nftLen - off;
+}
+
+// append an attribute
+static void nft_attr( u_int16_t type, const void* data, size_t size )
+{
+    struct nlattr* nla = (struct nlattr*)(nftBuf + nftLen);
+
+    nla->nla_type = type;
+    nla->nla_len = NLA_HDRLEN + size;
+    memcpy( (char*)nla + NLA_HDRLEN, data, size );
+    memset( (char*)nla + NLA_HDRLEN + size, 0, NLA_ALIGN(size) - size );
+    nftLen += NLA_HDRLEN + NLA_ALIGN(size);
+}
+
+// append a 32 bit attribute in network byte order
+static void nft_attr32( u_int16_t type, u_int32_t value )
+{
+    value = htonl( value );
+    nft_attr( type, &value, sizeof(value) );
+}
+
+// start a nested attribute, returning its offset
+static size_t nft_nest( u_int16_t type )
+{
+    size_t off = nftLen;
+
+    nft_attr( NLA_F_NESTED | type, NULL, 0 );
+    return off;
+}
+
+// finish the nested attribute at offset off
+static void nft_nest_end( size_t off )
+{
+    ((struct nlattr*)(nftBuf + off))->nla_len = nftLen - off;
+}
+
+// name of the set of a table for IPv4 (v6 = 0) or IPv6 (v6 = 1) addresses
+static void nft_setname( char* name, u_int16_t table, int v6 )
+{
+    snprintf( name, NFT_SET_MAXNAMELEN, "table%hu_v%d", table, v6 ? 6 : 4 );
+}
+
+// get the interval of an address prefix as set keys: its start, and its end
+// (the first address after it). Returns the key length, or 0 if the address is
+// not supported. *open is set if the prefix reaches the end of the address
+// space, so there is no end.
+static size_t nft_range( struct sockaddr* addr, socklen_t addrlen, u_int8_t masklen, unsigned char start[16], unsigned char end[16], int* open )
+{
+    unsigned int bits;
+    unsigned char mask;
+    size_t len;
+    int i;
+
+    switch( addr->sa_family )
+    {
+        case AF_INET:
+            if( (addrlen < sizeof(struct sockaddr_in)) || (masklen > 32) )
+                return 0;
+            len = 4;
+            memcpy( start, &((struct sockaddr_in*)addr)->sin_addr, len );
+            break;
+        case AF_INET6:
+            if( (addrlen < sizeof(struct sockaddr_in6)) || (masklen > 128) )
+                return 0;
+            len = 16;
+            memcpy( start, &((struct sockaddr_in6*)addr)->sin6_addr, len );
+            break;
+        default:
+            return 0;
+    }
+
+    // clear the host bits of the start and set them in the end
+    for( i = 0; i < (int)len; i++ )
+    {
+        bits = masklen > 8*i ? masklen - 8*i : 0;
+        mask = bits >= 8 ? 0xff : (unsigned char)(0xff << (8 - bits));
+        start[i] &= mask;
+        end[i] = start[i] | (unsigned char)~mask;
+    }
+
+    // the end is the next address
+    for( i = len - 1; i >= 0; i-- )
+        if( ++end[i] )
+            break;
+    *open = (i < 0);
+
+    return len;
+}
+
+// get the entry for a table whose sets we created, adding it if needed
+static struct nft_known* nft_known( u_int16_t table )
+{
+    struct nft_known* k;
+    unsigned int i;
+
+    for( i = 0; i < nftKnownCount; i++ )
+        if( nftKnown[i].table == table )
+            return &nftKnown[i];
+
+    if( !(k = (struct nft_known*) realloc( nftKnown, (nftKnownCount + 1)*sizeof(struct nft_known) )) )
+        return NULL;
+    nftKnown = k;
+    k = &nftKnown[nftKnownCount++];
+    k->table = table;
+    k->sets = 0;
+    return k;
+}
+
+// append messages creating the nftables table and the set of a table (if they do not exist)
+static void nft_create( u_int16_t table, int v6 )
+{
+    char set[NFT_SET_MAXNAMELEN];
+    size_t msg;
+
+    msg = nft_msg( (NFNL_SUBSYS_NFTABLES << 8) | NFT_MSG_NEWTABLE, NLM_F_CREATE | NLM_F_ACK, nftFamily, 0 );
+    nft_attr( NFTA_TABLE_NAME, nftTable, strlen( nftTable ) + 1 );
+    nft_msg_end( msg );
+
+    nft_setname( set, table, v6 );
+    msg = nft_msg( (NFNL_SUBSYS_NFTABLES << 8) | NFT_MSG_NEWSET, NLM_F_CREATE | NLM_F_ACK, nftFamily, 0 );
+    nft_attr( NFTA_SET_TABLE, nftTable, strlen( nftTable ) + 1 );
+    nft_attr( NFTA_SET_NAME, set, strlen( set ) + 1 );
+    nft_attr32( NFTA_SET_FLAGS, NFT_SET_INTERVAL | NFT_SET_TIMEOUT );
+    nft_attr32( NFTA_SET_KEY_TYPE, v6 ? NFT_TYPE_IP6ADDR : NFT_TYPE_IPADDR );
+    nft_attr32( NFTA_SET_KEY_LEN, v6 ? 16 : 4 );
+    nft_attr32( NFTA_SET_ID, table );
+    nft_msg_end( msg );
+}
+
+// append a key attribute to a set element
+static void nft_key( const unsigned char* key, size_t len )
+{
+    size_t nest;
+
+    nest = nft_nest( NFTA_SET_ELEM_KEY );
+    nft_attr( NFTA_DATA_VALUE, key, len );
+    nft_nest_end( nest );
+}
+
+// append a message adding (NFT_MSG_NEWSETELEM) or removing (NFT_MSG_DELSETELEM)
+// the pending entries (result -1) of one address family to the set of a table
+static void nft_elements( int op, u_int16_t table, int v6, struct fw_entry* entries, unsigned int n )
+{
+    char set[NFT_SET_MAXNAMELEN];
+    unsigned char start[16], end[16];
+    size_t msg, list, elem, len;
+    u_int64_t timeout;
+    time_t now = time( NULL );
+    unsigned int i;
+    int open;
+
+    nft_setname( set, table, v6 );
+    msg = nft_msg( (NFNL_SUBSYS_NFTABLES << 8) | op, (op == NFT_MSG_NEWSETELEM ? NLM_F_CREATE : 0) | NLM_F_ACK, nftFamily, 0 );
+    nft_attr( NFTA_SET_ELEM_LIST_TABLE, nftTable, strlen( nftTable ) + 1 );
+    nft_attr( NFTA_SET_ELEM_LIST_SET, set, strlen( set ) + 1 );
+    list = nft_nest( NFTA_SET_ELEM_LIST_ELEMENTS );
+    for( i = 0; i < n; i++ )
+    {
+        if( (entries[i].result != -1) || ((entries[i].addr->sa_family == AF_INET6) != v6) )
+            continue;
+        len = nft_range( entries[i].addr, entries[i].addrlen, entries[i].masklen, start, end, &open );
+
+        // an interval is a start element and an end element (unless it ends with the address space)
+        elem = nft_nest( NFTA_LIST_ELEM );
+        nft_key( start, len );
+        if( (op == NFT_MSG_NEWSETELEM) && entries[i].value )
+        {
+            // the value is the expiration time, at least let it reach the kernel
+            timeout = entries[i].value > now ? (u_int64_t)(entries[i].value - now)*1000 : 1000;
+            timeout = htobe64( timeout );
+            nft_attr( NFTA_SET_ELEM_TIMEOUT, &timeout, sizeof(timeout) );
+        }
+        nft_nest_end( elem );
+        if( !open )
+        {
+            elem = nft_nest( NFTA_LIST_ELEM );
+            nft_key( end, len );
+            nft_attr32( NFTA_SET_ELEM_FLAGS, NFT_SET_ELEM_INTERVAL_END );
+            nft_nest_end( elem );
+        }
+    }
+    nft_nest_end( list );
+    nft_msg_end( msg );
+}
+
+// send the messages in the buffer and collect the acknowledgements.
+// Returns 0, or the first error reported by the kernel.
+static int nft_send( )
+{
+    struct sockaddr_nl snl = { 0 };
+    struct nlmsghdr* nlh;
+    ssize_t len;
+    int rc = 0;
+
+    snl.nl_family = AF_NETLINK;
+    if( sendto( nftSocket, nftBuf, nftLen, 0, (struct sockaddr*)&snl, sizeof(snl) ) < 0 )
+        return errno;
+
+    // the kernel processes the batch while it is sent, so all replies are queued by now
+    while( (len = recv( nftSocket, nftRecv, NFT_BUFFER, MSG_DONTWAIT )) > 0 )
+        for( nlh = (struct nlmsghdr*)nftRecv; NLMSG_OK( nlh, len ); nlh = NLMSG_NEXT( nlh, len ) )
+            if( (nlh->nlmsg_type == NLMSG_ERROR) && !rc )
+                rc = -((struct nlmsgerr*)NLMSG_DATA( nlh ))->error;
+
+    return rc;
+}
+
+// Add (NFT_MSG_NEWSETELEM) or remove (NFT_MSG_DELSETELEM) n entries of a
+// table in one transaction, creating the sets as needed. Sets the result of
+// every entry. Returns 0, or the error that made the transaction fail.
+static int nft_commit( int op, struct fw_entry* entries, unsigned int n, u_int16_t table )
+{
+    unsigned char start[16], end[16];
+    struct nft_known* k = NULL;
+    unsigned int i;
+    int sets = 0, open, rc, v6;
+
+    for( i = 0; i < n; i++ )
+    {
+        entries[i].result = nft_range( entries[i].addr, entries[i].addrlen, entries[i].masklen, start, end, &open ) ? -1 : 1;
+        if( entries[i].result == -1 )
+            sets |= 1 << (entries[i].addr->sa_family == AF_INET6);
+    }
+    if( !sets )
+        return 0;
+
+    NFT_LOCK;
+    if( ((op == NFT_MSG_NEWSETELEM) && !(k = nft_known( table ))) || nft_reserve( 1024 + n*NFT_ELEMENT ) )
+        rc = ENOMEM;
+    else
+    {
+        nftLen = 0;
+        nft_msg( NFNL_MSG_BATCH_BEGIN, 0, AF_UNSPEC, NFNL_SUBSYS_NFTABLES );
+        for( v6 = 0; v6 < 2; v6++ )
+            if( k && (sets & (1 << v6)) && !(k->sets & (1 << v6)) )
+                nft_create( table, v6 );
+        for( v6 = 0; v6 < 2; v6++ )
+            if( sets & (1 << v6) )
+                nft_elements( op, table, v6, entries, n );
+        nft_msg( NFNL_MSG_BATCH_END, 0, AF_UNSPEC, NFNL_SUBSYS_NFTABLES );
+
+        rc = nft_send( );
+        if( !rc && k )
+            k->sets |= sets;
+    }
+    NFT_UNLOCK;
+
+    for( i = 0; i < n; i++ )
+        if( entries[i].result == -1 )
+            entries[i].result = rc ? 1 : 0;
+    errno = rc;
+
+    return rc;
+}
+
+// find the attributes of types up to max in len bytes of attributes
+static void nft_parse( const char* data, size_t len, const struct nlattr* tb[], unsigned int max )
+{
+    const struct nlattr* nla = (const struct nlattr*)data;
+
+    memset( tb, 0, (max + 1)*sizeof(*tb) );
+    while( (len >= NLA_HDRLEN) && (nla->nla_len >= NLA_HDRLEN) && (nla->nla_len <= len) )
+    {
+        if( (nla->nla_type & NLA_TYPE_MASK) <= max )
+            tb[nla->nla_type & NLA_TYPE_MASK] = nla;
+        if( (size_t)NLA_ALIGN(nla->nla_len) >= len )
+            break;
+        len -= NLA_ALIGN(nla->nla_len);
+        nla = (const struct nlattr*)((const char*)nla + NLA_ALIGN(nla->nla_len));
+    }
+}
+
+// payload of an attribute
+#define NFT_DATA(nla) ((const char*)(nla) + NLA_HDRLEN)
+#define NFT_DATALEN(nla) ((nla)->nla_len - NLA_HDRLEN)
+
+// Read the elements of the set of a table for IPv4 or IPv6 addresses.
+// Returns 0, ENOENT if there is no such set, or another error.
+static int nft_dump( u_int16_t table, int v6, struct nft_elem** elems, unsigned int* count, unsigned int* size )
+{
+    char set[NFT_SET_MAXNAMELEN];
+    const struct nlattr *tb[NFTA_SET_ELEM_LIST_MAX + 1], *etb[NFTA_SET_ELEM_MAX + 1], *ktb[NFTA_DATA_MAX + 1], *nla;
+    struct sockaddr_nl snl = { 0 };
+    struct nlmsghdr* nlh;
+    struct nft_elem* e;
+    u_int64_t expires;
+    time_t now = time( NULL );
+    ssize_t len;
+    size_t rest, msg;
+    int done = 0, rc = 0;
+
+    nft_setname( set, table, v6 );
+    if( nft_reserve( 1024 ) )
+        return ENOMEM;
+    nftLen = 0;
+    msg = nft_msg( (NFNL_SUBSYS_NFTABLES << 8) | NFT_MSG_GETSETELEM, NLM_F_DUMP, nftFamily, 0 );
+    nft_attr( NFTA_SET_ELEM_LIST_TABLE, nftTable, strlen( nftTable ) + 1 );
+    nft_attr( NFTA_SET_ELEM_LIST_SET, set, strlen( set ) + 1 );
+    nft_msg_end( msg );
+
+    snl.nl_family = AF_NETLINK;
+    if( sendto( nftSocket, nftBuf, nftLen, 0, (struct sockaddr*)&snl, sizeof(snl) ) < 0 )
+        return errno;
+
+    while( !done && ((len = recv( nftSocket, nftRecv, NFT_BUFFER, 0 )) > 0) )
+        for( nlh = (struct nlmsghdr*)nftRecv; !done && NLMSG_OK( nlh, len ); nlh = NLMSG_NEXT( nlh, len ) )
+        {
+            if( nlh->nlmsg_type == NLMSG_DONE )
+                done = 1;
+            else if( nlh->nlmsg_type == NLMSG_ERROR )
+            {
+                if( !rc )
+                    rc = -((struct nlmsgerr*)NLMSG_DATA( nlh ))->error;
+                done = 1;
+            }
+            else if( (nlh->nlmsg_type == ((NFNL_SUBSYS_NFTABLES << 8) | NFT_MSG_NEWSETELEM)) && (nlh->nlmsg_len >= NLMSG_SPACE(sizeof(struct nfgenmsg))) )
+            {
+                nft_parse( (const char*)NLMSG_DATA( nlh ) + NLMSG_ALIGN(sizeof(struct nfgenmsg)), nlh->nlmsg_len - NLMSG_SPACE(sizeof(struct nfgenmsg)), tb, NFTA_SET_ELEM_LIST_MAX );
+                if( !tb[NFTA_SET_ELEM_LIST_ELEMENTS] )
+                    continue;
+
+                // every element is an NFTA_LIST_ELEM in the list
+                nla = (const struct nlattr*)NFT_DATA( tb[NFTA_SET_ELEM_LIST_ELEMENTS] );
+                rest = NFT_DATALEN( tb[NFTA_SET_ELEM_LIST_ELEMENTS] );
+                while( (rest >= NLA_HDRLEN) && (nla->nla_len >= NLA_HDRLEN) && (nla->nla_len <= rest) )
+                {
+                    nft_parse( NFT_DATA( nla ), NFT_DATALEN( nla ), etb, NFTA_SET_ELEM_MAX );
+                    if( etb[NFTA_SET_ELEM_KEY] )
+                        nft_parse( NFT_DATA( etb[NFTA_SET_ELEM_KEY] ), NFT_DATALEN( etb[NFTA_SET_ELEM_KEY] ), ktb, NFTA_DATA_MAX );
+                    if( etb[NFTA_SET_ELEM_KEY] && ktb[NFTA_DATA_VALUE] && (NFT_DATALEN( ktb[NFTA_DATA_VALUE] ) == (v6 ? 16 : 4)) )
+                    {
+                        if( *count == *size )
+                        {
+                            if( !(e = (struct nft_elem*) realloc( *elems, (*size ? 2*(*size) : 256)*sizeof(struct nft_elem) )) )
+                            {
+                                rc = ENOMEM;
+                                break;
+                            }
+                            *elems = e;
+                            *size = *size ? 2*(*size) : 256;
+                        }
+                        e = &(*elems)[(*count)++];
+                        memcpy( e->key, NFT_DATA( ktb[NFTA_DATA_VALUE] ), v6 ? 16 : 4 );
+                        e->end = etb[NFTA_SET_ELEM_FLAGS] && (ntohl( *(const u_int32_t*)NFT_DATA( etb[NFTA_SET_ELEM_FLAGS] ) ) & NFT_SET_ELEM_INTERVAL_END);
+                        e->value = 0;
+                        if( etb[NFTA_SET_ELEM_EXPIRATION] )
+                        {
+                            memcpy( &expires, NFT_DATA( etb[NFTA_SET_ELEM_EXPIRATION] ), sizeof(expires) );
+                            e->value = now + (be64toh( expires ) + 999)/1000;
+                        }
+                    }
+                    if( (size_t)NLA_ALIGN(nla->nla_len) >= rest )
+                        break;
+                    rest -= NLA_ALIGN(nla->nla_len);
+                    nla = (const struct nlattr*)((const char*)nla + NLA_ALIGN(nla->nla_len));
+                }
+            }
+        }
+    if( !done && !rc )
+        rc = errno ? errno : EIO;
+
+    return rc;
+}
+
+// key length for the comparison of elements (set by nft_list for qsort)
+static size_t nftKeyLen = 4;
+
+// order elements by key, ends of intervals before starts of adjacent ones
+static int nft_compare( const void* a, const void* b )
+{
+    const struct nft_elem *ea = (const struct nft_elem*)a, *eb = (const struct nft_elem*)b;
+    int rc;
+
+    if( (rc = memcmp( ea->key, eb->key, nftKeyLen )) )
+        return rc;
+    return eb->end - ea->end;
+}
+
+// Get all address prefixes in both sets of a table and call a callback
+// function with each of them and its expiration time as value
+static int nft_list( void (*callback)(struct sockaddr*, socklen_t, u_int8_t, u_int32_t, u_int16_t), u_int16_t table )
+{
+    struct nft_elem* elems[2] = { NULL, NULL };
+    unsigned int count[2] = { 0, 0 }, size[2] = { 0, 0 }, i, masklen;
+    unsigned char last[16];
+    struct sockaddr_in sa4 = { 0 };
+    struct sockaddr_in6 sa6 = { 0 };
+    int rc[2], v6, j;
+
+    // read both sets first, the callback may alter them
+    NFT_LOCK;
+    for( v6 = 0; v6 < 2; v6++ )
+        rc[v6] = nft_dump( table, v6, &elems[v6], &count[v6], &size[v6] );
+    NFT_UNLOCK;
+
+    sa4.sin_family = AF_INET;
+    sa6.sin6_family = AF_INET6;
+    for( v6 = 0; v6 < 2; v6++ )
+    {
+        if( rc[v6] )
+            continue;
+        nftKeyLen = v6 ? 16 : 4;
+        qsort( elems[v6], count[v6], sizeof(struct nft_elem), nft_compare );
+        for( i = 0; i < count[v6]; i++ )
+        {
+            if( elems[v6][i].end )
+                continue;
+
+            // the prefix ends before the end of the interval (or with the address space)
+            if( (i + 1 < count[v6]) && elems[v6][i + 1].end )
+            {
+                memcpy( last, elems[v6][i + 1].key, nftKeyLen );
+                for( j = nftKeyLen - 1; (j >= 0) && (last[j]-- == 0); j-- );
+            }
+            else
+                memset( last, 0xff, nftKeyLen );
+            // ranges that are no prefix (not added by us) are reported as the prefix covering them
+            for( masklen = 0; (masklen < 8*nftKeyLen) && !((elems[v6][i].key[masklen/8] ^ last[masklen/8]) & (0x80 >> (masklen%8))); masklen++ );
+
+            if( v6 )
+            {
+                memcpy( &sa6.sin6_addr, elems[v6][i].key, 16 );
+                (*callback)( (struct sockaddr*)&sa6, sizeof(sa6), masklen, elems[v6][i].value, table );
+            }
+            else
+            {
+                memcpy( &sa4.sin_addr, elems[v6][i].key, 4 );
+                (*callback)( (struct sockaddr*)&sa4, sizeof(sa4), masklen, elems[v6][i].value, table );
+            }
+        }
+    }
+    free( elems[0] );
+    free( elems[1] );
+
+    // like a missing IPFW table, it is an error if neither set exists
+    if( (rc[0] && rc[0] != ENOENT) || (rc[1] && rc[1] != ENOENT) || (rc[0] == ENOENT && rc[1] == ENOENT) )
+        return 1;
+    return 0;
+}
+
+// Open the netlink socket
+static int nft_init( const char* options )
+{
+    static const struct { const char* name; u_int8_t family; } families[] = {
+        { "inet", NFPROTO_INET }, { "ip", NFPROTO_IPV4 }, { "ip6", NFPROTO_IPV6 },
+        { "bridge", NFPROTO_BRIDGE }, { "netdev", NFPROTO_NETDEV }
+    };
+    struct sockaddr_nl snl = { 0 };
+    char *opts, *c, *o, *v;
+    unsigned int i;
+    int one = 1, rc = 0;
+
+    if( nftSocket != -1 )
+        return 2;
+
+    if( options )
+    {
+        if( !(opts = strdup( options )) )
+            return 1;
+        c = opts;
+        while( (o = strsep( &c, "," )) )
+        {
+            if( !*o )
+                continue;
+            if( (v = strchr( o, '=' )) )
+                *v++ = '\0';
+            if( !v || !*v )
+                rc = 2;
+            else if( !strcmp( o, "table" ) )
+            {
+                if( strlen( v ) >= sizeof(nftTable) )
+                    rc = 2;
+                else
+                    strcpy( nftTable, v );
+            }
+            else if( !strcmp( o, "family" ) )
+            {
+                for( i = 0; (i < sizeof(families)/sizeof(families[0])) && strcmp( families[i].name, v ); i++ );
+                if( i < sizeof(families)/sizeof(families[0]) )
+                    nftFamily = families[i].family;
+                else
+                    rc = 2;
+            }
+            else
+                rc = 2;
+        }
+        free( opts );
+        if( rc )
+            return rc;
+    }
+
+    if( !(nftRecv = (char*) malloc( NFT_BUFFER )) )
+        return 1;
+    if( (nftSocket = socket( AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER )) < 0 )
+        return 1;
+    snl.nl_family = AF_NETLINK;
+    if( bind( nftSocket, (struct sockaddr*)&snl, sizeof(snl) ) < 0 )
+    {
+        close( nftSocket );
+        nftSocket = -1;
+        return 1;
+    }
+    // errors do not need to repeat our whole batch
+    setsockopt( nftSocket, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one) );
+    nftSeq = time( NULL );
+
+    return 0;
+}
+
+// Close the netlink socket
+static int nft_close( )
+{
+    if( nftSocket != -1 )
+        close( nftSocket );
+    nftSocket = -1;
+    free( nftBuf );
+    free( nftRecv );
+    free( nftKnown );
+    nftBuf = nftRecv = NULL;
+    nftLen = nftSize = 0;
+    nftKnown = NULL;
+    nftKnownCount = 0;
+    return 0;
+}
+
+// store an IP address prefix in the set of a table, with its value as expiration time
+static int nft_add( struct sockaddr* addr, socklen_t addrlen, u_int8_t masklen, u_int32_t value, u_int16_t table )
+{
+    struct fw_entry e = { addr, addrlen, masklen, value, 0 };
+
+    if( nftSocket == -1 )
+        return 1;
+    nft_commit( NFT_MSG_NEWSETELEM, &e, 1, table );
+    return e.result;
+}
+
+// remove an IP address prefix from the set of a table, error if not found
+static int nft_del( struct sockaddr* addr, socklen_t addrlen, u_int8_t masklen, u_int16_t table )
+{
+    struct fw_entry e = { addr, addrlen, masklen, 0, 0 };
+
+    if( nftSocket == -1 )
+        return 1;
+    nft_commit( NFT_MSG_DELSETELEM, &e, 1, table );
+    return e.result ? 1 : 0;
+}
+
+// Add n entries to the sets of a table in one transaction
+static int nft_add_batch( struct fw_entry* entries, unsigned int n, u_int16_t table )
+{
+    if( nftSocket == -1 )
+        return -1;
+    return nft_commit( NFT_MSG_NEWSETELEM, entries, n, table ) ? -1 : 0;
+}
+
+// Remove n entries from the sets of a table in one transaction. The whole
+// transaction fails if one of them is gone already (expired by the kernel).
+static int nft_del_batch( struct fw_entry* entries, unsigned int n, u_int16_t table )
+{
+    if( nftSocket == -1 )
+        return -1;
+    return nft_commit( NFT_MSG_DELSETELEM, entries, n, table ) ? -1 : 0;
+}
+
+const struct fw_backend fw_nft = {
+    "nft", 1, 1, 0,
+    nft_init, nft_close, nft_add, nft_del, nft_add_batch, nft_del_batch, nft_list, NULL, NULL
+};
+#endif
@@ -0,0 +1,207 @@
+/*
+ Copyright 2013-2025 Alexander Wittig. All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "radix.h"
+
+// node of the trie, holding the bits skipped on the way from its parent
+struct rx_node {
+    struct rx_node* child[2];   // Subtries continuing with a 0 or 1 bit (both or none set)
+    unsigned char key[16];      // Prefix of the node (bits after len are zero)
+    unsigned char len;          // Prefix length in bits
+    unsigned char member;       // Prefix is in the set (always for nodes without children)
+};
+
+struct radix {
+    struct rx_node* root;       // Root of the trie
+    unsigned int count;         // Number of prefixes in the set
+    unsigned int nodes;         // Number of nodes
+};
+
+// get bit i of an address key (counting from the most significant one)
+static unsigned int rx_bit( const unsigned char* key, unsigned int i )
+{
+    return (key[i/8] >> (7 - i%8)) & 1;
+}
+
+// count the leading bits two address keys have in common, up to max
+static unsigned int rx_common( const unsigned char* a, const unsigned char* b, unsigned int max )
+{
+    unsigned int i, n = 0;
+    unsigned char x;
+
+    for( i = 0; (n < max) && (a[i] == b[i]); i++ )
+        n += 8;
+    if( n < max )
+        for( x = a[i] ^ b[i]; !(x & 0x80); x <<= 1 )
+            n++;
+
+    return n < max ? n : max;
+}
+
+// allocate a node for the prefix of len bits of key
+static struct rx_node* rx_node( struct radix* rx, const unsigned char* key, unsigned int len, int member )
+{
+    struct rx_node* n;
+
+    if( !(n = (struct rx_node*) calloc( 1, sizeof(struct rx_node) )) )
+        return NULL;
+    memcpy( n->key, key, (len + 7)/8 );
+    if( len%8 )
+        n->key[len/8] &= 0xff00 >> (len%8);
+    n->len = len;
+    n->member = member;
+    rx->nodes++;
+
+    return n;
+}
+
+// free a node and its subtries, removing their prefixes from the set
+static void rx_drop( struct radix* rx, struct rx_node* n )
+{
+    if( !n )
+        return;
+    rx_drop( rx, n->child[0] );
+    rx_drop( rx, n->child[1] );
+    rx->count -= n->member;
+    rx->nodes--;
+    free( n );
+}
+
+// Create a new, empty set
+struct radix* rx_create( )
+{
+    return (struct radix*) calloc( 1, sizeof(struct radix) );
+}
+
+// Free a set and all its prefixes
+void rx_free( struct radix* rx )
+{
+    if( !rx )
+        return;
+    rx_drop( rx, rx->root );
+    free( rx );
+}
+
+// Add a prefix to the set. Prefixes in the set are always leaves, as anything
+// below them is covered by them anyway, and all other nodes have two children.
+int rx_add( struct radix* rx, const unsigned char addr[16], unsigned int masklen )
+{
+    struct rx_node **link = &rx->root, *n, *m, *b;
+    unsigned int common;
+
+    if( masklen > 128 )
+        masklen = 128;
+
+    while( (n = *link) )
+    {
+        common = rx_common( addr, n->key, masklen < n->len ? masklen : n->len );
+        if( common < n->len )
+            break;
+
+        // the new prefix begins with the prefix of this node
+        if( n->member )
+            return 0;
+        if( masklen == n->len )
+        {
+            // the new prefix covers both subtries
+            rx_drop( rx, n->child[0] );
+            rx_drop( rx, n->child[1] );
+            n->child[0] = n->child[1] = NULL;
+            n->member = 1;
+            rx->count++;
+            return 0;
+        }
+        link = &n->child[rx_bit( addr, n->len )];
+    }
+
+    if( !(m = rx_node( rx, addr, masklen, 1 )) )
+        return -1;
+    rx->count++;
+
+    if( !n )
+        // empty trie
+        *link = m;
+    else if( common == masklen )
+    {
+        // the new prefix covers the whole subtrie
+        rx_drop( rx, n );
+        *link = m;
+    }
+    else
+    {
+        // branch at the first bit the new prefix differs from this node
+        if( !(b = rx_node( rx, addr, common, 0 )) )
+        {
+            rx_drop( rx, m );
+            return -1;
+        }
+        b->child[rx_bit( addr, common )] = m;
+        b->child[rx_bit( n->key, common )] = n;
+        *link = b;
+    }
+
+    return 0;
+}
+
+// Check if a prefix overlaps a prefix in the set
+int rx_match( const struct radix* rx, const unsigned char addr[16], unsigned int masklen )
+{
+    const struct rx_node* n;
+    unsigned int len;
+
+    if( masklen > 128 )
+        masklen = 128;
+
+    for( n = rx->root; n; n = n->child[rx_bit( addr, n->len )] )
+    {
+        len = masklen < n->len ? masklen : n->len;
+        if( rx_common( addr, n->key, len ) < len )
+            return 0;
+        // a prefix of the set contains the address, or the address contains
+        // this subtrie, which always holds a prefix of the set
+        if( n->member || (n->len >= masklen) )
+            return 1;
+    }
+
+    return 0;
+}
+
+// Number of prefixes in the set
+unsigned int rx_count( const struct radix* rx )
+{
+    return rx->count;
+}
+
+// Memory used for the prefixes of the set
+size_t rx_memory( const struct radix* rx )
+{
+    return sizeof(struct radix) + rx->nodes*sizeof(struct rx_node);
+}
@@ -0,0 +1,48 @@
+/*
+ Copyright 2013-2025 Alexander Wittig. All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Set of IPv4 and IPv6 address prefixes (path compressed binary radix trie) */
+
+struct radix;
+
+// Create a new, empty set
+struct radix* rx_create( );
+
+// Free a set and all its prefixes
+void rx_free( struct radix* rx );
+
+// Add the prefix of masklen bits of an address key (see parseAddress) to the
+// set. Prefixes within one already in the set are not added again.
+// Returns non-zero if out of memory.
+int rx_add( struct radix* rx, const unsigned char addr[16], unsigned int masklen );
+
+// Check if the prefix of masklen bits of an address key overlaps a prefix in
+// the set, i.e. it lies within one of them or contains one of them. With a
+// masklen of 128 this checks if the set contains the address.
+int rx_match( const struct radix* rx, const unsigned char addr[16], unsigned int masklen );
+
+// Number of prefixes in the set and memory used for them
+unsigned int rx_count( const struct radix* rx );
+size_t rx_memory( const struct radix* rx );
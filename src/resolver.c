@@ -0,0 +1,418 @@
+/*
+ Copyright 2013-2025 Alexander Wittig. All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+#include "banlib.h"
+#include "resolver.h"
+#include "radix.h"
+
+extern int loglevel;                    // loglevel, defined in main programs
+
+// Most addresses of a host name that are blocked
+#define RS_ADDRS 8
+
+// Most host names waiting for a thread (more are resolved by the caller)
+#define RS_QUEUE 1024
+
+// Most threads
+#define RS_THREADS 32
+
+// Result of a cache lookup for a host name that is not cached
+#define RS_MISS -2
+
+// cached result of resolving a host name
+struct rs_entry {
+    char* name;                 // Host name (NULL if the entry is unused)
+    unsigned int hash;          // Hash of the host name
+    time_t expires;             // Time the entry expires
+    int count;                  // Number of addresses or -1 if the name could not be resolved
+    unsigned char addrs[RS_ADDRS][16];  // Addresses (see parseAddress)
+};
+
+// host name waiting to be resolved and blocked
+struct rs_job {
+    char* name;                 // Host name
+    uint32_t value;             // Value to block its addresses with
+    uint32_t table;             // Table to block its addresses in
+    time_t rt;                  // Time the addresses are blocked for (for logging)
+    int bl;                     // Also block local addresses
+    unsigned int prefix4;       // Prefix length to block IPv4 addresses with
+    unsigned int prefix6;       // Prefix length to block IPv6 addresses with
+    const struct radix* exclude[2]; // Prefixes never to block (NULL if none)
+};
+
+// the thread pool, its queue and the cache
+struct resolver {
+    struct rs_entry* cache;     // Cached results, each host name has one place (by its hash)
+    unsigned int cache_mask;    // Number of cache entries minus one (a power of two)
+    time_t ttl;                 // Time to cache addresses for
+    time_t negttl;              // Time to cache failures for
+    struct rs_job queue[RS_QUEUE];  // Queued host names (ring buffer)
+    unsigned int head;          // Index of the first queued host name
+    unsigned int queued;        // Number of queued host names
+    unsigned int active;        // Number of host names being resolved by the threads
+    unsigned long lookups;      // Statistics: host names looked up
+    unsigned long hits;         // Statistics: host names found in the cache
+    unsigned long failures;     // Statistics: host names that could not be resolved
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_t lock;       // Protects the cache, the queue and the statistics
+    pthread_cond_t work;        // Signalled when a host name was queued or the threads should stop
+    pthread_cond_t idle;        // Signalled when the last queued host name was blocked
+    pthread_t tid[RS_THREADS];  // Threads
+    unsigned int nthreads;      // Number of threads
+    int stop;                   // Threads should stop once the queue is empty
+#endif
+};
+
+#ifdef HAVE_LIBPTHREAD
+#define RS_LOCK(rs) pthread_mutex_lock( &(rs)->lock )
+#define RS_UNLOCK(rs) pthread_mutex_unlock( &(rs)->lock )
+#else
+#define RS_LOCK(rs)
+#define RS_UNLOCK(rs)
+#endif
+
+// hash function for host names (FNV-1a)
+static unsigned int rs_hash( const char* name )
+{
+    unsigned int h = 2166136261u;
+
+    while( *name )
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+
+    return h;
+}
+
+// Look up a host name in the cache and copy its addresses. Returns their
+// number, -1 for a cached failure, or RS_MISS. Must be called with the lock held.
+static int rs_lookup( struct resolver* rs, const char* name, unsigned int hash, unsigned char addrs[][16], time_t now )
+{
+    struct rs_entry* e = &rs->cache[hash & rs->cache_mask];
+
+    if( !e->name || (e->hash != hash) || (e->expires < now) || strcmp( e->name, name ) )
+        return RS_MISS;
+    if( e->count > 0 )
+        memcpy( addrs, e->addrs, e->count*sizeof(e->addrs[0]) );
+
+    return e->count;
+}
+
+// Cache the result of resolving a host name, replacing the entry in its place.
+// Must be called with the lock held.
+static void rs_store( struct resolver* rs, const char* name, unsigned int hash, int count, unsigned char addrs[][16], time_t now )
+{
+    struct rs_entry* e = &rs->cache[hash & rs->cache_mask];
+    char* copy;
+
+    if( !e->name || strcmp( e->name, name ) )
+    {
+        // keep the old entry if there is no memory for the new one
+        if( !(copy = strdup( name )) )
+            return;
+        free( e->name );
+        e->name = copy;
+    }
+    e->hash = hash;
+    e->expires = now + (count < 0 ? rs->negttl : rs->ttl);
+    e->count = count;
+    if( count > 0 )
+        memcpy( e->addrs, addrs, count*sizeof(e->addrs[0]) );
+}
+
+// Block the addresses a host name was resolved to. Returns non-zero if it could
+// not be resolved or one of them could not be blocked.
+static int rs_apply( const struct rs_job* job, int count, unsigned char addrs[][16], int cached )
+{
+    unsigned char prefix[16];
+    unsigned int masklen;
+    char ip[INET6_ADDRSTRLEN + 4];
+    int i, err = 0;
+
+    if( count < 0 )
+    {
+        if( cached && (loglevel >= 1) )
+            syslog( LOG_NOTICE, "Failed to resolve '%s' for blocking (cached)", job->name );
+        return -1;
+    }
+
+    for( i = 0; i < count; i++ )
+    {
+        // the same checks as for numeric addresses in the log
+        memcpy( prefix, addrs[i], 16 );
+        masklen = maskAddress( prefix, job->prefix4, job->prefix6 );
+        if( (job->exclude[0] && rx_match( job->exclude[0], prefix, masklen )) ||
+            (job->exclude[1] && rx_match( job->exclude[1], prefix, masklen )) )
+        {
+            if( loglevel >= 1 )
+                syslog( LOG_NOTICE, "Not blocking '%s' of host '%s' containing excluded addresses.", formatPrefix( prefix, masklen, ip, sizeof(ip) ), job->name );
+            continue;
+        }
+        err += addAddressLong( prefix, masklen, job->value, job->table, job->rt, job->bl );
+    }
+
+    return err;
+}
+
+// Resolve the host name of a job, using the cache, and block its addresses
+static int rs_resolve( struct resolver* rs, const struct rs_job* job )
+{
+    unsigned char addrs[RS_ADDRS][16];
+    unsigned int hash = rs_hash( job->name );
+    time_t now = time( NULL );
+    int count;
+
+    RS_LOCK( rs );
+    count = rs_lookup( rs, job->name, hash, addrs, now );
+    if( count != RS_MISS )
+    {
+        rs->hits++;
+        RS_UNLOCK( rs );
+        return rs_apply( job, count, addrs, 1 );
+    }
+    rs->lookups++;
+    RS_UNLOCK( rs );
+
+    count = resolveHost( job->name, addrs, RS_ADDRS );
+
+    RS_LOCK( rs );
+    if( count < 0 )
+        rs->failures++;
+    rs_store( rs, job->name, hash, count, addrs, time( NULL ) );
+    RS_UNLOCK( rs );
+
+    return rs_apply( job, count, addrs, 0 );
+}
+
+#ifdef HAVE_LIBPTHREAD
+// Resolve queued host names until told to stop
+static void* rs_worker( void* arg )
+{
+    struct resolver* rs = arg;
+    struct rs_job job;
+
+    pthread_mutex_lock( &rs->lock );
+    for( ;; )
+    {
+        while( !rs->queued && !rs->stop )
+            pthread_cond_wait( &rs->work, &rs->lock );
+        if( !rs->queued )
+            break;
+
+        job = rs->queue[rs->head];
+        rs->head = (rs->head + 1) % RS_QUEUE;
+        rs->queued--;
+        rs->active++;
+        pthread_mutex_unlock( &rs->lock );
+
+        // the main thread took it as blocked when it was queued
+        if( rs_resolve( rs, &job ) )
+            fw_report_failure( NULL, job.name, job.table );
+        free( job.name );
+
+        pthread_mutex_lock( &rs->lock );
+        if( !--rs->active && !rs->queued )
+            pthread_cond_broadcast( &rs->idle );
+    }
+    pthread_mutex_unlock( &rs->lock );
+
+    return NULL;
+}
+#endif
+
+// Create a resolver with the given number of threads and cache
+struct resolver* rs_create( unsigned int threads, unsigned int cache_size, time_t ttl, time_t negttl )
+{
+    struct resolver* rs;
+    unsigned int size;
+#ifdef HAVE_LIBPTHREAD
+    sigset_t all, old;
+#endif
+
+    if( !(rs = (struct resolver*) calloc( 1, sizeof(struct resolver) )) )
+        return NULL;
+    for( size = 16; size < cache_size; size *= 2 )
+        ;
+    if( !(rs->cache = (struct rs_entry*) calloc( size, sizeof(struct rs_entry) )) )
+    {
+        free( rs );
+        return NULL;
+    }
+    rs->cache_mask = size - 1;
+    rs->ttl = ttl;
+    rs->negttl = negttl;
+
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_init( &rs->lock, NULL );
+    pthread_cond_init( &rs->work, NULL );
+    pthread_cond_init( &rs->idle, NULL );
+
+    // signals are handled by the main thread only; without threads host names
+    // are resolved by the caller
+    sigfillset( &all );
+    pthread_sigmask( SIG_BLOCK, &all, &old );
+    for( ; (rs->nthreads < threads) && (rs->nthreads < RS_THREADS); rs->nthreads++ )
+        if( pthread_create( &rs->tid[rs->nthreads], NULL, rs_worker, rs ) != 0 )
+            break;
+    pthread_sigmask( SIG_SETMASK, &old, NULL );
+#endif
+
+    return rs;
+}
+
+// Wait for all queued host names, stop the threads and free the resolver
+void rs_free( struct resolver* rs )
+{
+    unsigned int i;
+
+    if( !rs )
+        return;
+
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_lock( &rs->lock );
+    rs->stop = 1;
+    pthread_cond_broadcast( &rs->work );
+    pthread_mutex_unlock( &rs->lock );
+    for( i = 0; i < rs->nthreads; i++ )
+        pthread_join( rs->tid[i], NULL );
+    pthread_cond_destroy( &rs->work );
+    pthread_cond_destroy( &rs->idle );
+    pthread_mutex_destroy( &rs->lock );
+#endif
+
+    for( i = 0; i <= rs->cache_mask; i++ )
+        free( rs->cache[i].name );
+    free( rs->cache );
+    free( rs );
+}
+
+// Wait for the threads to block all queued host names
+void rs_wait( struct resolver* rs )
+{
+#ifdef HAVE_LIBPTHREAD
+    if( !rs )
+        return;
+
+    pthread_mutex_lock( &rs->lock );
+    while( rs->queued || rs->active )
+        pthread_cond_wait( &rs->idle, &rs->lock );
+    pthread_mutex_unlock( &rs->lock );
+#else
+    (void)rs;
+#endif
+}
+
+// Block all addresses of host in table, queueing it for a thread if it is not cached
+int rs_block( struct resolver* rs, const char* host, uint32_t value, uint32_t table, time_t rt, int bl,
+              unsigned int prefix4, unsigned int prefix6, const struct radix* exclude, const struct radix* gexclude )
+{
+    struct rs_job job = { (char*)host, value, table, rt, bl, prefix4, prefix6, { exclude, gexclude } };
+    unsigned char addrs[RS_ADDRS][16];
+    int count;
+
+    RS_LOCK( rs );
+    count = rs_lookup( rs, host, rs_hash( host ), addrs, time( NULL ) );
+    if( count != RS_MISS )
+    {
+        rs->hits++;
+        RS_UNLOCK( rs );
+        return rs_apply( &job, count, addrs, 1 ) ? -1 : 0;
+    }
+
+#ifdef HAVE_LIBPTHREAD
+    // hand it to a thread unless there is none or all of them are busy for a while
+    if( rs->nthreads && (rs->queued < RS_QUEUE) && (job.name = strdup( host )) )
+    {
+        rs->queue[(rs->head + rs->queued) % RS_QUEUE] = job;
+        rs->queued++;
+        pthread_cond_signal( &rs->work );
+        RS_UNLOCK( rs );
+        return 0;
+    }
+    job.name = (char*)host;
+#endif
+    RS_UNLOCK( rs );
+
+    return rs_resolve( rs, &job ) ? -1 : 0;
+}
+
+// Statistics
+unsigned long rs_lookups( struct resolver* rs )
+{
+    unsigned long n;
+
+    RS_LOCK( rs );
+    n = rs->lookups;
+    RS_UNLOCK( rs );
+
+    return n;
+}
+
+unsigned long rs_hits( struct resolver* rs )
+{
+    unsigned long n;
+
+    RS_LOCK( rs );
+    n = rs->hits;
+    RS_UNLOCK( rs );
+
+    return n;
+}
+
+unsigned long rs_failures( struct resolver* rs )
+{
+    unsigned long n;
+
+    RS_LOCK( rs );
+    n = rs->failures;
+    RS_UNLOCK( rs );
+
+    return n;
+}
+
+unsigned int rs_pending( struct resolver* rs )
+{
+    unsigned int n;
+
+    RS_LOCK( rs );
+    n = rs->queued + rs->active;
+    RS_UNLOCK( rs );
+
+    return n;
+}
@@ -0,0 +1,56 @@
+/*
+ Copyright 2013-2025 Alexander Wittig. All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Resolve host names for blocking in a pool of threads, caching the results */
+
+struct resolver;
+struct radix;
+
+// Create a resolver with the given number of threads (0 resolves host names in
+// the calling thread). Up to cache_size results are cached, addresses for ttl
+// and failures for negttl seconds.
+struct resolver* rs_create( unsigned int threads, unsigned int cache_size, time_t ttl, time_t negttl );
+
+// Wait until all queued host names are blocked, stop the threads and free the resolver
+void rs_free( struct resolver* rs );
+
+// Wait until all queued host names are blocked
+void rs_wait( struct resolver* rs );
+
+// Block all addresses of host in table (see addAddressLong), each with a prefix
+// of prefix4 or prefix6 bits (see maskAddress), except for prefixes overlapping
+// one of the excluded sets (either may be NULL, they must not change before
+// rs_wait returns). Cached addresses are blocked right away, otherwise the host
+// name is queued and one of the threads blocks its addresses once it is
+// resolved. Returns 0 if the host was blocked or queued, and -1 if it could
+// not be resolved or one of its addresses could not be blocked.
+int rs_block( struct resolver* rs, const char* host, uint32_t value, uint32_t table, time_t rt, int bl,
+              unsigned int prefix4, unsigned int prefix6, const struct radix* exclude, const struct radix* gexclude );
+
+// Statistics: host names looked up, found in the cache, failed to resolve, and waiting to be resolved
+unsigned long rs_lookups( struct resolver* rs );
+unsigned long rs_hits( struct resolver* rs );
+unsigned long rs_failures( struct resolver* rs );
+unsigned int rs_pending( struct resolver* rs );
@@ -0,0 +1,495 @@
+/*
+ Copyright 2013-2025 Alexander Wittig. All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/queue.h>
+#ifdef HAVE_KQUEUE
+#include <sys/event.h>
+#include <sys/time.h>
+#elif defined(HAVE_INOTIFY_INIT1)
+#include <sys/inotify.h>
+#endif
+
+#include "linereader.h"
+#include "tail.h"
+
+// Longest time to wait for files to change before checking them anyway (in
+// seconds). This also bounds how long it takes to notice a new file after
+// rotation, for which no event is delivered.
+static const int TL_INTERVAL = 1;
+
+// a followed file
+struct tailfile {
+    char* path;                 // Path of the file
+    int fd;                     // Open file or -1 if it does not exist (yet)
+    dev_t dev;                  // Device of the open file
+    ino_t ino;                  // Inode of the open file
+    struct linereader* lr;      // Input buffer
+    unsigned int round;         // Last tl_begin round in which the file was added
+#ifdef HAVE_INOTIFY_INIT1
+    int wd;                     // Inotify watch or -1
+#endif
+    STAILQ_ENTRY(tailfile) next;    // Singly linked list entry
+};
+
+STAILQ_HEAD( _tailfiles, tailfile );
+
+// offset saved by tl_save for a file
+struct offset {
+    char* path;                 // Path of the file
+    dev_t dev;                  // Device of the file
+    ino_t ino;                  // Inode of the file
+    off_t offset;               // Offset up to which lines were handed out
+    STAILQ_ENTRY(offset) next;  // Singly linked list entry
+};
+
+STAILQ_HEAD( _offsets, offset );
+
+// the set of followed files
+struct tail {
+    struct _tailfiles files;    // Followed files
+    struct _offsets offsets;    // Saved offsets of files not added yet
+    unsigned int nfiles;        // Number of followed files
+    struct tailfile* last;      // File read from last
+    size_t maxline;             // Maximum line length
+    unsigned int round;         // Current tl_begin round
+    int events;                 // Kqueue or inotify descriptor (-1 if polling)
+    unsigned long rotations;    // Statistics: rotations detected
+    unsigned long truncations;  // Statistics: truncations detected
+    unsigned long truncated;    // Statistics: lines cut off in files no longer followed
+};
+
+// Watch an open file for changes
+static void tl_watch( struct tail* t, struct tailfile* f )
+{
+#ifdef HAVE_KQUEUE
+    struct kevent ev;
+
+    // the event is removed by the kernel when the file is closed
+    EV_SET( &ev, f->fd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+            NOTE_WRITE | NOTE_EXTEND | NOTE_DELETE | NOTE_RENAME | NOTE_ATTRIB, 0, f );
+    if( t->events >= 0 )
+        kevent( t->events, &ev, 1, NULL, 0, NULL );
+#elif defined(HAVE_INOTIFY_INIT1)
+    if( t->events >= 0 && f->wd < 0 )
+        f->wd = inotify_add_watch( t->events, f->path, IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF | IN_ATTRIB );
+#endif
+}
+
+// Stop watching a file (before closing it)
+static void tl_unwatch( struct tail* t, struct tailfile* f )
+{
+#ifdef HAVE_INOTIFY_INIT1
+    if( t->events >= 0 && f->wd >= 0 )
+        inotify_rm_watch( t->events, f->wd );
+    f->wd = -1;
+#endif
+}
+
+// Try to open the file, starting to read at offset (or the end of the file if
+// offset is negative). Returns non-zero if the file does not exist.
+static int tl_open( struct tail* t, struct tailfile* f, off_t offset )
+{
+    struct stat sb;
+
+    f->fd = open( f->path, O_RDONLY | O_NONBLOCK );
+    if( f->fd < 0 )
+        return 1;
+    if( fstat( f->fd, &sb ) )
+    {
+        close( f->fd );
+        f->fd = -1;
+        return 1;
+    }
+    f->dev = sb.st_dev;
+    f->ino = sb.st_ino;
+
+    // a file shorter than the offset was truncated in the meantime
+    if( (offset < 0) || (offset > sb.st_size) )
+        offset = offset < 0 ? sb.st_size : 0;
+    lseek( f->fd, offset, SEEK_SET );
+    lr_reset( f->lr, f->fd, offset );
+    tl_watch( t, f );
+
+    return 0;
+}
+
+// Close a file (e.g. after it was rotated)
+static void tl_close( struct tail* t, struct tailfile* f )
+{
+    if( f->fd < 0 ) return;
+    tl_unwatch( t, f );
+    close( f->fd );
+    f->fd = -1;
+}
+
+// Check if everything in a file was read and handed out
+static int tl_drained( struct tailfile* f )
+{
+    struct stat sb;
+
+    return !lr_buffered( f->lr ) && !fstat( f->fd, &sb ) && (lseek( f->fd, 0, SEEK_CUR ) >= sb.st_size);
+}
+
+// Look for rotation and truncation of a file, or for it to appear
+static void tl_check( struct tail* t, struct tailfile* f )
+{
+    struct stat sb;
+
+    // a file that did not exist is new, so it is read from the start
+    if( f->fd < 0 )
+    {
+        tl_open( t, f, 0 );
+        return;
+    }
+
+    // the path now refers to a different file (or none at all): finish the
+    // old one before switching to the new one (newsyslog, logrotate)
+    if( stat( f->path, &sb ) || (sb.st_dev != f->dev) || (sb.st_ino != f->ino) )
+    {
+        if( !tl_drained( f ) )
+            return;
+        // a last line without newline is handed out before switching
+        if( lr_finish( f->lr ) )
+            return;
+        tl_close( t, f );
+        t->rotations++;
+        tl_open( t, f, 0 );
+        return;
+    }
+
+    // the file is shorter than what we read (logrotate copytruncate): start over
+    if( sb.st_size < lseek( f->fd, 0, SEEK_CUR ) )
+    {
+        t->truncations++;
+        lseek( f->fd, 0, SEEK_SET );
+        lr_reset( f->lr, f->fd, 0 );
+    }
+}
+
+// Wait until a file changes, but at most TL_INTERVAL seconds.
+// Returns non-zero if interrupted by a signal.
+static int tl_wait( struct tail* t )
+{
+#ifdef HAVE_KQUEUE
+    struct kevent ev;
+    struct timespec ts = { TL_INTERVAL, 0 };
+
+    if( t->events >= 0 )
+        return kevent( t->events, NULL, 0, &ev, 1, &ts ) < 0;
+#elif defined(HAVE_INOTIFY_INIT1)
+    struct pollfd pfd;
+    char buf[4096];
+    int rc;
+
+    if( t->events >= 0 )
+    {
+        pfd.fd = t->events;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        rc = poll( &pfd, 1, TL_INTERVAL*1000 );
+        // the events themselves do not matter, all files are checked anyway
+        while( (rc > 0) && (read( t->events, buf, sizeof(buf) ) > 0) );
+        return rc < 0;
+    }
+#endif
+
+    // no change notification available, just look again later
+    return poll( NULL, 0, TL_INTERVAL*1000 ) < 0;
+}
+
+struct tail* tl_create( size_t maxline )
+{
+    struct tail* t;
+
+    t = (struct tail*) calloc( 1, sizeof(struct tail) );
+    if( !t )
+        return NULL;
+
+    STAILQ_INIT( &t->files );
+    STAILQ_INIT( &t->offsets );
+    t->maxline = maxline;
+#ifdef HAVE_KQUEUE
+    t->events = kqueue( );
+#elif defined(HAVE_INOTIFY_INIT1)
+    t->events = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+#else
+    t->events = -1;
+#endif
+
+    return t;
+}
+
+// Stop following a file and free it
+static void tl_remove( struct tail* t, struct tailfile* f )
+{
+    tl_close( t, f );
+    t->truncated += lr_truncated( f->lr );
+    lr_free( f->lr );
+    free( f->path );
+    free( f );
+}
+
+void tl_free( struct tail* t )
+{
+    struct tailfile* f;
+    struct offset* o;
+
+    if( !t ) return;
+
+    while( !STAILQ_EMPTY( &t->files ) )
+    {
+        f = STAILQ_FIRST( &t->files );
+        STAILQ_REMOVE_HEAD( &t->files, next );
+        tl_remove( t, f );
+    }
+    while( !STAILQ_EMPTY( &t->offsets ) )
+    {
+        o = STAILQ_FIRST( &t->offsets );
+        STAILQ_REMOVE_HEAD( &t->offsets, next );
+        free( o->path );
+        free( o );
+    }
+    if( t->events >= 0 )
+        close( t->events );
+    free( t );
+}
+
+int tl_limit( struct tail* t, size_t maxline )
+{
+    struct tailfile* f;
+
+    t->maxline = maxline;
+    STAILQ_FOREACH( f, &t->files, next )
+        if( lr_limit( f->lr, maxline ) )
+            return 1;
+
+    return 0;
+}
+
+int tl_load( struct tail* t, const char* file )
+{
+    FILE* fp;
+    char path[1024];
+    unsigned long long dev, ino;
+    long long offset;
+    struct offset* o;
+
+    if( !(fp = fopen( file, "r" )) )
+        return 1;
+
+    // one file per line: device inode offset path
+    while( fscanf( fp, "%llu %llu %lld %1023[^\n]", &dev, &ino, &offset, path ) == 4 )
+    {
+        if( !(o = (struct offset*) malloc( sizeof(struct offset) )) || !(o->path = strdup( path )) )
+        {
+            free( o );
+            break;
+        }
+        o->dev = dev;
+        o->ino = ino;
+        o->offset = offset;
+        STAILQ_INSERT_TAIL( &t->offsets, o, next );
+    }
+
+    fclose( fp );
+    return 0;
+}
+
+int tl_save( const struct tail* t, const char* file )
+{
+    FILE* fp;
+    struct tailfile* f;
+
+    if( !(fp = fopen( file, "w" )) )
+        return 1;
+
+    STAILQ_FOREACH( f, &t->files, next )
+        if( f->fd >= 0 )
+            fprintf( fp, "%llu %llu %lld %s\n", (unsigned long long)f->dev, (unsigned long long)f->ino,
+                     (long long)lr_offset( f->lr ), f->path );
+
+    fchmod( fileno( fp ), S_IWUSR|S_IRUSR|S_IRGRP|S_IROTH );
+    return fclose( fp ) != 0;
+}
+
+void tl_begin( struct tail* t )
+{
+    t->round++;
+}
+
+int tl_add( struct tail* t, const char* path )
+{
+    struct tailfile* f;
+    struct offset* o;
+    off_t offset = -1;
+    struct stat sb;
+
+    // files followed already keep their position
+    STAILQ_FOREACH( f, &t->files, next )
+        if( strcmp( f->path, path ) == 0 )
+        {
+            f->round = t->round;
+            return f->fd < 0;
+        }
+
+    if( !(f = (struct tailfile*) calloc( 1, sizeof(struct tailfile) )) )
+        return -1;
+    f->path = strdup( path );
+    f->lr = lr_create( -1, t->maxline );
+    if( !f->path || !f->lr )
+    {
+        lr_free( f->lr );
+        free( f->path );
+        free( f );
+        return -1;
+    }
+    lr_follow( f->lr );
+    f->fd = -1;
+    f->round = t->round;
+#ifdef HAVE_INOTIFY_INIT1
+    f->wd = -1;
+#endif
+    STAILQ_INSERT_TAIL( &t->files, f, next );
+    t->nfiles++;
+
+    // resume where we stopped if it is still the same file, otherwise the
+    // file was rotated in the meantime and all of it is new
+    STAILQ_FOREACH( o, &t->offsets, next )
+        if( strcmp( o->path, path ) == 0 )
+        {
+            offset = (stat( path, &sb ) == 0) && (sb.st_dev == o->dev) && (sb.st_ino == o->ino) ? o->offset : 0;
+            STAILQ_REMOVE( &t->offsets, o, offset, next );
+            free( o->path );
+            free( o );
+            break;
+        }
+
+    // without a saved offset only new lines are of interest
+    return tl_open( t, f, offset );
+}
+
+void tl_prune( struct tail* t )
+{
+    struct tailfile *f, *n;
+
+    for( f = STAILQ_FIRST( &t->files ); f; f = n )
+    {
+        n = STAILQ_NEXT( f, next );
+        if( f->round != t->round )
+        {
+            STAILQ_REMOVE( &t->files, f, tailfile, next );
+            tl_remove( t, f );
+            t->nfiles--;
+        }
+    }
+    t->last = NULL;
+}
+
+ssize_t tl_read( struct tail* t, struct lr_line* batch, size_t max )
+{
+    struct tailfile* f;
+    ssize_t n;
+    unsigned int i;
+    int pass;
+
+    for( pass = 0; pass < 2; pass++ )
+    {
+        // take turns, starting with the file after the one read last
+        f = t->last;
+        for( i = 0; i < t->nfiles; i++ )
+        {
+            f = (f && STAILQ_NEXT( f, next )) ? STAILQ_NEXT( f, next ) : STAILQ_FIRST( &t->files );
+            if( (f->fd >= 0) && ((n = lr_read( f->lr, batch, max )) > 0) )
+            {
+                t->last = f;
+                return n;
+            }
+        }
+
+        // nothing to read, so this is a good time to look for rotated or truncated files
+        STAILQ_FOREACH( f, &t->files, next )
+            tl_check( t, f );
+
+        if( (pass == 0) && tl_wait( t ) )
+        {
+            errno = EINTR;
+            return -1;
+        }
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+int tl_ready( struct tail* t )
+{
+    struct tailfile* f;
+    struct stat sb;
+
+    STAILQ_FOREACH( f, &t->files, next )
+        if( (f->fd >= 0) && (lr_buffered( f->lr ) ||
+            (!fstat( f->fd, &sb ) && (lseek( f->fd, 0, SEEK_CUR ) < sb.st_size))) )
+            return 1;
+
+    return 0;
+}
+
+unsigned int tl_count( const struct tail* t )
+{
+    return t->nfiles;
+}
+
+unsigned long tl_rotations( const struct tail* t )
+{
+    return t->rotations;
+}
+
+unsigned long tl_truncations( const struct tail* t )
+{
+    return t->truncations;
+}
+
+unsigned long tl_truncated( const struct tail* t )
+{
+    struct tailfile* f;
+    unsigned long n = t->truncated;
+
+    STAILQ_FOREACH( f, &t->files, next )
+        n += lr_truncated( f->lr );
+
+    return n;
+}
@@ -0,0 +1,69 @@
+/*
+ Copyright 2013-2025 Alexander Wittig. All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Follow a set of growing log files across rotation and truncation */
+
+struct tail;
+
+// Create an empty set of files for lines of up to maxline characters
+struct tail* tl_create( size_t maxline );
+
+// Stop following all files and free the set
+void tl_free( struct tail* t );
+
+// Change the maximum line length of all files
+int tl_limit( struct tail* t, size_t maxline );
+
+// Read the offsets saved by tl_save. Files added afterwards resume from there.
+int tl_load( struct tail* t, const char* file );
+
+// Save the offset of each file up to which all lines were handed out
+int tl_save( const struct tail* t, const char* file );
+
+// Start a new list of files. Files not added again before tl_prune is
+// called are no longer followed, all others keep their state.
+void tl_begin( struct tail* t );
+
+// Follow the file at path. Returns 0 on success, 1 if the file cannot be
+// opened yet (it is followed anyway), and -1 if out of memory.
+int tl_add( struct tail* t, const char* path );
+
+// Stop following files that were not added since tl_begin
+void tl_prune( struct tail* t );
+
+// Fill batch with up to max lines from one of the files. If none has a
+// complete line, wait for one to change for a while. Returns the number of
+// lines or -1 with errno EAGAIN if nothing arrived in time and EINTR if the
+// wait was interrupted by a signal.
+ssize_t tl_read( struct tail* t, struct lr_line* batch, size_t max );
+
+// Check if tl_read would return lines without waiting
+int tl_ready( struct tail* t );
+
+// Statistics: number of files, rotations and truncations detected, lines cut off
+unsigned int tl_count( const struct tail* t );
+unsigned long tl_rotations( const struct tail* t );
+unsigned long tl_truncations( const struct tail* t );
+unsigned long tl_truncated( const struct tail* t );
@@ -0,0 +1,82 @@
+#!/bin/sh
+#
+# Measure the cost per hit of banhammer for growing watch lists
+#
+# Usage: tools/bench.sh [banhammer] [lines] [hosts ...]
+#   banhammer  -  binary to run (default: ./banhammer)
+#   lines      -  minimum number of input lines per run (default: 500000)
+#   hosts      -  numbers of distinct hosts on the watch list
+#                 (default: 10 1000 100000 1000000)
+#
+# Every run feeds its lines, spread evenly over the hosts, through one
+# pattern. A run has at least lines lines, and at least two per host, so every
+# host is watched and also hit again once it is. No host reaches the block
+# count (65000 hits) as long as lines/hosts stays below it, so the runs only
+# differ in the size of the watch list.
+#
+# Each run is repeated with as many lines that no pattern matches. Its time,
+# spent on starting up, reading and rejecting lines, is subtracted, so the
+# cost per hit is that of matching, extracting and watching the host only.
+# The in-memory firewall simulation is used, so no root privileges are
+# needed and no table is touched.
+#
+
+BANHAMMER="${1:-./banhammer}"
+LINES="${2:-500000}"
+[ $# -gt 2 ] && shift 2 || shift $#
+HOSTS="${*:-10 1000 100000 1000000}"
+
+if [ ! -x "$BANHAMMER" ]; then
+    echo "Error: $BANHAMMER not found or not executable"
+    exit 1
+fi
+
+# seconds since the epoch, with fractions where date supports them
+now( ) {
+    date +%s.%N | sed 's/\.N$//'
+}
+
+# write n lines to a file, for host i%h as address 10.x.y.z, or that do not match if h is 0
+lines( ) {
+    awk -v n="$1" -v h="$2" 'BEGIN {
+        for( i = 0; i < n; i++ ) {
+            k = h ? i % h : i
+            if( h )
+                printf "Oct 17 00:00:00 bench sshd[%d]: Invalid user admin from 10.%d.%d.%d port 22\n", \
+                       i % 99991, int(k/65536) % 256, int(k/256) % 256, k % 256
+            else
+                printf "Oct 17 00:00:00 bench sshd[%d]: Accepted publickey for admin from 10.%d.%d.%d port 22\n", \
+                       i % 99991, int(k/65536) % 256, int(k/256) % 256, k % 256
+        }
+    }' > "$3"
+}
+
+# print the seconds it takes banhammer to read a file
+run( ) {
+    START=`now`
+    if ! BANHAMMER_FIREWALL=sim "$BANHAMMER" -q -q -f "$TMP/bench.conf" < "$1" > /dev/null; then
+        echo "Error: $BANHAMMER failed" >&2
+        exit 1
+    fi
+    END=`now`
+    awk -v s="$START" -v e="$END" 'BEGIN { print e-s }'
+}
+
+TMP=`mktemp -d -t banhammer-bench.XXXXXX` || exit 1
+trap 'rm -rf "$TMP"' EXIT INT TERM
+
+cat > "$TMP/bench.conf" <<CONF
+[table=1, within=86400, count=65000, reset=86400]
+sshd\[[0-9]+\]: Invalid user [a-z]+ from ([0-9.]+) port
+CONF
+
+echo "hosts     lines     seconds   baseline  us/hit"
+for H in $HOSTS; do
+    N=$(( LINES > 2*H ? LINES : 2*H ))
+    lines "$N" "$H" "$TMP/bench.log"
+    lines "$N" 0 "$TMP/base.log"
+
+    T=`run "$TMP/bench.log"` || exit 1
+    B=`run "$TMP/base.log"` || exit 1
+    awk -v h="$H" -v n="$N" -v t="$T" -v b="$B" 'BEGIN { printf "%-9d %-9d %-9.2f %-9.2f %.3f\n", h, n, t, b, 1e6*(t-b)/n }'
+done